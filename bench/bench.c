@@ -0,0 +1,326 @@
+/*
+ *      bench.c:
+ *      Microbenchmarks for the hot paths, built for the host by
+ *      make bench against a wiringPi shim. Every input is generated from
+ *      a fixed seed so runs are comparable, and results go to stdout as
+ *      JSON for tracking across releases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commands.h"
+#include "control.h"
+#include "dht22.h"
+#include "history.h"
+#include "log.h"
+#include "render.h"
+#include "rules.h"
+#include "thermostat.h"
+
+#define REPETITIONS 7
+#define TRACES 64
+#define MAXTIMINGS 85
+#define BENCHZONES 4
+
+// what main.c provides in the daemon
+struct zone zones[MAXZONES];
+int numZones = 0;
+static unsigned long stateVersion = 1;
+
+unsigned long state_version(void)
+{
+	return stateVersion;
+}
+
+void state_changed(void)
+{
+	stateVersion++;
+}
+
+// keeps results alive so the compiler can't drop the work
+static volatile unsigned long sink;
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// run fn for iterations per repetition, print one JSON result
+static void run(const char *name, void (*fn)(unsigned long i), unsigned long iterations, int *first)
+{
+	double perOp[REPETITIONS];
+	unsigned long i;
+	uint64_t start;
+	int r;
+
+	// one untimed pass to warm caches
+	for(i = 0; i < iterations / 10 + 1; i++)
+		fn(i);
+
+	for(r = 0; r < REPETITIONS; r++)
+	{
+		start = now_ns();
+		for(i = 0; i < iterations; i++)
+			fn(i);
+		perOp[r] = (double)(now_ns() - start) / iterations;
+	}
+	qsort(perOp, REPETITIONS, sizeof(double), compare_double);
+
+	printf("%s\n    {\"name\":\"%s\",\"iterations\":%lu,\"repetitions\":%d,\"ns_per_op_median\":%.1f,\"ns_per_op_min\":%.1f}",
+		*first ? "" : ",", name, iterations, REPETITIONS, perOp[REPETITIONS / 2], perOp[0]);
+	*first = 0;
+}
+
+// DHT22 pulse timings as the capture loop records them: the response
+// preamble, then a ~50us low and a 26-28us (0) or 70us (1) high per bit
+static uint8_t traces[TRACES][MAXTIMINGS];
+static int traceLen[TRACES];
+static int traceTemp[TRACES], traceHum[TRACES];
+
+static void make_traces(void)
+{
+	int n, i, j, bit;
+	uint8_t dat[5];
+
+	for(n = 0; n < TRACES; n++)
+	{
+		int t = (int)(next_random() % 500) - 100;
+		int h = 200 + next_random() % 700;
+
+		dat[0] = h >> 8;
+		dat[1] = h & 0xFF;
+		dat[2] = (t < 0 ? (-t >> 8) | 0x80 : t >> 8);
+		dat[3] = (t < 0 ? -t : t) & 0xFF;
+		dat[4] = dat[0] + dat[1] + dat[2] + dat[3];
+		traceTemp[n] = t;
+		traceHum[n] = h;
+
+		i = 0;
+		for(j = 0; j < 3; j++)
+			traces[n][i++] = 30 + next_random() % 8;
+		for(j = 0; j < 40; j++)
+		{
+			bit = (dat[j / 8] >> (7 - j % 8)) & 1;
+			traces[n][i++] = 7 + next_random() % 4;
+			traces[n][i++] = bit ? 22 + next_random() % 10 : 5 + next_random() % 6;
+		}
+		traceLen[n] = i;
+	}
+}
+
+static void bench_dht22_decode(unsigned long i)
+{
+	int t, h;
+
+	sink += dht22_decode(traces[i % TRACES], traceLen[i % TRACES], DHT22THRESHOLD, &t, &h);
+}
+
+static struct dht22_cal cal;
+
+// one full window update and 2-means pass per read
+static void bench_dht22_calibrate(unsigned long i)
+{
+	dht22_cal_add(&cal, traces[i % TRACES], traceLen[i % TRACES]);
+	sink += cal.threshold;
+}
+
+static char page[64 * 1024];
+
+static void bench_render_html(unsigned long i)
+{
+	sink += render_html(i % numZones, page, sizeof(page));
+}
+
+static void bench_render_json(unsigned long i)
+{
+	sink += render_json(page, sizeof(page), i);
+}
+
+// the keys and values the web form posts, through iterate_post's setter
+static const char *form[][3] =
+{
+	{ "hvacmode", "heat", "ac" },
+	{ "fanmode", "auto", "on" },
+	{ "hightemp", "72.5", "73" },
+	{ "cooltemp", "68", "69.5" },
+	{ "offsetvalue", "0", "-1.5" },
+};
+
+static void bench_form_parse(unsigned long i)
+{
+	int k = i % 5;
+
+	sink += settings_apply(i % numZones, form[k][0], form[k][1 + (i / 5) % 2], "bench");
+}
+
+static void no_output(struct zone *z, int relay, int on, uint64_t now)
+{
+}
+
+static uint64_t controlNow;
+
+// temperatures wander across the setpoint so relays switch now and then
+static void bench_control_step(unsigned long i)
+{
+	if(i % 16 == 0)
+		zones[i / 16 % numZones].temperature = 200 + next_random() % 60;
+	controlNow += 100;
+	control_step(controlNow);
+}
+
+// one sample every 3s per zone, like the sensor interval
+static uint32_t historyTime = 1500000000;
+
+static void bench_history_add(unsigned long i)
+{
+	if(i % numZones == 0)
+		historyTime += 3;
+	history_add(i % numZones, historyTime, 215, 450, i & 7, i & 1);
+}
+
+static struct history_sample window[1200];
+
+// an hour of samples from somewhere in a full ring
+static void bench_history_query(unsigned long i)
+{
+	uint32_t from = historyTime - 3 * HISTORYSIZE + 3600 + (i % 64) * 60;
+
+	sink += history_query(i % numZones, from, from + 3600, window, 1200);
+}
+
+#define BENCHRULES 64
+
+static uint64_t rulesNow;
+
+// a sample every 3s against a zone's whole rule list
+static void bench_rules_sample(unsigned long i)
+{
+	if(i % numZones == 0)
+		rulesNow += 3000;
+	zones[i % numZones].temperature = 200 + next_random() % 60;
+	rules_sample(i % numZones, (i & 15) != 0, rulesNow);
+}
+
+int main(int argc, char *argv[])
+{
+	int t, h;
+	int i, first = 1;
+
+	log_init("stdout", LVL_ERROR);
+	if(!render_load_template("main.html"))
+	{
+		fprintf(stderr, "run from the source directory, main.html is needed\n");
+		return 1;
+	}
+
+	numZones = BENCHZONES;
+	for(i = 0; i < numZones; i++)
+	{
+		snprintf(zones[i].name, sizeof(zones[i].name), "zone%d", i);
+		zones[i].hvacMode = HEAT;
+		zones[i].fanMode = AUTO;
+		zones[i].heatTemp = 720;
+		zones[i].coolTemp = 760;
+		zones[i].temperature = 215;
+		zones[i].humidity = 450;
+		zones[i].sensorReady = 1;
+		memset(zones[i].relays, 0, sizeof(zones[i].relays));
+	}
+
+	// a decoder that gets the traces wrong makes its timing meaningless
+	make_traces();
+	for(i = 0; i < TRACES; i++)
+	{
+		if(!dht22_decode(traces[i], traceLen[i], DHT22THRESHOLD, &t, &h) || t != traceTemp[i] || h != traceHum[i])
+		{
+			fprintf(stderr, "dht22_decode failed on trace %d\n", i);
+			return 1;
+		}
+	}
+
+	// a board looping twice as fast doubles every count, past the fixed
+	// threshold; calibration has to find the new split
+	dht22_cal_init(&cal);
+	for(i = 0; i < TRACES; i++)
+	{
+		uint8_t fast[MAXTIMINGS];
+		int j;
+
+		for(j = 0; j < traceLen[i]; j++)
+			fast[j] = traces[i][j] * 2;
+		dht22_cal_add(&cal, fast, traceLen[i]);
+		if(i >= DHT22WINDOW && (!dht22_decode(fast, traceLen[i], cal.threshold, &t, &h) || t != traceTemp[i] || h != traceHum[i]))
+		{
+			fprintf(stderr, "dht22 calibration failed on trace %d, threshold %d\n", i, cal.threshold);
+			return 1;
+		}
+	}
+	dht22_cal_init(&cal);
+
+	control_init(0, no_output);
+
+	// a mix of every condition, so each sample walks the full list
+	for(i = 0; i < BENCHRULES; i++)
+	{
+		static const char *conditions[] =
+		{
+			"temperature > %d.5", "temperature < %dC", "humidity > %d", "no_reading for %dm",
+			"heating rise < %d.5F for 10m", "cooling for %dm"
+		};
+		char condition[48], rule[96];
+
+		snprintf(condition, sizeof(condition), conditions[i % 6], 20 + i);
+		snprintf(rule, sizeof(rule), "*: %s -> log", condition);
+		rules_add(rule, "bench", i + 1, 0);
+	}
+	if(rules_count(numZones - 1) != BENCHRULES)
+	{
+		fprintf(stderr, "rules_add rejected a rule\n");
+		return 1;
+	}
+
+	printf("{\"suite\":\"thermostat\",\"version\":1,\"compiler\":\"%s\",\"results\":[", __VERSION__);
+	run("dht22_decode", bench_dht22_decode, 1000000, &first);
+	run("dht22_calibrate", bench_dht22_calibrate, 100000, &first);
+	run("render_html", bench_render_html, 100000, &first);
+	run("render_json", bench_render_json, 100000, &first);
+	run("form_parse", bench_form_parse, 200000, &first);
+	run("control_step", bench_control_step, 1000000, &first);
+	run("history_add", bench_history_add, HISTORYSIZE * BENCHZONES * 2, &first);
+	run("history_query", bench_history_query, 100000, &first);
+	run("rules_sample", bench_rules_sample, 1000000, &first);
+	printf("\n]}\n");
+
+	// an empty window would time nothing
+	if(history_query(0, historyTime - 3600, historyTime, window, 1200) < 1000)
+	{
+		fprintf(stderr, "history_query found too few samples\n");
+		return 1;
+	}
+
+	log_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ *      fleetsim.c:
+ *      Loopback check of the telemetry aggregator, built by make fleetsim.
+ *      Starts thermostat -a on a local port and plays thousands of
+ *      simulated thermostats at it, with skipped sequence numbers and
+ *      restarts that come back from a different source port with a new
+ *      boot id, followed by a straggler from the boot before. The fleet is
+ *      then read back as JSON from the aggregator's prompt, and every
+ *      sender, loss, late datagram and restart has to be accounted for,
+ *      with no sender counted twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "telemetry.h"
+#include "thermostat.h"
+
+#define SENDERS 3000
+#define ROUNDS 6
+// sockets the senders share, a restart moves a sender to another
+#define POOL 64
+// datagrams between short pauses, so loopback buffers keep up
+#define BURST 256
+#define MAXJSON (4 << 20)
+
+// what main.c provides in the daemon, telemetry.c links against it
+struct zone zones[MAXZONES];
+int numZones = 0;
+
+unsigned long state_version(void)
+{
+	return 1;
+}
+
+void state_changed(void)
+{
+}
+
+struct sender
+{
+	uint32_t boot;
+	uint32_t sequence;
+	int socket;
+	// the run before the last restart, and where it stopped
+	uint32_t oldBoot;
+	uint32_t oldSequence;
+	int oldSocket;
+};
+
+static struct sender *senders;
+static int pool[POOL];
+
+static void pause_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+// the sum of every "key":N in the JSON
+static unsigned long sum_key(const char *json, const char *key)
+{
+	unsigned long total = 0;
+	size_t len = strlen(key);
+	const char *p;
+
+	for(p = strstr(json, key); p; p = strstr(p + len, key))
+		total += strtoul(p + len, NULL, 10);
+
+	return total;
+}
+
+static int check(const char *what, unsigned long got, unsigned long want)
+{
+	printf("%-10s %8lu %8lu %s\n", what, got, want, got == want ? "ok" : "MISMATCH");
+
+	return got == want;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *binary = argc > 1 ? argv[1] : "./thermostat";
+	int count = argc > 2 ? atoi(argv[2]) : SENDERS;
+	unsigned long lost = 0, late = 0, restarts = 0, sent = 0;
+	unsigned char buf[TELEMETRYSIZE];
+	struct sockaddr_in addr;
+	struct telemetry t;
+	char spec[32], line[256];
+	char *json;
+	int toChild[2], fromChild[2];
+	int port, i, round, ok;
+	FILE *in, *out;
+	pid_t pid;
+
+	if(count <= 0 || count > 10000)
+	{
+		fprintf(stderr, "usage: %s [thermostat binary] [senders, up to 10000]\n", argv[0]);
+		return 1;
+	}
+
+	srand(time(NULL) ^ getpid());
+	port = 40000 + getpid() % 20000;
+	snprintf(spec, sizeof(spec), "127.0.0.1:%d", port);
+
+	// the aggregator, its prompt on a pair of pipes
+	if(pipe(toChild) < 0 || pipe(fromChild) < 0)
+		return 1;
+	pid = fork();
+	if(pid < 0)
+		return 1;
+	if(pid == 0)
+	{
+		dup2(toChild[0], 0);
+		dup2(fromChild[1], 1);
+		close(toChild[1]);
+		close(fromChild[0]);
+		execl(binary, binary, "-a", spec, (char *)NULL);
+		perror(binary);
+		_exit(127);
+	}
+	close(toChild[0]);
+	close(fromChild[1]);
+	in = fdopen(fromChild[0], "r");
+	out = fdopen(toChild[1], "w");
+
+	while(fgets(line, sizeof(line), in) && strncmp(line, "Aggregating", 11) != 0)
+		;
+	if(feof(in))
+	{
+		fprintf(stderr, "%s -a %s didn't start\n", binary, spec);
+		return 1;
+	}
+
+	telemetry_address(spec, &addr);
+	for(i = 0; i < POOL; i++)
+	{
+		pool[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if(pool[i] < 0 || connect(pool[i], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			perror("socket");
+			return 1;
+		}
+	}
+
+	senders = calloc(count, sizeof(struct sender));
+	for(i = 0; i < count; i++)
+	{
+		senders[i].boot = rand();
+		senders[i].socket = i % POOL;
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.humidity = 450;
+	t.heatTemp = 720;
+	t.coolTemp = 760;
+	t.flags = TELEMETRY_READY;
+	snprintf(t.zoneName, sizeof(t.zoneName), "main");
+
+	for(round = 0; round < ROUNDS; round++)
+	{
+		for(i = 0; i < count; i++)
+		{
+			struct sender *s = &senders[i];
+
+			// every tenth restarts twice, on a new port with its count reset
+			if(i % 10 == 0 && (round == 2 || round == 4))
+			{
+				s->oldBoot = s->boot;
+				s->oldSequence = s->sequence;
+				s->oldSocket = s->socket;
+				s->boot = rand();
+				s->sequence = 0;
+				s->socket = (s->socket + 1) % POOL;
+				restarts++;
+			}
+			// every seventh loses one datagram mid run
+			else if(i % 7 == 0 && round == 3)
+			{
+				s->sequence++;
+				lost++;
+			}
+
+			t.boot = s->boot;
+			t.sequence = s->sequence++;
+			t.uptime = round * 3000;
+			t.temperature = 200 + i % 50;
+			snprintf(t.host, sizeof(t.host), "sim%05d", i);
+			telemetry_encode(&t, buf);
+			if(send(pool[s->socket], buf, sizeof(buf), 0) == sizeof(buf))
+				sent++;
+			if(sent % BURST == 0)
+				pause_ms(2);
+
+			// a datagram of the old run, held up in the network past the restart
+			if(i % 10 == 0 && round == 3)
+			{
+				t.boot = s->oldBoot;
+				t.sequence = s->oldSequence;
+				t.uptime = 2 * 3000;
+				telemetry_encode(&t, buf);
+				if(send(pool[s->oldSocket], buf, sizeof(buf), 0) == sizeof(buf))
+				{
+					sent++;
+					late++;
+				}
+			}
+		}
+		pause_ms(100);
+	}
+	pause_ms(500);
+
+	// the fleet as the aggregator sees it
+	json = malloc(MAXJSON);
+	fputs("j\n", out);
+	fflush(out);
+	while(fgets(json, MAXJSON, in) && strncmp(json, "{\"nodes\"", 8) != 0)
+		;
+	fputs("q\n", out);
+	fflush(out);
+
+	printf("%-10s %8s %8s\n", "", "counted", "expected");
+	ok = check("senders", sum_key(json, "\"nodes\":"), count);
+	ok &= check("datagrams", sum_key(json, "\"datagrams\":"), sent);
+	ok &= check("dropped", sum_key(json, "\"dropped\":"), 0);
+	// the fleet's total and each sender's add up to twice the loss
+	ok &= check("lost", sum_key(json, "\"lost\":") / 2, lost);
+	ok &= check("late", sum_key(json, "\"late\":"), late);
+	ok &= check("restarts", sum_key(json, "\"restarts\":"), restarts);
+
+	fclose(out);
+	fclose(in);
+	waitpid(pid, NULL, 0);
+	free(json);
+	free(senders);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,340 @@
+/*
+ *      mqttsim.c:
+ *      Protocol check of the MQTT client, built by make mqttsim. A fake
+ *      broker on a loopback socket shares the event loop with mqtt.c and
+ *      walks it through a session: CONNECT with its will, the set
+ *      subscription, online status and retained state, a set command
+ *      answered by a new state, a command on a topic too long to take
+ *      that still has to be acknowledged, a full telemetry batch, a dropped
+ *      connection and the reconnect, and the clean disconnect. It also
+ *      times every mqtt_service call, none of which may block. Exits
+ *      non-zero at the first step that goes wrong.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "control.h"
+#include "event.h"
+#include "log.h"
+#include "mqtt.h"
+#include "thermostat.h"
+#include "units.h"
+
+// a step fails if the client hasn't done it by then, in ms
+#define STEPTIMEOUT 5000
+// longest an mqtt_service call may take, in ms
+#define MAXSERVICE 50
+#define MAXPACKET 4096
+
+// what main.c provides in the daemon
+struct zone zones[MAXZONES];
+int numZones = 0;
+static unsigned long stateVersion = 1;
+
+unsigned long state_version(void)
+{
+	return stateVersion;
+}
+
+void state_changed(void)
+{
+	stateVersion++;
+}
+
+static int listenFd = -1;
+static int brokerFd = -1;
+static unsigned char in[MAXPACKET * 2];
+static size_t inLen;
+static uint64_t slowest;
+
+// one packet as the broker saw it
+struct packet
+{
+	int type;
+	int flags;
+	unsigned char body[MAXPACKET];
+	size_t len;
+	char topic[256];
+	const unsigned char *payload;
+	size_t payloadLen;
+	int id;
+};
+
+static void fail(const char *step)
+{
+	printf("FAILED  %s\n", step);
+	exit(1);
+}
+
+static void pass(const char *step)
+{
+	printf("ok      %s\n", step);
+}
+
+// a pass of the daemon's loop, with the broker's socket read alongside
+static void spin(void)
+{
+	uint64_t start = monotonic_ms();
+	ssize_t n;
+
+	mqtt_service(start);
+	if(monotonic_ms() - start > slowest)
+		slowest = monotonic_ms() - start;
+	event_poll(5);
+
+	if(brokerFd < 0)
+	{
+		brokerFd = accept(listenFd, NULL, NULL);
+		return;
+	}
+	n = recv(brokerFd, in + inLen, sizeof(in) - inLen, MSG_DONTWAIT);
+	if(n > 0)
+		inLen += n;
+}
+
+// the next whole packet from the client
+static void next_packet(struct packet *p, const char *step)
+{
+	uint64_t start = monotonic_ms();
+
+	while(monotonic_ms() - start < STEPTIMEOUT)
+	{
+		size_t remaining = 0, headLen = 1;
+		int shift = 0;
+
+		// fixed header, then the remaining length in 7 bit groups
+		do
+		{
+			if(headLen >= inLen)
+				goto more;
+			remaining |= (size_t)(in[headLen] & 0x7F) << shift;
+			shift += 7;
+		}
+		while(in[headLen++] & 0x80);
+
+		if(headLen + remaining <= inLen)
+		{
+			if(remaining > sizeof(p->body))
+				fail(step);
+			p->type = in[0] & 0xF0;
+			p->flags = in[0] & 0x0F;
+			memcpy(p->body, in + headLen, remaining);
+			p->len = remaining;
+			inLen -= headLen + remaining;
+			memmove(in, in + headLen + remaining, inLen);
+
+			// publishes come apart into topic, id and payload
+			p->topic[0] = '\0';
+			p->payload = NULL;
+			p->payloadLen = 0;
+			p->id = 0;
+			if(p->type == 0x30 && p->len >= 2)
+			{
+				size_t topicLen = p->body[0] << 8 | p->body[1];
+				size_t off = 2 + topicLen + (p->flags & 6 ? 2 : 0);
+
+				if(off > p->len || topicLen >= sizeof(p->topic))
+					fail(step);
+				memcpy(p->topic, p->body + 2, topicLen);
+				p->topic[topicLen] = '\0';
+				if(p->flags & 6)
+					p->id = p->body[2 + topicLen] << 8 | p->body[3 + topicLen];
+				p->payload = p->body + off;
+				p->payloadLen = p->len - off;
+			}
+			return;
+		}
+more:
+		spin();
+	}
+	fail(step);
+}
+
+static void expect(struct packet *p, int type, const char *step)
+{
+	next_packet(p, step);
+	if(p->type != type)
+		fail(step);
+}
+
+static void send_bytes(const void *buf, size_t len)
+{
+	if(send(brokerFd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+		fail("broker send");
+}
+
+static void send_puback(int id)
+{
+	unsigned char ack[4] = { 0x40, 2, id >> 8, id & 0xFF };
+
+	send_bytes(ack, sizeof(ack));
+}
+
+// a publish the broker has to acknowledge, and the client's retained state
+static void expect_state(struct packet *p, const char *needle, const char *step)
+{
+	expect(p, 0x30, step);
+	if(strcmp(p->topic, "sim/main/state") != 0 || (p->flags & 7) != 3)
+		fail(step);
+	if(needle && !memmem(p->payload, p->payloadLen, needle, strlen(needle)))
+		fail(step);
+	send_puback(p->id);
+}
+
+// CONNECT with the will, then CONNACK, the subscription and online status
+static void handshake(const char *step)
+{
+	static const unsigned char connack[] = { 0x20, 2, 0, 0 };
+	static const unsigned char willTopic[] = { 0, 10, 's', 'i', 'm', '/', 's', 't', 'a', 't', 'u', 's' };
+	struct packet p;
+
+	brokerFd = -1;
+	expect(&p, 0x10, step);
+	// protocol MQTT level 4, clean session with a retained QoS 1 will
+	if(p.len < 12 || memcmp(p.body, "\0\4MQTT\4", 7) != 0 || p.body[7] != 0x2E)
+		fail(step);
+	if(!memmem(p.body, p.len, willTopic, sizeof(willTopic)) || !memmem(p.body, p.len, "offline", 7))
+		fail(step);
+	send_bytes(connack, sizeof(connack));
+
+	expect(&p, 0x80, step);
+	if(p.len < 5 || !memmem(p.body, p.len, "sim/+/set/+", 11))
+		fail(step);
+	{
+		unsigned char suback[5] = { 0x90, 3, p.body[0], p.body[1], 1 };
+		send_bytes(suback, sizeof(suback));
+	}
+
+	expect(&p, 0x30, step);
+	if(strcmp(p.topic, "sim/status") != 0 || (p.flags & 7) != 3 || p.payloadLen != 6 || memcmp(p.payload, "online", 6) != 0)
+		fail(step);
+	send_puback(p.id);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char setTopic[] = "sim/main/set/hightemp";
+	unsigned char command[400];
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	struct packet p;
+	char spec[64];
+	size_t len;
+	int i;
+
+	log_init("stderr", LVL_ERROR);
+
+	numZones = 1;
+	snprintf(zones[0].name, sizeof(zones[0].name), "main");
+	zones[0].hvacMode = HEAT;
+	zones[0].fanMode = AUTO;
+	zones[0].unit = UNIT_F;
+	zones[0].heatTemp = 720;
+	zones[0].coolTemp = 760;
+	zones[0].temperature = 215;
+	zones[0].humidity = 450;
+	zones[0].sensorReady = 1;
+
+	// the broker, on a port of the kernel's choosing
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0 ||
+		getsockname(listenFd, (struct sockaddr *)&addr, &addrLen) < 0)
+	{
+		perror("broker");
+		return 1;
+	}
+	snprintf(spec, sizeof(spec), "localhost:%d/sim", ntohs(addr.sin_port));
+
+	if(!mqtt_open(spec))
+		fail("mqtt_open");
+
+	handshake("connect, subscribe and online status");
+	pass("connect, subscribe and online status");
+
+	expect_state(&p, "\"heatTemp\":72.0", "retained state on connect");
+	pass("retained state on connect");
+
+	// PREFIX/ZONE/set/KEY, QoS 1 with id 7
+	len = 0;
+	command[len++] = 0x32;
+	command[len++] = 2 + strlen(setTopic) + 2 + 4;
+	command[len++] = 0;
+	command[len++] = strlen(setTopic);
+	memcpy(command + len, setTopic, strlen(setTopic));
+	len += strlen(setTopic);
+	command[len++] = 0;
+	command[len++] = 7;
+	memcpy(command + len, "71.5", 4);
+	len += 4;
+	send_bytes(command, len);
+
+	expect(&p, 0x40, "set command acknowledged");
+	if(p.len != 2 || p.body[1] != 7)
+		fail("set command acknowledged");
+	pass("set command acknowledged");
+	expect_state(&p, "\"heatTemp\":71.5", "state republished after set");
+	pass("state republished after set");
+
+	// a 300 byte topic, past the client's buffer, QoS 1 with id 9
+	len = 0;
+	command[len++] = 0x32;
+	command[len++] = ((2 + 300 + 2 + 4) & 0x7F) | 0x80;
+	command[len++] = (2 + 300 + 2 + 4) >> 7;
+	command[len++] = 300 >> 8;
+	command[len++] = 300 & 0xFF;
+	memset(command + len, 'x', 300);
+	len += 300;
+	command[len++] = 0;
+	command[len++] = 9;
+	memcpy(command + len, "71.5", 4);
+	len += 4;
+	send_bytes(command, len);
+
+	expect(&p, 0x40, "long topic acknowledged");
+	if(p.len != 2 || p.body[1] != 9)
+		fail("long topic acknowledged");
+	pass("long topic acknowledged");
+
+	// a full batch goes out on the next pass
+	for(i = 0; i < 32; i++)
+		mqtt_sample(0, 1, monotonic_ms());
+	expect(&p, 0x30, "telemetry batch");
+	if(strcmp(p.topic, "sim/telemetry") != 0 || (p.flags & 6) != 0 || p.payloadLen < 2 || p.payload[0] != '[')
+		fail("telemetry batch");
+	pass("telemetry batch");
+
+	// the broker goes away, the client comes back on its own
+	close(brokerFd);
+	inLen = 0;
+	handshake("reconnect after the broker drops");
+	expect_state(&p, NULL, "reconnect after the broker drops");
+	pass("reconnect after the broker drops");
+
+	// offline status and DISCONNECT, the will is not sent
+	mqtt_close();
+	expect(&p, 0x30, "clean disconnect");
+	if(strcmp(p.topic, "sim/status") != 0 || p.payloadLen != 7 || memcmp(p.payload, "offline", 7) != 0)
+		fail("clean disconnect");
+	expect(&p, 0xE0, "clean disconnect");
+	pass("clean disconnect");
+
+	printf("slowest mqtt_service %llu ms\n", (unsigned long long)slowest);
+	if(slowest > MAXSERVICE)
+		fail("mqtt_service blocked the loop");
+
+	close(brokerFd);
+	close(listenFd);
+	log_shutdown();
+
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ *      sensorsim.c:
+ *      Driver and scheduler check against fake hardware, built by make
+ *      sensorsim. A BME280 register image carries the datasheet's
+ *      calibration example, and two stand-in w1 sysfs trees hold
+ *      DS18B20s: one with bulk conversion, one without, where a FIFO in
+ *      place of a temperature file makes the read wait out a conversion
+ *      the way the kernel does. Each zone has to report once per
+ *      interval with the fused reading, a sensor stuck at its power-on
+ *      value has to count as failed, and no sensor_service call may
+ *      block. Exits non-zero at the first check that goes wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "control.h"
+#include "history.h"
+#include "log.h"
+#include "sensor.h"
+#include "thermostat.h"
+
+// long enough for three rounds after the first start
+#define RUNTIME 12500
+// longest a sensor_service call may take, in ms
+#define MAXSERVICE 50
+// how long the fake kernel holds a read without bulk conversion
+#define SLOWREAD 750
+
+// what main.c provides in the daemon
+struct zone zones[MAXZONES];
+int numZones = 0;
+static unsigned long stateVersion = 1;
+
+unsigned long state_version(void)
+{
+	return stateVersion;
+}
+
+void state_changed(void)
+{
+	stateVersion++;
+}
+
+static char root[32];
+static char fifoPath[192];
+static int failed = 0;
+
+// datasheet section 8.1 example calibration and readings
+static const uint16_t T1 = 27504;
+static const int16_t T2 = 26435, T3 = -1000;
+static const uint16_t P1 = 36477;
+static const int16_t P2 = -10685, P3 = 3024, P4 = 2855, P5 = 140, P6 = -7, P7 = 15500, P8 = -14600, P9 = 6000;
+static const uint8_t H1 = 75, H3 = 0;
+static const int16_t H2 = 362, H4 = 313, H5 = 50;
+static const int8_t H6 = 30;
+static const int32_t adcT = 519888, adcP = 415148, adcH = 30000;
+
+static void check(const char *what, long got, long want, long slack)
+{
+	int ok = got >= want - slack && got <= want + slack;
+
+	printf("%-34s %8ld %8ld %s\n", what, got, want, ok ? "ok" : "MISMATCH");
+	failed |= !ok;
+}
+
+static void pause_ms(long ms)
+{
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void write_file(const char *dir, const char *name, const char *text)
+{
+	char path[192];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if(f == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+	fputs(text, f);
+	fclose(f);
+}
+
+static void make_dir(const char *tree, const char *name, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s/%s", root, tree, name);
+	mkdir(path, 0755);
+}
+
+static void make_image(const char *path)
+{
+	uint8_t regs[256];
+	int fd;
+
+	memset(regs, 0, sizeof(regs));
+	regs[0xD0] = 0x60;
+	put16(regs + 0x88, T1);
+	put16(regs + 0x8A, T2);
+	put16(regs + 0x8C, T3);
+	put16(regs + 0x8E, P1);
+	put16(regs + 0x90, P2);
+	put16(regs + 0x92, P3);
+	put16(regs + 0x94, P4);
+	put16(regs + 0x96, P5);
+	put16(regs + 0x98, P6);
+	put16(regs + 0x9A, P7);
+	put16(regs + 0x9C, P8);
+	put16(regs + 0x9E, P9);
+	regs[0xA1] = H1;
+	put16(regs + 0xE1, H2);
+	regs[0xE3] = H3;
+	regs[0xE4] = H4 >> 4;
+	regs[0xE5] = (H4 & 0x0F) | (H5 & 0x0F) << 4;
+	regs[0xE6] = H5 >> 4;
+	regs[0xE7] = H6;
+	// status 0xF3 stays 0, the measurement is always done
+	regs[0xF7] = adcP >> 12;
+	regs[0xF8] = adcP >> 4 & 0xFF;
+	regs[0xF9] = adcP << 4 & 0xF0;
+	regs[0xFA] = adcT >> 12;
+	regs[0xFB] = adcT >> 4 & 0xFF;
+	regs[0xFC] = adcT << 4 & 0xF0;
+	regs[0xFD] = adcH >> 8;
+	regs[0xFE] = adcH & 0xFF;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || write(fd, regs, sizeof(regs)) != sizeof(regs))
+	{
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+}
+
+// the datasheet's floating point humidity formula, in tenths, as a
+// cross-check on the driver's integer one
+static long expected_humidity(void)
+{
+	double v1, v2, tFine, h;
+
+	v1 = (adcT / 16384.0 - T1 / 1024.0) * T2;
+	v2 = (adcT / 131072.0 - T1 / 8192.0) * (adcT / 131072.0 - T1 / 8192.0) * T3;
+	tFine = v1 + v2;
+	h = tFine - 76800.0;
+	h = (adcH - (H4 * 64.0 + H5 / 16384.0 * h)) *
+		(H2 / 65536.0 * (1.0 + H6 / 67108864.0 * h * (1.0 + H3 / 67108864.0 * h)));
+	h = h * (1.0 - H1 * h / 524288.0);
+
+	return (long)(h * 10 + 0.5);
+}
+
+// a kernel read that holds the reader for a whole conversion
+static void *slow_kernel(void *arg)
+{
+	int fd;
+
+	for(;;)
+	{
+		fd = open(fifoPath, O_WRONLY);
+		if(fd < 0)
+			return NULL;
+		pause_ms(SLOWREAD);
+		if(write(fd, "23500\n", 6) != 6)
+			perror("fifo");
+		close(fd);
+		// opened again before the reader lets go, the next open wouldn't wait
+		pause_ms(SLOWREAD / 4);
+	}
+
+	return NULL;
+}
+
+static void add_zone(const char *name, const char *spec)
+{
+	struct zone *z = &zones[numZones++];
+
+	memset(z, 0, sizeof(*z));
+	snprintf(z->name, sizeof(z->name), "%s", name);
+	snprintf(z->sensors, sizeof(z->sensors), "%s", spec);
+}
+
+// run the scheduler like the main loop does, returns the slowest pass
+static uint64_t run(void)
+{
+	uint64_t start = monotonic_ms(), slowest = 0, now, took;
+
+	while((now = monotonic_ms()) - start < RUNTIME)
+	{
+		sensor_service(now);
+		took = monotonic_ms() - now;
+		if(took > slowest)
+			slowest = took;
+		pause_ms(5);
+	}
+
+	return slowest;
+}
+
+static struct sensor *find_sensor(const char *device)
+{
+	int i;
+
+	for(i = 0; i < numSensors; i++)
+	{
+		if(strcmp(sensors[i].device, device) == 0)
+			return &sensors[i];
+	}
+	fprintf(stderr, "no sensor %s\n", device);
+	exit(1);
+}
+
+static long latest(int zone, int humidity)
+{
+	struct history_sample s[HISTORYSIZE];
+	int n = history_query(zone, 0, 0xFFFFFFFF, s, HISTORYSIZE);
+
+	if(n == 0)
+		return -1;
+
+	return humidity ? s[n - 1].humidity : s[n - 1].temperature;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[160], spec[SENSORSPEC], image[48];
+	struct sensor *ok, *reset, *bme;
+	pthread_t kernel;
+	long rounds;
+	uint64_t slowest;
+
+	log_init("stderr", LVL_ERROR);
+	signal(SIGPIPE, SIG_IGN);
+
+	snprintf(root, sizeof(root), "/tmp/sensorsim.XXXXXX");
+	if(mkdtemp(root) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// bulk conversion on the bus, a good sensor and one stuck at power-on
+	snprintf(dir, sizeof(dir), "%s/bulk", root);
+	mkdir(dir, 0755);
+	make_dir("bulk", "w1_bus_master1", dir, sizeof(dir));
+	write_file(dir, "therm_bulk_read", "1\n");
+	make_dir("bulk", "28-000000000001", dir, sizeof(dir));
+	write_file(dir, "temperature", "21375\n");
+	make_dir("bulk", "28-000000000002", dir, sizeof(dir));
+	write_file(dir, "temperature", "85000\n");
+	make_dir("bulk", "28-000000000003", dir, sizeof(dir));
+	write_file(dir, "temperature", "20000\n");
+	snprintf(image, sizeof(image), "%s/i2c.img", root);
+	make_image(image);
+
+	snprintf(dir, sizeof(dir), "%s/bulk", root);
+	ds18b20_set_root(dir);
+	snprintf(spec, sizeof(spec), "ds18b20@28-000000000001 bme280@%s", image);
+	add_zone("fused", spec);
+	add_zone("mixed", "ds18b20@28-000000000003 ds18b20@28-000000000002");
+	add_zone("reset", "ds18b20@28-000000000002");
+	sensor_setup();
+
+	slowest = run();
+	ok = find_sensor("28-000000000001");
+	reset = find_sensor("28-000000000002");
+	bme = find_sensor(image);
+	rounds = ok->reads;
+	printf("%-34s %8s %8s\n", "", "got", "want");
+	check("bulk: rounds run", rounds, 3, 1);
+	check("bme280 temperature, tenths C", bme->last.temperature, 251, 0);
+	check("bme280 pressure, Pa", bme->last.pressure, 100653, 1);
+	check("bme280 humidity, tenths %", bme->last.humidity, expected_humidity(), 2);
+	// weights 1/0.5^2 and 1/1.0^2: (4 * 21.4 + 25.1) / 5
+	check("fused temperature, tenths C", latest(0, 0), 221, 0);
+	check("fused humidity, tenths %", latest(0, 1), bme->last.humidity, 0);
+	check("fused zone reports per round", history_count(0), rounds, 0);
+	check("mixed zone reports per round", history_count(1), rounds, 0);
+	check("mixed zone ignores the failed one", latest(1, 0), 200, 0);
+	check("85C power-on value is a failure", reset->failures, reset->reads, 0);
+	check("zone with nothing fresh reports none", history_count(2), 0, 0);
+	check("slowest sensor_service, ms", slowest, 0, MAXSERVICE);
+	sensor_close();
+
+	// no bulk conversion: a blocking read and a w1_slave only sensor
+	snprintf(dir, sizeof(dir), "%s/slow", root);
+	mkdir(dir, 0755);
+	make_dir("slow", "28-000000000004", dir, sizeof(dir));
+	snprintf(fifoPath, sizeof(fifoPath), "%s/temperature", dir);
+	if(mkfifo(fifoPath, 0644) < 0 || pthread_create(&kernel, NULL, slow_kernel, NULL) != 0)
+	{
+		perror(fifoPath);
+		return 1;
+	}
+	make_dir("slow", "28-000000000005", dir, sizeof(dir));
+	write_file(dir, "w1_slave", "72 01 4b 46 7f ff 0e 10 57 : crc=57 YES\n72 01 4b 46 7f ff 0e 10 57 t=23125\n");
+
+	snprintf(dir, sizeof(dir), "%s/slow", root);
+	ds18b20_set_root(dir);
+	numZones = 0;
+	add_zone("slow", "ds18b20@28-000000000004 ds18b20@28-000000000005");
+	sensor_setup();
+
+	slowest = run();
+	ok = find_sensor("28-000000000004");
+	rounds = ok->reads;
+	check("no bulk: rounds run", rounds, 3, 1);
+	check("no bulk: blocking read failures", ok->failures, 0, 0);
+	check("no bulk: w1_slave failures", find_sensor("28-000000000005")->failures, 0, 0);
+	// equal weights, (23.5 + 23.1) / 2, history carries on from the first run's zone 0
+	check("no bulk: fused temperature, tenths C", latest(0, 0), 233, 0);
+	check("no bulk: slowest sensor_service, ms", slowest, 0, MAXSERVICE);
+	sensor_close();
+
+	log_shutdown();
+	printf("%s\n", failed ? "FAILED" : "all ok");
+
+	return failed;
+}
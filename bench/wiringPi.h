@@ -0,0 +1,20 @@
+#ifndef WIRINGPI_SHIM_H
+#define WIRINGPI_SHIM_H
+
+// no-op stand-in so the benchmarks build on any host, the hardware paths
+// they would reach are never run
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+static inline int wiringPiSetup(void) { return 0; }
+static inline int wiringPiSetupGpio(void) { return 0; }
+static inline void pinMode(int pin, int mode) { (void)pin; (void)mode; }
+static inline void digitalWrite(int pin, int value) { (void)pin; (void)value; }
+static inline int digitalRead(int pin) { (void)pin; return LOW; }
+static inline void delay(unsigned int ms) { (void)ms; }
+static inline void delayMicroseconds(unsigned int us) { (void)us; }
+
+#endif
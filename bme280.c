@@ -0,0 +1,226 @@
+/*
+ *      bme280.c:
+ *      Bosch BME280 temperature, humidity and pressure sensor on i2c.
+ *      Each start() kicks off a forced mode measurement and poll()
+ *      collects it once the status register says it's done, using the
+ *      integer compensation from the datasheet. A regular file in place
+ *      of the i2c device is read as a 256 byte register image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/i2c-dev.h>
+
+#include "log.h"
+#include "sensor.h"
+
+#define REG_CALIB1 0x88
+#define REG_ID 0xD0
+#define REG_CALIB2 0xE1
+#define REG_CTRL_HUM 0xF2
+#define REG_STATUS 0xF3
+#define REG_CTRL_MEAS 0xF4
+#define REG_DATA 0xF7
+
+#define CHIPID 0x60
+// x1 oversampling on everything, forced mode
+#define CTRL_HUM 0x01
+#define CTRL_MEAS 0x25
+// typical measurement time at x1 oversampling, in ms
+#define MEASURETIME 10
+#define STATUS_MEASURING 0x08
+
+struct bme280
+{
+	// register image instead of an i2c bus
+	int image;
+
+	uint16_t T1;
+	int16_t T2, T3;
+	uint16_t P1;
+	int16_t P2, P3, P4, P5, P6, P7, P8, P9;
+	uint8_t H1, H3;
+	int16_t H2, H4, H5;
+	int8_t H6;
+};
+
+static int read_regs(struct sensor *s, uint8_t reg, uint8_t *buf, size_t len)
+{
+	struct bme280 *b = s->priv;
+
+	if(b->image)
+		return pread(s->fd, buf, len, reg) == (ssize_t)len;
+
+	return write(s->fd, &reg, 1) == 1 && read(s->fd, buf, len) == (ssize_t)len;
+}
+
+static int write_reg(struct sensor *s, uint8_t reg, uint8_t value)
+{
+	struct bme280 *b = s->priv;
+	uint8_t buf[2] = { reg, value };
+
+	if(b->image)
+		return pwrite(s->fd, &value, 1, reg) == 1;
+
+	return write(s->fd, buf, 2) == 2;
+}
+
+static void bme280_close(struct sensor *s)
+{
+	if(s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+	free(s->priv);
+	s->priv = NULL;
+}
+
+static int bme280_open(struct sensor *s)
+{
+	struct bme280 *b;
+	struct stat st;
+	uint8_t c[26], h[7], id;
+
+	s->fd = open(s->device, O_RDWR);
+	if(s->fd < 0)
+		return 0;
+
+	b = calloc(1, sizeof(*b));
+	if(b == NULL)
+		return 0;
+	s->priv = b;
+	b->image = fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	if(!b->image && ioctl(s->fd, I2C_SLAVE, s->address) < 0)
+		return 0;
+
+	if(!read_regs(s, REG_ID, &id, 1) || id != CHIPID)
+	{
+		log_event(LVL_WARN, "bme280_bad_id", "device=%s address=0x%02x", s->device, s->address);
+		return 0;
+	}
+
+	if(!read_regs(s, REG_CALIB1, c, sizeof(c)) || !read_regs(s, REG_CALIB2, h, sizeof(h)))
+		return 0;
+
+	b->T1 = c[0] | c[1] << 8;
+	b->T2 = c[2] | c[3] << 8;
+	b->T3 = c[4] | c[5] << 8;
+	b->P1 = c[6] | c[7] << 8;
+	b->P2 = c[8] | c[9] << 8;
+	b->P3 = c[10] | c[11] << 8;
+	b->P4 = c[12] | c[13] << 8;
+	b->P5 = c[14] | c[15] << 8;
+	b->P6 = c[16] | c[17] << 8;
+	b->P7 = c[18] | c[19] << 8;
+	b->P8 = c[20] | c[21] << 8;
+	b->P9 = c[22] | c[23] << 8;
+	b->H1 = c[25];
+	b->H2 = h[0] | h[1] << 8;
+	b->H3 = h[2];
+	b->H4 = (int8_t)h[3] * 16 | (h[4] & 0x0F);
+	b->H5 = (int8_t)h[5] * 16 | h[4] >> 4;
+	b->H6 = h[6];
+
+	return 1;
+}
+
+// a sensor that wasn't there at startup is retried on every start
+static int bme280_init(struct sensor *s)
+{
+	if(bme280_open(s))
+		return 1;
+	bme280_close(s);
+
+	return 0;
+}
+
+static int bme280_start(struct sensor *s)
+{
+	if(s->priv == NULL && !bme280_init(s))
+		return -1;
+
+	// humidity settings only latch on the following ctrl_meas write
+	if(!write_reg(s, REG_CTRL_HUM, CTRL_HUM) || !write_reg(s, REG_CTRL_MEAS, CTRL_MEAS))
+		return -1;
+
+	return MEASURETIME;
+}
+
+static int bme280_poll(struct sensor *s, struct sensor_reading *r)
+{
+	struct bme280 *b = s->priv;
+	uint8_t d[8], status;
+	int32_t adcT, adcP, adcH, var1, var2, tFine, v;
+	int64_t p1, p2, p;
+
+	if(!read_regs(s, REG_STATUS, &status, 1))
+		return SENSOR_FAILED;
+	if(status & STATUS_MEASURING)
+		return SENSOR_PENDING;
+	if(!read_regs(s, REG_DATA, d, sizeof(d)))
+		return SENSOR_FAILED;
+
+	adcP = (int32_t)d[0] << 12 | d[1] << 4 | d[2] >> 4;
+	adcT = (int32_t)d[3] << 12 | d[4] << 4 | d[5] >> 4;
+	adcH = (int32_t)d[6] << 8 | d[7];
+	// skipped measurements read back as 0x80000
+	if(adcT == 0x80000)
+		return SENSOR_FAILED;
+
+	// temperature, 0.01C rounded to tenths
+	var1 = (((adcT >> 3) - ((int32_t)b->T1 << 1)) * b->T2) >> 11;
+	var2 = (((((adcT >> 4) - b->T1) * ((adcT >> 4) - b->T1)) >> 12) * b->T3) >> 14;
+	tFine = var1 + var2;
+	v = (tFine * 5 + 128) >> 8;
+	r->temperature = (v + (v < 0 ? -5 : 5)) / 10;
+
+	// pressure, Q24.8 Pa to Pa
+	r->pressure = 0;
+	p1 = (int64_t)tFine - 128000;
+	p2 = p1 * p1 * b->P6;
+	p2 += (p1 * b->P5) << 17;
+	p2 += (int64_t)b->P4 << 35;
+	p1 = ((p1 * p1 * b->P3) >> 8) + ((p1 * b->P2) << 12);
+	p1 = ((((int64_t)1 << 47) + p1) * b->P1) >> 33;
+	if(p1 != 0 && adcP != 0x80000)
+	{
+		p = 1048576 - adcP;
+		p = (((p << 31) - p2) * 3125) / p1;
+		p2 = ((int64_t)b->P9 * (p >> 13) * (p >> 13)) >> 25;
+		p1 = ((int64_t)b->P8 * p) >> 19;
+		p = ((p + p1 + p2) >> 8) + ((int64_t)b->P7 << 4);
+		r->pressure = (p + 128) >> 8;
+	}
+
+	// humidity, Q22.10 %RH to tenths
+	r->humidity = 0;
+	if(adcH != 0x8000)
+	{
+		v = tFine - 76800;
+		v = ((((adcH << 14) - ((int32_t)b->H4 << 20) - (b->H5 * v)) + 16384) >> 15) *
+			(((((((v * b->H6) >> 10) * (((v * b->H3) >> 11) + 32768)) >> 10) + 2097152) * b->H2 + 8192) >> 14);
+		v -= ((((v >> 15) * (v >> 15)) >> 7) * b->H1) >> 4;
+		if(v < 0)
+			v = 0;
+		if(v > 419430400)
+			v = 419430400;
+		r->humidity = ((v >> 12) * 10 + 512) >> 10;
+	}
+
+	return SENSOR_OK;
+}
+
+
+// +-1C, +-3%RH
+const struct sensor_driver bme280_driver =
+{
+	"bme280", CAP_TEMPERATURE | CAP_HUMIDITY | CAP_PRESSURE, 10, 0,
+	bme280_init, bme280_start, bme280_poll, bme280_close, NULL,
+};
@@ -0,0 +1,415 @@
+/*
+ *      commands.c:
+ *      Table driven command dispatcher shared by the stdin prompt and the
+ *      control socket. Each command writes its reply to the given stream
+ *      and acts on the zone currently selected by that caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commands.h"
+#include "config.h"
+#include "log.h"
+#include "record.h"
+#include "sensor.h"
+#include "thermostat.h"
+#include "trace.h"
+#include "units.h"
+
+#define MAXCOMMAND 16
+
+struct command
+{
+	const char *name;
+	const char *help;
+	int (*handler)(const char *arg, FILE *out, int *zone);
+};
+
+static int cmd_help(const char *arg, FILE *out, int *zone);
+
+// set while replaying a trace, nothing is written to disk
+static int dryRun = 0;
+
+void command_set_dry_run(int on)
+{
+	dryRun = on;
+}
+
+// print current settings
+void print_settings(FILE *out, int zone)
+{
+	struct zone *z = &zones[zone];
+	char text[UNITTEXT];
+
+	fprintf(out, "Settings are: \n");
+	if(numZones > 1)
+	{
+		fprintf(out, "Zone %s\n", z->name);
+	}
+	switch(z->hvacMode)
+	{
+		case AC:
+		{
+			fprintf(out, "AC On\n");
+		}
+		break;
+
+		case HEAT:
+		{
+			fprintf(out, "Heat on\n");
+		}
+		break;
+
+		case OFF:
+		{
+			fprintf(out, "HVAC Off\n");
+		}
+		break;
+	}
+
+	switch(z->fanMode)
+	{
+		case ON:
+		{
+			fprintf(out, "Fan On\n");
+		}
+		break;
+
+		case AUTO:
+		{
+			fprintf(out, "Auto Fan\n");
+		}
+		break;
+	}
+
+	fprintf(out, "Unit is: %s\n", unit_name(z->unit));
+	fprintf(out, "Heat temp is: %s\n", unit_format(text, z->heatTemp));
+	fprintf(out, "Cool temp is: %s\n", unit_format(text, z->coolTemp));
+	fprintf(out, "Offset Val is: %s\n", unit_format(text, z->offsetVal));
+}
+
+static int cmd_print_temp(const char *arg, FILE *out, int *zone)
+{
+	struct zone *z = &zones[*zone];
+	char text[UNITTEXT];
+
+	if(z->sensorReady)
+	{
+		fprintf(out, "Current temp is: %s\n", unit_format(text, unit_from_c(z->temperature, z->unit) + z->offsetVal));
+		return CMD_OK;
+	}
+
+	fprintf(out, "Sensor not ready\n");
+	return CMD_ERROR;
+}
+
+static int cmd_quit(const char *arg, FILE *out, int *zone)
+{
+	fprintf(out, "Quiting now\n");
+	return CMD_QUIT;
+}
+
+static int cmd_sensors(const char *arg, FILE *out, int *zone)
+{
+	sensor_dump(out);
+	return CMD_OK;
+}
+
+#ifdef THERMOSTAT_TRACE
+static int cmd_trace(const char *arg, FILE *out, int *zone)
+{
+	trace_dump(out);
+	return CMD_OK;
+}
+#endif
+
+static int cmd_save(const char *arg, FILE *out, int *zone)
+{
+	if(dryRun)
+	{
+		fprintf(out, "Settings not saved during replay\n");
+		return CMD_OK;
+	}
+
+	if(config_save())
+	{
+		fprintf(out, "Settings saved\n");
+		return CMD_OK;
+	}
+
+	fprintf(out, "Error writing settings\n");
+	return CMD_ERROR;
+}
+
+static int cmd_heat_temp(const char *arg, FILE *out, int *zone)
+{
+	char text[UNITTEXT];
+
+	if(!config_set(*zone, "heatTemp", arg))
+	{
+		fprintf(out, "Invalid temperature\n");
+		return CMD_ERROR;
+	}
+
+	fprintf(out, "New high temp is: %s\n", unit_format(text, zones[*zone].heatTemp));
+	return CMD_OK;
+}
+
+static int cmd_cool_temp(const char *arg, FILE *out, int *zone)
+{
+	char text[UNITTEXT];
+
+	if(!config_set(*zone, "coolTemp", arg))
+	{
+		fprintf(out, "Invalid temperature\n");
+		return CMD_ERROR;
+	}
+
+	fprintf(out, "New low temp is: %s\n", unit_format(text, zones[*zone].coolTemp));
+	return CMD_OK;
+}
+
+static int cmd_offset(const char *arg, FILE *out, int *zone)
+{
+	char text[UNITTEXT];
+
+	if(!config_set(*zone, "offsetVal", arg))
+	{
+		fprintf(out, "Invalid offset\n");
+		return CMD_ERROR;
+	}
+
+	fprintf(out, "New offset value is: %s\n", unit_format(text, zones[*zone].offsetVal));
+	return CMD_OK;
+}
+
+// setpoints and offset are converted to the new unit
+static int cmd_unit(const char *arg, FILE *out, int *zone)
+{
+	char text[UNITTEXT];
+
+	if(!config_set(*zone, "unit", arg))
+	{
+		fprintf(out, "Invalid unit\n");
+		return CMD_ERROR;
+	}
+
+	fprintf(out, "Unit is now %s, high temp %s", unit_name(zones[*zone].unit), unit_format(text, zones[*zone].heatTemp));
+	fprintf(out, ", low temp %s\n", unit_format(text, zones[*zone].coolTemp));
+	return CMD_OK;
+}
+
+static int cmd_hvac_mode(const char *arg, FILE *out, int *zone)
+{
+	struct zone *z = &zones[*zone];
+
+	if(strcmp(arg, "AC") != 0 && strcmp(arg, "HEAT") != 0 && strcmp(arg, "OFF") != 0)
+	{
+		fprintf(out, "Invalid mode set\n");
+		return CMD_ERROR;
+	}
+
+	// reset HVAC
+	blowerOff(z);
+	ACoff(z);
+	HeatOff(z);
+
+	config_set(*zone, "hvacMode", arg);
+	fprintf(out, "hvacMode is now %s\n", arg);
+	return CMD_OK;
+}
+
+static int cmd_fan_mode(const char *arg, FILE *out, int *zone)
+{
+	if(strcmp(arg, "ON") != 0 && strcmp(arg, "AUTO") != 0)
+	{
+		fprintf(out, "Invalid mode set\n");
+		return CMD_ERROR;
+	}
+
+	config_set(*zone, "fanMode", arg);
+	fprintf(out, "fanMode is now %s\n", arg);
+	return CMD_OK;
+}
+
+static int cmd_print_settings(const char *arg, FILE *out, int *zone)
+{
+	print_settings(out, *zone);
+	return CMD_OK;
+}
+
+static int cmd_zone(const char *arg, FILE *out, int *zone)
+{
+	int index = config_zone(arg);
+
+	if(index < 0)
+	{
+		fprintf(out, "No such zone\n");
+		return CMD_ERROR;
+	}
+
+	*zone = index;
+	fprintf(out, "Zone is now %s\n", zones[index].name);
+	return CMD_OK;
+}
+
+static int cmd_list_zones(const char *arg, FILE *out, int *zone)
+{
+	char text[UNITTEXT];
+	int i;
+
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+
+		fprintf(out, "%c %d %s sensor=%d relays=%d/%d/%d", i == *zone ? '*' : ' ', i, z->name,
+			z->sensorPin, z->relayPins[RELAY_BLOWER], z->relayPins[RELAY_AC], z->relayPins[RELAY_HEAT]);
+		if(z->sensorReady)
+			fprintf(out, " temp=%s%s\n", unit_format(text, unit_from_c(z->temperature, z->unit) + z->offsetVal), unit_name(z->unit));
+		else
+			fprintf(out, " temp=none\n");
+	}
+
+	return CMD_OK;
+}
+
+static const struct command commands[] =
+{
+	{ "h", "h: help", cmd_help },
+	{ "sht", "sht = XX.XX: set high temp", cmd_heat_temp },
+	{ "slt", "slt = XX.XX: set low temp", cmd_cool_temp },
+	{ "sov", "sov = XX.XX: set offset value", cmd_offset },
+	{ "shm", "shm = AC/HEAT/OFF: set hvac mode", cmd_hvac_mode },
+	{ "sfm", "sfm = AUTO/ON: set blower mode", cmd_fan_mode },
+	{ "su", "su = F/C: set display unit", cmd_unit },
+	{ "ps", "ps: print settings", cmd_print_settings },
+	{ "p", "p: print temp", cmd_print_temp },
+	{ "z", "z = NAME: select zone for following commands", cmd_zone },
+	{ "lz", "lz: list zones", cmd_list_zones },
+	{ "s", "s: save settings", cmd_save },
+	{ "sn", "sn: sensor counters and calibration as JSON", cmd_sensors },
+#ifdef THERMOSTAT_TRACE
+	{ "tr", "tr: dump the span trace as Chrome trace JSON", cmd_trace },
+#endif
+	{ "q", "q: quit", cmd_quit },
+};
+
+#define NUMCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+// print command line help
+void command_help(FILE *out)
+{
+	unsigned int i;
+
+	fprintf(out, "Valid command options\n");
+	fprintf(out, "Note: commands are case sensitive\n");
+	for(i = 0; i < NUMCOMMANDS; i++)
+	{
+		fprintf(out, "%s\n", commands[i].help);
+	}
+}
+
+static int cmd_help(const char *arg, FILE *out, int *zone)
+{
+	command_help(out);
+	return CMD_OK;
+}
+
+// web form field names and the settings they map to
+static const char *formKeys[][2] =
+{
+	{ "hvacmode", "hvacMode" },
+	{ "fanmode", "fanMode" },
+	{ "unit", "unit" },
+	{ "cooltemp", "coolTemp" },
+	{ "hightemp", "heatTemp" },
+	{ "offsetvalue", "offsetVal" },
+};
+
+// apply a setting from the web form, returns 0 for an unknown key or bad value
+int settings_apply(int zone, const char *key, const char *data, const char *source)
+{
+	char value[LOGQUOTE];
+	unsigned int i;
+
+	for(i = 0; i < sizeof(formKeys) / sizeof(formKeys[0]); i++)
+	{
+		if(strcmp(key, formKeys[i][0]) == 0)
+			break;
+	}
+	if(i == sizeof(formKeys) / sizeof(formKeys[0]))
+		return 0;
+
+	record_setting(zone, key, data);
+	if(!config_set(zone, formKeys[i][1], data))
+	{
+		log_event(LVL_WARN, "setting_rejected", "source=%s zone=%s key=%s value=%s", source, zones[zone].name, key,
+			log_quote(value, sizeof(value), data));
+		return 0;
+	}
+	log_event(LVL_INFO, "setting", "source=%s zone=%s key=%s value=%s", source, zones[zone].name, key,
+		log_quote(value, sizeof(value), data));
+
+	return 1;
+}
+
+// run one command line of the form "name [=] [value]" against the caller's zone
+int command_exec(const char *line, FILE *out, int *zone)
+{
+	char name[MAXCOMMAND];
+	char arg[64];
+	size_t len, end;
+	unsigned int i;
+
+	record_command(*zone, line);
+
+	// zones can't go away under a caller, but stay safe
+	if(*zone < 0 || *zone >= numZones)
+		*zone = 0;
+
+	// command name
+	line += strspn(line, " \t");
+	len = strcspn(line, " \t=\r\n");
+	if(len == 0 || len >= sizeof(name))
+	{
+		fprintf(out, "Invalid command\n");
+		return CMD_ERROR;
+	}
+	memcpy(name, line, len);
+	name[len] = '\0';
+	line += len;
+
+	// optional '=' then the value, trailing whitespace trimmed
+	line += strspn(line, " \t");
+	if(*line == '=')
+		line++;
+	line += strspn(line, " \t");
+	end = strcspn(line, "\r\n");
+	while(end > 0 && (line[end-1] == ' ' || line[end-1] == '\t'))
+		end--;
+	if(end >= sizeof(arg))
+	{
+		fprintf(out, "Argument too long\n");
+		return CMD_ERROR;
+	}
+	memcpy(arg, line, end);
+	arg[end] = '\0';
+
+	for(i = 0; i < NUMCOMMANDS; i++)
+	{
+		if(strcmp(name, commands[i].name) == 0)
+		{
+			int ret;
+			TRACE_START(start);
+
+			ret = commands[i].handler(arg, out, zone);
+			TRACE_END(start, TR_COMMAND, *zone, 0);
+			return ret;
+		}
+	}
+
+	fprintf(out, "Invalid command\n");
+	return CMD_ERROR;
+}
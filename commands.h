@@ -0,0 +1,18 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdio.h>
+
+// command results
+enum command_result
+{
+	CMD_OK, CMD_ERROR, CMD_QUIT
+};
+
+int command_exec(const char *line, FILE *out, int *zone);
+void command_help(FILE *out);
+void print_settings(FILE *out, int zone);
+int settings_apply(int zone, const char *key, const char *data, const char *source);
+void command_set_dry_run(int on);
+
+#endif
@@ -0,0 +1,845 @@
+/*
+ *      config.c:
+ *      Keyed config.ini parser and writer. Every setting has a type,
+ *      default and valid range; unknown keys and bad values are logged
+ *      and skipped. Changes mark the file dirty and are written back in
+ *      one debounced batch, through a temp file, fsync and rename so a
+ *      power cut leaves either the old or the new file.
+ *
+ *      Keys before any section belong to the first zone, called "main",
+ *      which keeps the original wiring. Each [zone NAME] section adds a
+ *      zone with its own sensors and relay pins.
+ *
+ *      Setpoints and the offset are tenths in the zone's unit, ranges
+ *      are checked in F. A zone's unit is settled before its setpoints
+ *      are, so a section may list them in either order.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "control.h"
+#include "log.h"
+#include "sensor.h"
+#include "thermostat.h"
+#include "trace.h"
+#include "units.h"
+
+// write this long after the last change
+#define SAVEDELAY 2000
+// but never hold a change longer than this
+#define SAVEMAXDELAY 30000
+#define MAXLINE 128
+#define MAXPIN 40
+
+enum config_type
+{
+	TYPE_ENUM, TYPE_INT, TYPE_DECI, TYPE_STRING
+};
+
+// hardware keys only take effect at startup
+#define KEY_HARDWARE 1
+// a difference rather than a temperature, converts without the 32F
+#define KEY_DELTA 2
+// changing it converts the zone's temperatures
+#define KEY_UNIT 4
+
+struct config_key
+{
+	const char *name;
+	int type;
+	size_t offset;
+	// tenths of a degree F for temperatures
+	int def;
+	int min;
+	int max;
+	int flags;
+	// names accepted for enum values, index is the value
+	const char *names[4];
+};
+
+static const struct config_key keys[] =
+{
+	{ "sensors", TYPE_STRING, offsetof(struct zone, sensors), 0, 0, 0, KEY_HARDWARE, { NULL } },
+	{ "sensorPin", TYPE_INT, offsetof(struct zone, sensorPin), 4, 0, MAXPIN, KEY_HARDWARE, { NULL } },
+	{ "blowerPin", TYPE_INT, offsetof(struct zone, relayPins[RELAY_BLOWER]), 27, 0, MAXPIN, KEY_HARDWARE, { NULL } },
+	{ "acPin", TYPE_INT, offsetof(struct zone, relayPins[RELAY_AC]), 17, 0, MAXPIN, KEY_HARDWARE, { NULL } },
+	{ "heatPin", TYPE_INT, offsetof(struct zone, relayPins[RELAY_HEAT]), 22, 0, MAXPIN, KEY_HARDWARE, { NULL } },
+	{ "hvacMode", TYPE_ENUM, offsetof(struct zone, hvacMode), OFF, AC, OFF, 0, { "AC", "HEAT", "OFF" } },
+	{ "fanMode", TYPE_ENUM, offsetof(struct zone, fanMode), AUTO, ON, AUTO, 0, { "ON", "AUTO" } },
+	{ "unit", TYPE_ENUM, offsetof(struct zone, unit), UNIT_F, UNIT_F, UNIT_C, KEY_UNIT, { "F", "C" } },
+	{ "heatTemp", TYPE_DECI, offsetof(struct zone, heatTemp), 740, 400, 950, 0, { NULL } },
+	{ "coolTemp", TYPE_DECI, offsetof(struct zone, coolTemp), 700, 400, 950, 0, { NULL } },
+	{ "offsetVal", TYPE_DECI, offsetof(struct zone, offsetVal), 0, -200, 200, KEY_DELTA, { NULL } },
+};
+
+#define NUMKEYS (sizeof(keys) / sizeof(keys[0]))
+// a saved file at its largest: every zone with a full name, a full
+// sensor list and a line per key
+#define SAVESIZE (MAXZONES * (ZONENAME + SENSORSPEC + 32 * NUMKEYS))
+
+// parsed file, built up before anything is swapped in
+struct staging
+{
+	struct zone zones[MAXZONES];
+	int numZones;
+};
+
+static char configPath[256] = CONFIGFILE;
+static pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER;
+static int dirty = 0;
+// the file has zones we couldn't run, saving would throw them away
+static int broken = 0;
+static uint64_t firstChange;
+static uint64_t lastChange;
+// keys set since the last save, 1 << key index per zone
+static unsigned int pending[MAXZONES];
+// what the last save wrote, so its own rename isn't taken for an edit
+static uint64_t savedHash;
+
+static const struct config_key *find_key(const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < NUMKEYS; i++)
+	{
+		if(strcasecmp(name, keys[i].name) == 0)
+			return &keys[i];
+	}
+
+	return NULL;
+}
+
+// parse and range check a value, numbers or names for enums, temperatures
+// are range checked once the zone's unit is known
+static int parse_value(const struct config_key *key, const char *text, int *out)
+{
+	char *end;
+	long v;
+	int i;
+
+	if(key->type == TYPE_ENUM)
+	{
+		for(i = 0; i < 4 && key->names[i]; i++)
+		{
+			if(strcasecmp(text, key->names[i]) == 0)
+			{
+				*out = i;
+				return 1;
+			}
+		}
+	}
+
+	if(key->type == TYPE_DECI)
+		return unit_parse(text, out);
+
+	v = strtol(text, &end, 10);
+	if(end == text || *end != '\0')
+		return 0;
+	if(v < key->min || v > key->max)
+		return 0;
+
+	*out = v;
+	return 1;
+}
+
+// a temperature in the zone's unit against the key's range in F
+static int deci_valid(const struct config_key *key, int v, int unit)
+{
+	if(key->flags & KEY_DELTA)
+		v = unit_convert_delta(v, unit, UNIT_F);
+	else
+		v = unit_convert(v, unit, UNIT_F);
+
+	return v >= key->min && v <= key->max;
+}
+
+// the key's default in the zone's unit
+static int deci_default(const struct config_key *key, int unit)
+{
+	if(key->flags & KEY_DELTA)
+		return unit_convert_delta(key->def, UNIT_F, unit);
+
+	return unit_convert(key->def, UNIT_F, unit);
+}
+
+static void store_value(struct zone *z, const struct config_key *key, int v)
+{
+	void *field = (char *)z + key->offset;
+
+	if(key->type == TYPE_DECI)
+		*(int16_t *)field = v;
+	else
+		*(int *)field = v;
+}
+
+static int current_value(const struct zone *z, const struct config_key *key)
+{
+	const void *field = (const char *)z + key->offset;
+
+	if(key->type == TYPE_DECI)
+		return *(const int16_t *)field;
+
+	return *(const int *)field;
+}
+
+// store a live change, a new unit carries the temperatures over to it
+static void set_value(struct zone *z, const struct config_key *key, int v)
+{
+	unsigned int i;
+
+	if((key->flags & KEY_UNIT) && v != z->unit)
+	{
+		for(i = 0; i < NUMKEYS; i++)
+		{
+			if(keys[i].type != TYPE_DECI)
+				continue;
+			if(keys[i].flags & KEY_DELTA)
+				store_value(z, &keys[i], unit_convert_delta(current_value(z, &keys[i]), z->unit, v));
+			else
+				store_value(z, &keys[i], unit_convert(current_value(z, &keys[i]), z->unit, v));
+		}
+	}
+	store_value(z, key, v);
+}
+
+// value as written to the file, temperatures with their tenth
+static const char *format_value(const struct zone *z, const struct config_key *key, char *buf)
+{
+	if(key->type == TYPE_DECI)
+		return unit_format(buf, current_value(z, key));
+	if(key->flags & KEY_UNIT)
+		return unit_name(current_value(z, key));
+
+	snprintf(buf, UNITTEXT, "%i", current_value(z, key));
+	return buf;
+}
+
+// string keys are only sensor specs for now
+static int store_string(struct zone *z, const struct config_key *key, const char *text)
+{
+	char *field = (char *)z + key->offset;
+
+	if(strlen(text) >= SENSORSPEC || !sensor_spec_valid(text))
+		return 0;
+	strcpy(field, text);
+
+	return 1;
+}
+
+// defaults for a new zone, only the first gets the original pins
+static void zone_defaults(struct zone *z, int index, const char *name)
+{
+	unsigned int i;
+
+	memset(z, 0, sizeof(*z));
+	snprintf(z->name, sizeof(z->name), "%s", name);
+	for(i = 0; i < NUMKEYS; i++)
+	{
+		if(keys[i].type == TYPE_STRING)
+			continue;
+		if(index > 0 && (keys[i].flags & KEY_HARDWARE) && keys[i].type == TYPE_INT)
+			store_value(z, &keys[i], -1);
+		else
+			store_value(z, &keys[i], keys[i].def);
+	}
+	for(i = 0; i < RELAYS; i++)
+	{
+		z->relays[i] = -1;
+	}
+}
+
+// names go into JSON, pages, URLs and MQTT topics as they are
+static int name_valid(const char *name)
+{
+	return *name && strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-.") == strlen(name);
+}
+
+// every zone needs its own pins and a plain, unique name, returns how many
+// zones were dropped
+static int check_zones(const char *path, struct staging *st)
+{
+	int used[MAXPIN + 1];
+	int i, j, kept = 0;
+
+	memset(used, 0, sizeof(used));
+	for(i = 0; i < st->numZones; i++)
+	{
+		struct zone *z = &st->zones[i];
+		int pins[RELAYS + MAXSENSORS];
+		int numPins = 0;
+		const char *reason = name_valid(z->name) ? NULL : "bad_name";
+
+		for(j = 0; j < RELAYS; j++)
+		{
+			pins[numPins++] = z->relayPins[j];
+		}
+		// a zone without a sensor list reads a dht22 on sensorPin
+		if(z->sensors[0])
+			numPins += sensor_spec_pins(z->sensors, pins + numPins, MAXSENSORS);
+		else
+			pins[numPins++] = z->sensorPin;
+
+		for(j = 0; j < numPins && !reason; j++)
+		{
+			if(pins[j] < 0)
+				reason = "missing_pin";
+			else if(used[pins[j]])
+				reason = "shared_pin";
+		}
+		for(j = 0; j < kept && !reason; j++)
+		{
+			if(strcmp(st->zones[j].name, z->name) == 0)
+				reason = "duplicate_name";
+		}
+
+		if(reason)
+		{
+			log_event(LVL_ERROR, "config_zone_dropped", "file=%s zone=%s reason=%s", path, z->name, reason);
+			continue;
+		}
+
+		for(j = 0; j < numPins; j++)
+		{
+			used[pins[j]] = 1;
+		}
+		if(kept != i)
+			st->zones[kept] = *z;
+		kept++;
+	}
+
+	j = st->numZones - kept;
+	st->numZones = kept;
+
+	return j;
+}
+
+// once a section's unit is known, fill in and range check its temperatures
+static void finish_zone(const char *path, struct zone *z, unsigned int given)
+{
+	char text[UNITTEXT];
+	unsigned int i;
+
+	for(i = 0; i < NUMKEYS; i++)
+	{
+		if(keys[i].type != TYPE_DECI)
+			continue;
+		if((given & (1u << i)) && !deci_valid(&keys[i], current_value(z, &keys[i]), z->unit))
+		{
+			log_event(LVL_WARN, "config_bad_value", "file=%s zone=%s key=%s value=%s %s", path, z->name,
+				keys[i].name, format_value(z, &keys[i], text), unit_name(z->unit));
+			given &= ~(1u << i);
+		}
+		if(!(given & (1u << i)))
+			store_value(z, &keys[i], deci_default(&keys[i], z->unit));
+	}
+}
+
+// parse a file into staged zones, anything missing or invalid keeps its default
+static int parse_file(const char *path, struct staging *st)
+{
+	char line[MAXLINE];
+	// keys set in the current section, by index
+	unsigned int given = 0;
+	int lineNo = 0;
+	int topLevel = 0;
+	int sections = 0;
+	struct zone *z;
+	FILE *config;
+
+	st->numZones = 1;
+	zone_defaults(&st->zones[0], 0, "main");
+	z = &st->zones[0];
+
+	config = fopen(path, "r");
+	if(config == NULL)
+		return 0;
+
+	while(fgets(line, sizeof(line), config))
+	{
+		char *name, *value, *eq, *end;
+		const struct config_key *key;
+		int v;
+
+		lineNo++;
+
+		// strip comments and surrounding whitespace
+		line[strcspn(line, "#;\r\n")] = '\0';
+		name = line + strspn(line, " \t");
+		if(*name == '\0')
+			continue;
+
+		// [zone NAME] starts the next zone
+		if(*name == '[')
+		{
+			char zoneName[ZONENAME];
+
+			if(z)
+				finish_zone(path, z, given);
+			given = 0;
+			if(sscanf(name, "[zone %15[^] ]]", zoneName) != 1)
+			{
+				log_event(LVL_WARN, "config_syntax", "file=%s line=%d", path, lineNo);
+				z = NULL;
+				continue;
+			}
+			if(st->numZones == MAXZONES)
+			{
+				log_event(LVL_WARN, "config_too_many_zones", "file=%s line=%d max=%d", path, lineNo, MAXZONES);
+				z = NULL;
+				continue;
+			}
+			// without top level keys the first section becomes the first zone
+			sections++;
+			z = &st->zones[st->numZones];
+			zone_defaults(z, topLevel ? st->numZones : st->numZones - 1, zoneName);
+			st->numZones++;
+			continue;
+		}
+
+		eq = strchr(name, '=');
+		if(eq == NULL)
+		{
+			log_event(LVL_WARN, "config_syntax", "file=%s line=%d", path, lineNo);
+			continue;
+		}
+		value = eq + 1;
+		value += strspn(value, " \t");
+		for(end = eq; end > name && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		for(end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+
+		// keys under a rejected section are dropped with it
+		if(z == NULL)
+			continue;
+
+		key = find_key(name);
+		if(key == NULL)
+		{
+			log_event(LVL_WARN, "config_unknown_key", "file=%s line=%d key=%s", path, lineNo, name);
+			continue;
+		}
+		if(key->type == TYPE_STRING)
+		{
+			if(!store_string(z, key, value))
+			{
+				log_event(LVL_WARN, "config_bad_value", "file=%s line=%d key=%s value=%s", path, lineNo, key->name, value);
+				continue;
+			}
+		}
+		else if(!parse_value(key, value, &v))
+		{
+			log_event(LVL_WARN, "config_bad_value", "file=%s line=%d key=%s value=%s", path, lineNo, key->name, value);
+			continue;
+		}
+		else
+		{
+			store_value(z, key, v);
+			given |= 1u << (key - keys);
+		}
+		if(sections == 0)
+			topLevel = 1;
+	}
+	fclose(config);
+	if(z)
+		finish_zone(path, z, given);
+
+	// a file of only sections has no implicit main zone
+	if(sections > 0 && !topLevel)
+	{
+		st->numZones--;
+		memmove(&st->zones[0], &st->zones[1], sizeof(struct zone) * st->numZones);
+	}
+
+	return 1;
+}
+
+// FNV-1a, over a buffer or continuing over the next piece of one
+static uint64_t hash_bytes(uint64_t hash, const char *buf, size_t len)
+{
+	while(len--)
+		hash = (hash ^ (unsigned char)*buf++) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+#define HASHSTART 0xCBF29CE484222325ULL
+
+static int hash_file(const char *path, uint64_t *hash)
+{
+	char buf[1024];
+	size_t n;
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL)
+		return 0;
+	*hash = HASHSTART;
+	while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+		*hash = hash_bytes(*hash, buf, n);
+	fclose(file);
+
+	return 1;
+}
+
+// load settings at startup, returns 0 if the file was missing
+int config_load(const char *path)
+{
+	struct staging st;
+	int found;
+
+	snprintf(configPath, sizeof(configPath), "%s", path);
+	found = parse_file(path, &st);
+
+	// run the zones that make sense, but don't save over the ones that didn't
+	broken = found && check_zones(path, &st) > 0;
+	if(st.numZones == 0)
+	{
+		st.numZones = 1;
+		zone_defaults(&st.zones[0], 0, "main");
+	}
+
+	memcpy(zones, st.zones, sizeof(struct zone) * st.numZones);
+	numZones = st.numZones;
+
+	return found;
+}
+
+// re-read the file after an outside change, swapping in only what differs;
+// settings changed here since the last save are newer than the file
+void config_reload(const char *path)
+{
+	struct staging st;
+	unsigned int k;
+	uint64_t hash;
+	int i, j;
+	int changed = 0;
+
+	// our own save renamed into place; anything else, even a later
+	// return to that content, is an edit
+	if(hash_file(path, &hash) && hash == savedHash)
+		return;
+	savedHash = 0;
+
+	if(!parse_file(path, &st))
+	{
+		// mid-replace or deleted, keep running on what we have
+		log_event(LVL_WARN, "config_reload_skipped", "file=%s errno=%d", path, errno);
+		return;
+	}
+	broken = check_zones(path, &st) > 0;
+
+	pthread_mutex_lock(&configLock);
+	for(j = 0; j < st.numZones; j++)
+	{
+		struct zone *staged = &st.zones[j];
+		struct zone *z = NULL;
+
+		for(i = 0; i < numZones; i++)
+		{
+			if(strcmp(zones[i].name, staged->name) == 0)
+				z = &zones[i];
+		}
+		if(z == NULL)
+		{
+			log_event(LVL_WARN, "config_reload_restart_needed", "zone=%s reason=new_zone", staged->name);
+			continue;
+		}
+
+		// an unsaved unit stays, so read the file's temperatures in it
+		for(k = 0; k < NUMKEYS; k++)
+		{
+			if((keys[k].flags & KEY_UNIT) && (pending[z - zones] & 1u << k))
+				set_value(staged, &keys[k], z->unit);
+		}
+
+		for(k = 0; k < NUMKEYS; k++)
+		{
+			char oldText[UNITTEXT], newText[UNITTEXT];
+			int old, v;
+
+			if(keys[k].type == TYPE_STRING)
+			{
+				if(strcmp((char *)z + keys[k].offset, (char *)staged + keys[k].offset) != 0)
+					log_event(LVL_WARN, "config_reload_restart_needed", "zone=%s key=%s", z->name, keys[k].name);
+				continue;
+			}
+
+			old = current_value(z, &keys[k]);
+			v = current_value(staged, &keys[k]);
+			if(old == v)
+				continue;
+
+			if(pending[z - zones] & 1u << k)
+			{
+				log_event(LVL_INFO, "config_reload_kept", "zone=%s key=%s reason=unsaved", z->name, keys[k].name);
+				continue;
+			}
+
+			// relays and sensors are never rewired under a running zone
+			if(keys[k].flags & KEY_HARDWARE)
+			{
+				log_event(LVL_WARN, "config_reload_restart_needed", "zone=%s key=%s", z->name, keys[k].name);
+				continue;
+			}
+
+			log_event(LVL_INFO, "config_reload_key", "zone=%s key=%s old=%s new=%s", z->name, keys[k].name,
+				format_value(z, &keys[k], oldText), format_value(staged, &keys[k], newText));
+			// the unit comes first, so temperatures already in it then match
+			set_value(z, &keys[k], v);
+			changed++;
+		}
+	}
+	pthread_mutex_unlock(&configLock);
+
+	if(changed)
+	{
+		log_event(LVL_INFO, "config_reloaded", "file=%s changed=%d", path, changed);
+		state_changed();
+	}
+}
+
+static void mark_dirty(void)
+{
+	uint64_t now = monotonic_ms();
+
+	pthread_mutex_lock(&configLock);
+	if(!dirty)
+		firstChange = now;
+	lastChange = now;
+	dirty = 1;
+	pthread_mutex_unlock(&configLock);
+}
+
+// note a setting change, the file is written once changes settle
+void config_changed(void)
+{
+	mark_dirty();
+	state_changed();
+}
+
+// validated keyed setter shared by the CLI, socket and web form
+int config_set(int zone, const char *name, const char *value)
+{
+	const struct config_key *key = find_key(name);
+	int v;
+
+	if(zone < 0 || zone >= numZones || key == NULL || (key->flags & KEY_HARDWARE) || key->type == TYPE_STRING)
+		return 0;
+	if(!parse_value(key, value, &v))
+		return 0;
+
+	// the web form and other threads land here, and a unit change
+	// rewrites several fields that saves and renders must see together
+	pthread_mutex_lock(&configLock);
+	if(key->type == TYPE_DECI && !deci_valid(key, v, zones[zone].unit))
+	{
+		pthread_mutex_unlock(&configLock);
+		return 0;
+	}
+	set_value(&zones[zone], key, v);
+	pending[zone] |= 1u << (key - keys);
+	pthread_mutex_unlock(&configLock);
+	config_changed();
+
+	return 1;
+}
+
+// hold settings still while reading several of them from another thread
+void config_lock(void)
+{
+	pthread_mutex_lock(&configLock);
+}
+
+void config_unlock(void)
+{
+	pthread_mutex_unlock(&configLock);
+}
+
+// look a zone up by name or index, -1 if there is no such zone
+int config_zone(const char *name)
+{
+	char *end;
+	long index;
+	int i;
+
+	for(i = 0; i < numZones; i++)
+	{
+		if(strcmp(zones[i].name, name) == 0)
+			return i;
+	}
+
+	index = strtol(name, &end, 10);
+	if(end != name && *end == '\0' && index >= 0 && index < numZones)
+		return index;
+
+	return -1;
+}
+
+static int write_fully(int fd, const char *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+// what a failed save held is unsaved again, and retried
+static void save_failed(const unsigned int *saving)
+{
+	int i;
+
+	pthread_mutex_lock(&configLock);
+	for(i = 0; i < MAXZONES; i++)
+		pending[i] |= saving[i];
+	pthread_mutex_unlock(&configLock);
+	mark_dirty();
+}
+
+// add to the file being saved, returns 0 once it no longer fits
+static int append(char *buf, size_t *len, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(buf + *len, SAVESIZE - *len, format, args);
+	va_end(args);
+	if(n < 0 || (size_t)n >= SAVESIZE - *len)
+		return 0;
+	*len += n;
+
+	return 1;
+}
+
+// crash safe write: temp file, fsync, rename over the old one, fsync dir
+int config_save(void)
+{
+	char tmpPath[sizeof(configPath) + 4];
+	char buf[SAVESIZE];
+	char dir[sizeof(configPath)];
+	char *slash;
+	unsigned int k;
+	unsigned int saving[MAXZONES];
+	size_t len = 0;
+	int i, fd, ok, fits = 1;
+
+	if(broken)
+	{
+		log_event(LVL_WARN, "config_save_blocked", "file=%s reason=invalid_zones", configPath);
+		pthread_mutex_lock(&configLock);
+		dirty = 0;
+		pthread_mutex_unlock(&configLock);
+		return 0;
+	}
+
+	pthread_mutex_lock(&configLock);
+	for(i = 0; i < numZones && fits; i++)
+	{
+		// the first zone stays at the top so single zone files look as before
+		if(i > 0 || strcmp(zones[i].name, "main") != 0)
+			fits = append(buf, &len, "%s[zone %s]\n", len ? "\n" : "", zones[i].name);
+
+		for(k = 0; k < NUMKEYS && fits; k++)
+		{
+			char text[UNITTEXT];
+
+			if(keys[k].type == TYPE_STRING)
+			{
+				// unset keeps the file looking as before
+				if(*((char *)&zones[i] + keys[k].offset))
+					fits = append(buf, &len, "%s = %s\n", keys[k].name, (char *)&zones[i] + keys[k].offset);
+			}
+			else
+				fits = append(buf, &len, "%s = %s\n", keys[k].name, format_value(&zones[i], &keys[k], text));
+		}
+	}
+	dirty = 0;
+	memcpy(saving, pending, sizeof(saving));
+	memset(pending, 0, sizeof(pending));
+	pthread_mutex_unlock(&configLock);
+
+	if(!fits)
+	{
+		log_event(LVL_ERROR, "config_save_failed", "file=%s reason=too_long", configPath);
+		save_failed(saving);
+		return 0;
+	}
+
+	TRACE_START(saveStart);
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", configPath);
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		log_event(LVL_ERROR, "config_save_failed", "file=%s errno=%d", tmpPath, errno);
+		save_failed(saving);
+		TRACE_END(saveStart, TR_CONFIG_SAVE, TR_NOZONE, 0);
+		return 0;
+	}
+	ok = write_fully(fd, buf, len) && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	if(!ok || rename(tmpPath, configPath) < 0)
+	{
+		log_event(LVL_ERROR, "config_save_failed", "file=%s errno=%d", configPath, errno);
+		unlink(tmpPath);
+		// try again once the delay passes
+		save_failed(saving);
+		TRACE_END(saveStart, TR_CONFIG_SAVE, TR_NOZONE, 0);
+		return 0;
+	}
+
+	// make the rename itself durable
+	snprintf(dir, sizeof(dir), "%s", configPath);
+	slash = strrchr(dir, '/');
+	if(slash)
+		*slash = '\0';
+	else
+		strcpy(dir, ".");
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if(fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	savedHash = hash_bytes(HASHSTART, buf, len);
+
+	log_event(LVL_INFO, "config_saved", "file=%s", configPath);
+	TRACE_END(saveStart, TR_CONFIG_SAVE, TR_NOZONE, 1);
+
+	return 1;
+}
+
+// called from the main loop, writes dirty settings once they settle
+void config_service(uint64_t now)
+{
+	int due;
+
+	pthread_mutex_lock(&configLock);
+	due = dirty && (now - lastChange >= SAVEDELAY || now - firstChange >= SAVEMAXDELAY);
+	pthread_mutex_unlock(&configLock);
+
+	if(due)
+		config_save();
+}
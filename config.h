@@ -0,0 +1,16 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+
+int config_load(const char *path);
+void config_reload(const char *path);
+int config_set(int zone, const char *key, const char *value);
+int config_zone(const char *name);
+void config_changed(void);
+void config_lock(void);
+void config_unlock(void);
+int config_save(void);
+void config_service(uint64_t now);
+
+#endif
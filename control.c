@@ -0,0 +1,283 @@
+/*
+ *      control.c:
+ *      Thermostat decision logic and relay outputs. Time is passed in by
+ *      the caller and relays go through a pluggable output, so the same
+ *      code drives the GPIO pins live and runs headless during replay.
+ *      Every zone runs its own controller off the shared control pass.
+ */
+
+#include <wiringPi.h>
+#include <time.h>
+
+#include "control.h"
+#include "dht22.h"
+#include "log.h"
+#include "thermostat.h"
+#include "trace.h"
+#include "units.h"
+
+// ms after start before the HVAC may be switched
+#define HVACDELAY 1000
+
+static const char *relayNames[RELAYS] = { "blower", "ac", "heat" };
+
+static relay_output output = relay_gpio;
+static uint64_t startTime = 0;
+static uint64_t lastTime = 0;
+
+uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// drive the relay pin directly
+void relay_gpio(struct zone *z, int relay, int on, uint64_t now)
+{
+	digitalWrite(z->relayPins[relay], on ? HIGH : LOW);
+}
+
+// setup HVAC Output
+void relay_setup(struct zone *z)
+{
+	int i;
+
+	for(i = 0; i < RELAYS; i++)
+	{
+		pinMode(z->relayPins[i], OUTPUT);
+	}
+}
+
+const char *relay_name(int relay)
+{
+	return relayNames[relay];
+}
+
+// relays that are on, 1 << RELAY_*
+int relay_bits(const struct zone *z)
+{
+	int i, bits = 0;
+
+	for(i = 0; i < RELAYS; i++)
+	{
+		if(z->relays[i] > 0)
+			bits |= 1 << i;
+	}
+
+	return bits;
+}
+
+static void relay_set(struct zone *z, int relay, int on)
+{
+	if(z->relays[relay] == on)
+		return;
+
+	TRACE_START(start);
+
+	if(z->relays[relay] >= 0)
+		log_event(LVL_INFO, "relay", "zone=%s name=%s state=%s", z->name, relayNames[relay], on ? "on" : "off");
+	z->relays[relay] = on;
+	z->relayChanged[relay] = lastTime;
+	output(z, relay, on, lastTime);
+	state_changed();
+	TRACE_END(start, TR_RELAY_WRITE, z - zones, relay << 1 | on);
+}
+
+// LED Yellow, PIN 13/GPIO 27 on the first zone
+void blowerOn(struct zone *z)
+{
+	relay_set(z, RELAY_BLOWER, 1);
+}
+
+void blowerOff(struct zone *z)
+{
+	relay_set(z, RELAY_BLOWER, 0);
+}
+
+// LED Green, PIN 11/GPIO 17 on the first zone
+void ACOn(struct zone *z)
+{
+	relay_set(z, RELAY_AC, 1);
+
+	// Safety turn heater off
+	HeatOff(z);
+}
+
+void ACoff(struct zone *z)
+{
+	relay_set(z, RELAY_AC, 0);
+}
+
+// LED Red, PIN 15/GPIO 22 on the first zone
+void HeatOn(struct zone *z)
+{
+	relay_set(z, RELAY_HEAT, 1);
+
+	// Safety turn AC off
+	ACoff(z);
+}
+
+void HeatOff(struct zone *z)
+{
+	relay_set(z, RELAY_HEAT, 0);
+}
+
+void control_init(uint64_t now, relay_output out)
+{
+	startTime = lastTime = now;
+	output = out;
+}
+
+uint64_t control_started(void)
+{
+	return startTime;
+}
+
+// put a zone back in a recorded state; the outputs were already there, so
+// nothing is driven
+void control_restore(struct zone *z, int ready, const int *states, const uint64_t *changed)
+{
+	int i;
+
+	z->hvacReady = ready;
+	for(i = 0; i < RELAYS; i++)
+	{
+		z->relays[i] = states[i];
+		z->relayChanged[i] = changed[i];
+	}
+}
+
+// pick up where a previous run left off: no warm-up delay, relays as they were
+void control_resume(struct zone *z, uint64_t now, const int *states, const uint64_t *changed)
+{
+	int i;
+
+	lastTime = now;
+	z->hvacReady = 1;
+	for(i = 0; i < RELAYS; i++)
+	{
+		relay_set(z, i, states[i]);
+		z->relayChanged[i] = changed[i];
+	}
+	log_event(LVL_INFO, "control_resumed", "zone=%s hvac_on=%d", z->name, z->hvacOn);
+}
+
+// take a good sensor reading, tenths of a degree C and of a percent
+void control_sample(struct zone *z, int t, int h)
+{
+	if(!z->sensorReady || t != z->temperature || h != z->humidity)
+	{
+		z->temperature = t;
+		z->humidity = h;
+		z->sensorReady = 1;
+		state_changed();
+	}
+}
+
+// see if AC, Heater, or Blower need to be activated for one zone
+static void zone_step(struct zone *z, uint64_t now)
+{
+	int wasOn = z->hvacOn;
+
+	// check if program has run long enough to activate HVAC
+	if(!z->hvacReady)
+	{
+		if(now - startTime < HVACDELAY)
+			return;
+
+		log_event(LVL_INFO, "hvac_ready", "zone=%s uptime_ms=%llu", z->name, (unsigned long long)(now - startTime));
+		z->hvacReady = 1;
+	}
+
+	switch(z->fanMode)
+	{
+		case ON:
+		{
+			blowerOn(z);
+		}
+		break;
+
+		case AUTO:
+		{
+			if(z->hvacOn)
+			{
+				blowerOn(z);
+			}
+			else
+			{
+				blowerOff(z);
+			}
+		}
+		break;
+	}
+
+	// reading plus offset against the setpoints, exactly in the zone's unit
+	switch(z->hvacMode)
+	{
+		case HEAT:
+		{
+			if(unit_compare(z->temperature, z->offsetVal, z->heatTemp, z->unit) < 0)
+			{
+				// turn heat on
+				z->hvacOn = 1;
+				HeatOn(z);
+			}
+			else if(unit_compare(z->temperature, z->offsetVal, z->heatTemp, z->unit) > 0)
+			{
+				// turn heat off
+				z->hvacOn = 0;
+				HeatOff(z);
+			}
+		}
+		break;
+
+		case AC:
+		{
+			if(unit_compare(z->temperature, z->offsetVal, z->coolTemp, z->unit) > 0)
+			{
+				// turn ac on
+				z->hvacOn = 1;
+				ACOn(z);
+			}
+			else if(unit_compare(z->temperature, z->offsetVal, z->coolTemp, z->unit) < 0)
+			{
+				// turn ac off
+				z->hvacOn = 0;
+				ACoff(z);
+			}
+		}
+		break;
+
+		case OFF:
+		{
+			// make sure ac and heat are off
+			z->hvacOn = 0;
+			ACoff(z);
+			HeatOff(z);
+		}
+		break;
+	}
+
+	if(z->hvacOn != wasOn)
+	{
+		state_changed();
+	}
+}
+
+// one control pass over every zone
+void control_step(uint64_t now)
+{
+	int i;
+
+	TRACE_START(start);
+	lastTime = now;
+	for(i = 0; i < numZones; i++)
+	{
+		TRACE_START(zoneStart);
+		zone_step(&zones[i], now);
+		TRACE_END(zoneStart, TR_ZONE_STEP, i, 0);
+	}
+	TRACE_END(start, TR_CONTROL_STEP, TR_NOZONE, 0);
+}
@@ -0,0 +1,23 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+
+#include "thermostat.h"
+
+// called when a relay actually changes state
+typedef void (*relay_output)(struct zone *z, int relay, int on, uint64_t now);
+
+uint64_t monotonic_ms(void);
+void control_init(uint64_t now, relay_output out);
+uint64_t control_started(void);
+void control_restore(struct zone *z, int ready, const int *states, const uint64_t *changed);
+void control_resume(struct zone *z, uint64_t now, const int *states, const uint64_t *changed);
+void control_sample(struct zone *z, int t, int h);
+void control_step(uint64_t now);
+const char *relay_name(int relay);
+int relay_bits(const struct zone *z);
+void relay_gpio(struct zone *z, int relay, int on, uint64_t now);
+void relay_setup(struct zone *z);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ *      ctlsock.c:
+ *      Unix domain socket control interface. Clients send newline
+ *      terminated commands, as many as they like per write, and get one
+ *      reply per command in order: the command output followed by a
+ *      status line of "ok", "err" or "bye".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "commands.h"
+#include "ctlsock.h"
+#include "event.h"
+#include "log.h"
+
+#define MAXCLIENTS 32
+#define INBUFSIZE 4096
+// stop reading from a client that isn't collecting its replies
+#define MAXPENDING (64 * 1024)
+
+struct client
+{
+	int fd;
+	char in[INBUFSIZE];
+	size_t inLen;
+	char *out;
+	size_t outLen;
+	size_t outSent;
+	// zone selected by this client's z command
+	int zone;
+};
+
+static struct client clients[MAXCLIENTS];
+static int listenFd = -1;
+static char socketPath[108];
+static int *quitFlag;
+
+static void client_close(struct client *c)
+{
+	event_remove(c->fd);
+	close(c->fd);
+	free(c->out);
+	c->fd = -1;
+	c->out = NULL;
+	c->inLen = c->outLen = c->outSent = 0;
+}
+
+static void client_update_events(struct client *c)
+{
+	short events = 0;
+
+	if(c->outLen - c->outSent < MAXPENDING)
+		events |= POLLIN;
+	if(c->outSent < c->outLen)
+		events |= POLLOUT;
+
+	event_modify(c->fd, events);
+}
+
+// write as much pending output as the socket takes
+static int client_flush(struct client *c)
+{
+	while(c->outSent < c->outLen)
+	{
+		ssize_t n = write(c->fd, c->out + c->outSent, c->outLen - c->outSent);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			return 0;
+		}
+		c->outSent += n;
+	}
+
+	if(c->outSent == c->outLen)
+	{
+		free(c->out);
+		c->out = NULL;
+		c->outLen = c->outSent = 0;
+	}
+
+	return 1;
+}
+
+// run every complete line in the input buffer, replies batched into one
+// write; returns 0 if the replies can't be queued and the client has to go
+static int client_run(struct client *c)
+{
+	static const char *status[] = { "ok\n", "err\n", "bye\n" };
+	char *start = c->in;
+	char *nl;
+	char *reply;
+	size_t replyLen;
+	FILE *out;
+	int commands = 0;
+
+	out = open_memstream(&reply, &replyLen);
+	if(out == NULL)
+	{
+		log_event(LVL_ERROR, "ctl_no_memory", "fd=%d", c->fd);
+		return 0;
+	}
+
+	while((nl = memchr(start, '\n', c->in + c->inLen - start)) != NULL)
+	{
+		int ret;
+
+		*nl = '\0';
+		ret = command_exec(start, out, &c->zone);
+		fputs(status[ret], out);
+		commands++;
+		start = nl + 1;
+
+		if(ret == CMD_QUIT)
+			*quitFlag = 1;
+	}
+	fclose(out);
+
+	// keep the partial line for the next read
+	c->inLen -= start - c->in;
+	memmove(c->in, start, c->inLen);
+
+	if(commands)
+	{
+		log_event(LVL_DEBUG, "ctl_batch", "fd=%d commands=%d", c->fd, commands);
+
+		if(c->out == NULL)
+		{
+			c->out = reply;
+			c->outLen = replyLen;
+			c->outSent = 0;
+			reply = NULL;
+		}
+		else
+		{
+			char *grown = realloc(c->out, c->outLen + replyLen);
+			if(grown == NULL)
+			{
+				// a reply that never comes would leave the client waiting
+				log_event(LVL_ERROR, "ctl_no_memory", "fd=%d", c->fd);
+				free(reply);
+				return 0;
+			}
+			memcpy(grown + c->outLen, reply, replyLen);
+			c->out = grown;
+			c->outLen += replyLen;
+		}
+	}
+	free(reply);
+
+	return 1;
+}
+
+static void client_event(int fd, short revents, void *arg)
+{
+	struct client *c = arg;
+
+	if(revents & POLLIN)
+	{
+		ssize_t n = read(fd, c->in + c->inLen, sizeof(c->in) - c->inLen);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		{
+			client_close(c);
+			return;
+		}
+		if(n > 0)
+		{
+			c->inLen += n;
+			if(!client_run(c))
+			{
+				client_close(c);
+				return;
+			}
+
+			// a line longer than the buffer can never complete
+			if(c->inLen == sizeof(c->in))
+			{
+				log_event(LVL_WARN, "ctl_line_too_long", "fd=%d", fd);
+				client_close(c);
+				return;
+			}
+		}
+	}
+	else if(revents & (POLLHUP | POLLERR))
+	{
+		client_close(c);
+		return;
+	}
+
+	if(!client_flush(c))
+	{
+		client_close(c);
+		return;
+	}
+	client_update_events(c);
+}
+
+static void accept_event(int fd, short revents, void *arg)
+{
+	int i, cfd;
+
+	while((cfd = accept(fd, NULL, NULL)) >= 0)
+	{
+		fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+		for(i = 0; i < MAXCLIENTS; i++)
+		{
+			if(clients[i].fd < 0)
+				break;
+		}
+		if(i == MAXCLIENTS || !event_add(cfd, POLLIN, client_event, &clients[i]))
+		{
+			log_event(LVL_WARN, "ctl_rejected", "reason=too_many_clients");
+			close(cfd);
+			continue;
+		}
+
+		clients[i].fd = cfd;
+		clients[i].inLen = 0;
+		clients[i].zone = 0;
+	}
+}
+
+// create the listening socket and hook it into the event loop
+int ctlsock_open(const char *path, int *quit)
+{
+	struct sockaddr_un addr;
+	int i;
+
+	for(i = 0; i < MAXCLIENTS; i++)
+	{
+		clients[i].fd = -1;
+	}
+	quitFlag = quit;
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenFd < 0)
+	{
+		log_event(LVL_ERROR, "ctl_socket_failed", "errno=%d", errno);
+		return 0;
+	}
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	snprintf(socketPath, sizeof(socketPath), "%s", path);
+
+	// stale socket from a previous run, the lock file guards real conflicts
+	unlink(path);
+	if(bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 16) < 0)
+	{
+		log_event(LVL_ERROR, "ctl_bind_failed", "path=%s errno=%d", path, errno);
+		close(listenFd);
+		listenFd = -1;
+		return 0;
+	}
+	chmod(path, 0660);
+
+	event_add(listenFd, POLLIN, accept_event, NULL);
+	log_event(LVL_INFO, "ctl_listening", "path=%s", path);
+
+	return 1;
+}
+
+void ctlsock_close(void)
+{
+	int i;
+
+	if(listenFd < 0)
+		return;
+
+	for(i = 0; i < MAXCLIENTS; i++)
+	{
+		if(clients[i].fd >= 0)
+			client_close(&clients[i]);
+	}
+	event_remove(listenFd);
+	close(listenFd);
+	unlink(socketPath);
+	listenFd = -1;
+}
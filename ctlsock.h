@@ -0,0 +1,9 @@
+#ifndef CTLSOCK_H
+#define CTLSOCK_H
+
+#define CTLSOCKET "/var/run/thermostat.sock"
+
+int ctlsock_open(const char *path, int *quit);
+void ctlsock_close(void);
+
+#endif
@@ -10,20 +10,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "dht22.h"
 #include "locking.h"
+#include "sensor.h"
+#include "trace.h"
 
 #define MAXTIMINGS 85
-static int DHTPIN = 4;
-static int dht22_dat[5] = {0,0,0,0,0};
-
-// convert C to F
-float CtoF(float c)
-{
-        return c * 1.8 + 32;
-}
 
 uint8_t sizecvt(const int read)
 {
@@ -38,13 +34,151 @@ uint8_t sizecvt(const int read)
   return (uint8_t)read;
 }
 
-int read_dht22_dat(float* temp, float* hum)
+// the bit pulses start after the response preamble
+#define FIRSTBIT 4
+// reads in the window before the threshold is trusted
+#define MINREADS 3
+
+void dht22_cal_init(struct dht22_cal *c)
+{
+  memset(c, 0, sizeof(*c));
+  c->threshold = DHT22THRESHOLD;
+}
+
+// 2-means over the window's histogram: split at the midpoint of the two
+// cluster means until it stops moving. Only a split with both clusters
+// populated and clearly apart replaces the threshold in use.
+static void calibrate(struct dht22_cal *c)
+{
+  long n0, n1, s0, s1;
+  int lo, hi, t, prev, i, iter;
+
+  c->calibrated = 0;
+  if (c->count < MINREADS)
+    return;
+
+  for (lo = 0; lo < 255 && c->hist[lo] == 0; lo++)
+    ;
+  for (hi = 255; hi > lo && c->hist[hi] == 0; hi--)
+    ;
+  if (lo == hi)
+    return;
+
+  t = (lo + hi) / 2;
+  for (iter = 0; iter < 16; iter++) {
+    n0 = n1 = s0 = s1 = 0;
+    for (i = lo; i <= hi; i++) {
+      if (i <= t) {
+        n0 += c->hist[i];
+        s0 += (long)i * c->hist[i];
+      } else {
+        n1 += c->hist[i];
+        s1 += (long)i * c->hist[i];
+      }
+    }
+    if (n0 == 0 || n1 == 0)
+      return;
+
+    prev = t;
+    // midpoint of s0/n0 and s1/n1, a count at it reads as a 0
+    t = (s0 * n1 + s1 * n0) / (2 * n0 * n1);
+    if (t == prev)
+      break;
+  }
+
+  c->zeroMean = s0 * 10 / n0;
+  c->oneMean = s1 * 10 / n1;
+  // a 1 is ~70us against ~27us for a 0, and every reading has a few of each
+  if (c->oneMean * 2 < c->zeroMean * 3 || n0 * 16 < n0 + n1 || n1 * 16 < n0 + n1)
+    return;
+
+  c->calibrated = 1;
+  if (t != c->threshold) {
+    c->threshold = t;
+    c->thresholdChanges++;
+  }
+}
+
+// add a full capture's high pulses to the window, whether or not it
+// decodes, so a threshold that has drifted can still be corrected
+void dht22_cal_add(struct dht22_cal *c, const uint8_t *timings, int count)
+{
+  uint8_t *slot;
+  int i;
+
+  if (count < FIRSTBIT + 2 * DHT22BITS - 1)
+    return;
+
+  slot = c->pulses[c->head];
+  if (c->count == DHT22WINDOW) {
+    for (i = 0; i < DHT22BITS; i++)
+      c->hist[slot[i]]--;
+  } else
+    c->count++;
+
+  for (i = 0; i < DHT22BITS; i++) {
+    slot[i] = timings[FIRSTBIT + 2 * i];
+    c->hist[slot[i]]++;
+  }
+  c->head = (c->head + 1) % DHT22WINDOW;
+
+  calibrate(c);
+}
+
+void dht22_cal_outcome(struct dht22_cal *c, int ok)
+{
+  c->outcomes = c->outcomes << 1 | (ok != 0);
+  if (c->outcomeCount < 64)
+    c->outcomeCount++;
+}
+
+// decode captured pulse lengths, split from the capture so it can run on
+// recorded timings without the hardware; tenths of a degree C and of a
+// percent, as the sensor sends them. High pulses longer than threshold
+// loop counts are 1 bits.
+int dht22_decode(const uint8_t *timings, int count, int threshold, int *temp, int *hum)
+{
+  int dat[5] = {0,0,0,0,0};
+  int i, j = 0;
+
+  for (i = 0; i < count && j < 40; i++) {
+    // ignore first 3 transitions
+    if ((i >= FIRSTBIT) && (i%2 == 0)) {
+      // shove each bit into the storage bytes
+      dat[j/8] <<= 1;
+      if (timings[i] > threshold)
+        dat[j/8] |= 1;
+      j++;
+    }
+  }
+
+  // check we read 40 bits (8bit x 5 ) + verify checksum in the last byte
+  // print it out if data is good
+  if ((j >= 40) && 
+      (dat[4] == ((dat[0] + dat[1] + dat[2] + dat[3]) & 0xFF)) ) {
+        int t, h;
+        h = dat[0] * 256 + dat[1];
+        t = (dat[2] & 0x7F) * 256 + dat[3];
+        if ((dat[2] & 0x80) != 0)  t *= -1;
+
+    	*temp = t;
+    	*hum = h;
+    	return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+// cal may be NULL, the fixed threshold is used then
+int read_dht22_dat(int DHTPIN, struct dht22_cal *cal, int* temp, int* hum)
 {
+  uint8_t timings[MAXTIMINGS];
   uint8_t laststate = HIGH;
   uint8_t counter = 0;
-  uint8_t j = 0, i;
-
-  dht22_dat[0] = dht22_dat[1] = dht22_dat[2] = dht22_dat[3] = dht22_dat[4] = 0;
+  uint8_t i;
+  int ok;
 
   // pull pin down for 18 milliseconds
   pinMode(DHTPIN, OUTPUT);
@@ -58,7 +192,7 @@ int read_dht22_dat(float* temp, float* hum)
   // prepare to read the pin
   pinMode(DHTPIN, INPUT);
 
-  // detect change and read data
+  // detect change and time each level
   for ( i=0; i< MAXTIMINGS; i++) {
     counter = 0;
     while (sizecvt(digitalRead(DHTPIN)) == laststate) {
@@ -71,34 +205,81 @@ int read_dht22_dat(float* temp, float* hum)
     laststate = sizecvt(digitalRead(DHTPIN));
 
     if (counter == 255) break;
-
-    // ignore first 3 transitions
-    if ((i >= 4) && (i%2 == 0)) {
-      // shove each bit into the storage bytes
-      dht22_dat[j/8] <<= 1;
-      if (counter > 16)
-        dht22_dat[j/8] |= 1;
-      j++;
-    }
+    timings[i] = counter;
   }
 
-  // check we read 40 bits (8bit x 5 ) + verify checksum in the last byte
-  // print it out if data is good
-  if ((j >= 40) && 
-      (dht22_dat[4] == ((dht22_dat[0] + dht22_dat[1] + dht22_dat[2] + dht22_dat[3]) & 0xFF)) ) {
-        float t, h;
-        h = (float)dht22_dat[0] * 256 + (float)dht22_dat[1];
-        h /= 10;
-        t = (float)(dht22_dat[2] & 0x7F)* 256 + (float)dht22_dat[3];
-        t /= 10.0;
-        if ((dht22_dat[2] & 0x80) != 0)  t *= -1;
+  if (cal == NULL)
+    return dht22_decode(timings, i, DHT22THRESHOLD, temp, hum);
 
-    	*temp = t;
-    	*hum = h;
-    	return 1;
+  // calibrate first so a drifted threshold is fixed by this very read
+  dht22_cal_add(cal, timings, i);
+  ok = dht22_decode(timings, i, cal->threshold, temp, hum);
+  dht22_cal_outcome(cal, ok);
+
+  return ok;
+}
+
+// the bit-banged read is done by the time start() returns
+static int dht22_start(struct sensor *s)
+{
+  int t, h;
+  int ok;
+  TRACE_START(start);
+
+  ok = read_dht22_dat(s->pin, s->priv, &t, &h);
+  TRACE_END(start, TR_DHT22_READ, s->zone, s->pin);
+
+  s->resultStatus = SENSOR_FAILED;
+  if (ok) {
+    s->result.temperature = t;
+    s->result.humidity = h;
+    s->result.pressure = 0;
+    s->resultStatus = SENSOR_OK;
   }
-  else
-  {
+  return 0;
+}
+
+static int dht22_poll(struct sensor *s, struct sensor_reading *r)
+{
+  *r = s->result;
+  return s->resultStatus;
+}
+
+// calibration is per sensor, wiring length changes the pulse shapes
+static int dht22_init(struct sensor *s)
+{
+  s->priv = malloc(sizeof(struct dht22_cal));
+  if (s->priv == NULL)
     return 0;
-  }
+  dht22_cal_init(s->priv);
+  return 1;
+}
+
+static void dht22_close(struct sensor *s)
+{
+  free(s->priv);
+  s->priv = NULL;
 }
+
+static void dht22_stats(struct sensor *s, FILE *out)
+{
+  struct dht22_cal *c = s->priv;
+  int good = 0, i;
+
+  if (c == NULL)
+    return;
+  for (i = 0; i < c->outcomeCount; i++)
+    good += (c->outcomes >> i) & 1;
+
+  fprintf(out, ",\"threshold\":%d,\"calibrated\":%d,\"zeroMean\":%.1f,\"oneMean\":%.1f,"
+    "\"windowReads\":%d,\"thresholdChanges\":%lu,\"recentReads\":%d,\"recentOk\":%d",
+    c->threshold, c->calibrated, c->zeroMean / 10.0, c->oneMean / 10.0,
+    c->count, c->thresholdChanges, c->outcomeCount, good);
+}
+
+// +-0.5C, timing critical so never alongside another bit-banged read
+const struct sensor_driver dht22_driver =
+{
+  "dht22", CAP_TEMPERATURE | CAP_HUMIDITY, 5, 1,
+  dht22_init, dht22_start, dht22_poll, dht22_close, dht22_stats,
+};
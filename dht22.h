@@ -1,7 +1,37 @@
 #ifndef DHT22
 #define DHT22
 
-float CtoF(float temp);
-int read_dht22_dat(float* temp, float* hum);
+#include <stdint.h>
+
+#define DHT22BITS 40
+// loop count splitting 0 from 1 bits until there is enough to calibrate
+#define DHT22THRESHOLD 16
+// reads whose high pulses the threshold is derived from
+#define DHT22WINDOW 16
+
+// adaptive 0/1 bit threshold, from the high pulses of recent reads
+struct dht22_cal
+{
+  uint8_t pulses[DHT22WINDOW][DHT22BITS];
+  // loop counts over the window
+  uint16_t hist[256];
+  int head;
+  int count;
+  int threshold;
+  int calibrated;
+  // cluster centres, tenths of a loop count
+  int zeroMean;
+  int oneMean;
+  unsigned long thresholdChanges;
+  // last 64 reads, newest in bit 0, set when good
+  uint64_t outcomes;
+  int outcomeCount;
+};
+
+void dht22_cal_init(struct dht22_cal *c);
+void dht22_cal_add(struct dht22_cal *c, const uint8_t *timings, int count);
+void dht22_cal_outcome(struct dht22_cal *c, int ok);
+int read_dht22_dat(int pin, struct dht22_cal *cal, int* temp, int* hum);
+int dht22_decode(const uint8_t *timings, int count, int threshold, int *temp, int *hum);
 
 #endif
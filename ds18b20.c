@@ -0,0 +1,287 @@
+/*
+ *      ds18b20.c:
+ *      DS18B20 1-Wire temperature sensors through the kernel's w1_therm
+ *      sysfs files. Where the bus master offers therm_bulk_read one
+ *      trigger starts a conversion on every sensor at once and the
+ *      results are collected when it reports done. Without it a read
+ *      blocks for the whole 750ms conversion, so it runs on a helper
+ *      thread and poll() picks up the result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "sensor.h"
+
+// worst case 12 bit conversion time, in ms
+#define CONVERSIONTIME 750
+// what a sensor reports before its first conversion, in thousandths
+#define POWERONRESET 85000
+
+// a read without bulk conversion, the sensor and the helper thread
+// share it and whichever lets go last frees it
+struct w1_read
+{
+	char dir[256];
+	int refs;
+	int done;
+	int ok;
+	int milli;
+};
+
+static char w1Root[128] = "/sys/bus/w1/devices";
+static char bulkPath[192];
+static int bulkChecked = 0;
+static uint64_t bulkTriggered = 0;
+static pthread_mutex_t readLock = PTHREAD_MUTEX_INITIALIZER;
+
+// point at a different tree, for testing against a fake sysfs
+void ds18b20_set_root(const char *root)
+{
+	snprintf(w1Root, sizeof(w1Root), "%s", root);
+	bulkChecked = 0;
+}
+
+static int read_line(const char *path, char *buf, size_t size)
+{
+	FILE *f = fopen(path, "r");
+	size_t n;
+
+	if(f == NULL)
+		return 0;
+	n = fread(buf, 1, size - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	return n > 0;
+}
+
+static int write_line(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+	int ok;
+
+	if(f == NULL)
+		return 0;
+	ok = fputs(text, f) >= 0;
+
+	return fclose(f) == 0 && ok;
+}
+
+// find the first bus master with bulk conversion support
+static const char *bulk_path(void)
+{
+	char pattern[192];
+	glob_t g;
+
+	if(!bulkChecked)
+	{
+		bulkChecked = 1;
+		bulkPath[0] = '\0';
+		snprintf(pattern, sizeof(pattern), "%s/w1_bus_master*/therm_bulk_read", w1Root);
+		if(glob(pattern, 0, NULL, &g) == 0)
+		{
+			snprintf(bulkPath, sizeof(bulkPath), "%s", g.gl_pathv[0]);
+			globfree(&g);
+		}
+	}
+
+	return bulkPath[0] ? bulkPath : NULL;
+}
+
+// the result in thousandths, from temperature or on older kernels from
+// w1_slave: "... crc=xx YES\n... t=21375\n"
+static int read_milli(const char *dir, int *milli)
+{
+	char path[288];
+	char buf[128];
+	char *t;
+
+	snprintf(path, sizeof(path), "%s/temperature", dir);
+	if(read_line(path, buf, sizeof(buf)))
+	{
+		*milli = atoi(buf);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/w1_slave", dir);
+	if(!read_line(path, buf, sizeof(buf)) || strstr(buf, "YES") == NULL)
+		return 0;
+	t = strstr(buf, "t=");
+	if(t == NULL)
+		return 0;
+	*milli = atoi(t + 2);
+
+	return 1;
+}
+
+static void release(struct w1_read *w)
+{
+	int last;
+
+	pthread_mutex_lock(&readLock);
+	last = --w->refs == 0;
+	pthread_mutex_unlock(&readLock);
+	if(last)
+		free(w);
+}
+
+static void *read_thread(void *arg)
+{
+	struct w1_read *w = arg;
+	int milli = 0;
+	int ok = read_milli(w->dir, &milli);
+
+	pthread_mutex_lock(&readLock);
+	w->ok = ok;
+	w->milli = milli;
+	w->done = 1;
+	pthread_mutex_unlock(&readLock);
+	release(w);
+
+	return NULL;
+}
+
+// hand the read to a helper, unless the last one is still out
+static int start_read(struct sensor *s)
+{
+	struct w1_read *w = s->priv;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ok, done;
+
+	if(w)
+	{
+		pthread_mutex_lock(&readLock);
+		done = w->done;
+		pthread_mutex_unlock(&readLock);
+		// a sensor that stopped answering keeps one read out, not one per start
+		if(!done)
+			return CONVERSIONTIME;
+		release(w);
+		s->priv = NULL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if(w == NULL)
+		return -1;
+	snprintf(w->dir, sizeof(w->dir), "%s/%s", w1Root, s->device);
+	w->refs = 2;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ok = pthread_create(&thread, &attr, read_thread, w) == 0;
+	pthread_attr_destroy(&attr);
+	if(!ok)
+	{
+		free(w);
+		return -1;
+	}
+	s->priv = w;
+
+	return CONVERSIONTIME;
+}
+
+// only checks the files are there, reading them would start a conversion
+static int ds18b20_init(struct sensor *s)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s/temperature", w1Root, s->device);
+	if(access(path, R_OK) == 0)
+		return 1;
+	snprintf(path, sizeof(path), "%s/%s/w1_slave", w1Root, s->device);
+
+	return access(path, R_OK) == 0;
+}
+
+static int ds18b20_start(struct sensor *s)
+{
+	const char *bulk = bulk_path();
+	uint64_t now = monotonic_ms();
+
+	if(bulk == NULL)
+		return start_read(s);
+
+	// sensors on the same bus start together, one trigger covers them all
+	if(bulkTriggered == 0 || now - bulkTriggered >= CONVERSIONTIME)
+	{
+		if(!write_line(bulk, "trigger\n"))
+			return -1;
+		bulkTriggered = now;
+	}
+
+	return CONVERSIONTIME - (now - bulkTriggered);
+}
+
+// sysfs reports thousandths, round to the tenths everything else uses
+static int milli_to_deci(int milli)
+{
+	return milli >= 0 ? (milli + 50) / 100 : -((-milli + 50) / 100);
+}
+
+static int reading(int milli, struct sensor_reading *r)
+{
+	// a conversion that never happened, not a real 85C
+	if(milli == POWERONRESET)
+		return SENSOR_FAILED;
+	memset(r, 0, sizeof(*r));
+	r->temperature = milli_to_deci(milli);
+
+	return SENSOR_OK;
+}
+
+static int ds18b20_poll(struct sensor *s, struct sensor_reading *r)
+{
+	const char *bulk = bulk_path();
+	struct w1_read *w = s->priv;
+	char dir[256];
+	char buf[128];
+	int milli, ok, done;
+
+	if(bulk == NULL)
+	{
+		if(w == NULL)
+			return SENSOR_FAILED;
+		pthread_mutex_lock(&readLock);
+		done = w->done;
+		ok = w->ok;
+		milli = w->milli;
+		pthread_mutex_unlock(&readLock);
+		if(!done)
+			return SENSOR_PENDING;
+		release(w);
+		s->priv = NULL;
+
+		return ok ? reading(milli, r) : SENSOR_FAILED;
+	}
+
+	// -1 while converting, 1 once every sensor has a fresh result
+	if(read_line(bulk, buf, sizeof(buf)) && atoi(buf) < 0)
+		return SENSOR_PENDING;
+
+	snprintf(dir, sizeof(dir), "%s/%s", w1Root, s->device);
+	if(!read_milli(dir, &milli))
+		return SENSOR_FAILED;
+
+	return reading(milli, r);
+}
+
+static void ds18b20_close(struct sensor *s)
+{
+	if(s->priv)
+		release(s->priv);
+	s->priv = NULL;
+}
+
+// +-0.5C from -10C to 85C
+const struct sensor_driver ds18b20_driver =
+{
+	"ds18b20", CAP_TEMPERATURE, 5, 0,
+	ds18b20_init, ds18b20_start, ds18b20_poll, ds18b20_close, NULL,
+};
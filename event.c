@@ -0,0 +1,112 @@
+/*
+ *      event.c:
+ *      Minimal poll() based event loop. The main loop registers file
+ *      descriptors with a callback and calls event_poll() once per pass.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+
+#include "event.h"
+#include "log.h"
+#include "trace.h"
+
+#define MAXEVENTS 64
+
+struct event_handler
+{
+	event_cb cb;
+	void *arg;
+};
+
+static struct pollfd fds[MAXEVENTS];
+static struct event_handler handlers[MAXEVENTS];
+static int count = 0;
+
+static int find(int fd)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(fds[i].fd == fd)
+			return i;
+	}
+
+	return -1;
+}
+
+int event_add(int fd, short events, event_cb cb, void *arg)
+{
+	if(count == MAXEVENTS)
+	{
+		log_event(LVL_ERROR, "event_add_failed", "fd=%d reason=full", fd);
+		return 0;
+	}
+
+	fds[count].fd = fd;
+	fds[count].events = events;
+	fds[count].revents = 0;
+	handlers[count].cb = cb;
+	handlers[count].arg = arg;
+	count++;
+
+	return 1;
+}
+
+void event_modify(int fd, short events)
+{
+	int i = find(fd);
+
+	if(i >= 0)
+		fds[i].events = events;
+}
+
+// safe to call from a callback, the slot is skipped and compacted later
+void event_remove(int fd)
+{
+	int i = find(fd);
+
+	if(i >= 0)
+		fds[i].fd = -1;
+}
+
+// wait up to timeout ms and dispatch ready descriptors
+int event_poll(int timeout)
+{
+	int ready, i, n, j;
+
+	TRACE_START(start);
+	ready = poll(fds, count, timeout);
+	TRACE_END(start, TR_IDLE, TR_NOZONE, ready < 0 ? 0 : ready);
+	if(ready < 0)
+	{
+		if(errno != EINTR)
+			log_event(LVL_ERROR, "poll_failed", "errno=%d", errno);
+		return -1;
+	}
+
+	// callbacks may add descriptors, only look at the ones polled
+	n = count;
+	for(i = 0; i < n && ready > 0; i++)
+	{
+		if(fds[i].fd >= 0 && fds[i].revents)
+		{
+			ready--;
+			handlers[i].cb(fds[i].fd, fds[i].revents, handlers[i].arg);
+		}
+	}
+
+	// drop removed slots
+	for(i = 0, j = 0; i < count; i++)
+	{
+		if(fds[i].fd < 0)
+			continue;
+		fds[j] = fds[i];
+		handlers[j] = handlers[i];
+		j++;
+	}
+	count = j;
+
+	return 0;
+}
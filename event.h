@@ -0,0 +1,13 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <poll.h>
+
+typedef void (*event_cb)(int fd, short revents, void *arg);
+
+int event_add(int fd, short events, event_cb cb, void *arg);
+void event_modify(int fd, short events);
+void event_remove(int fd);
+int event_poll(int timeout);
+
+#endif
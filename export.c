@@ -0,0 +1,234 @@
+/*
+ *      export.c:
+ *      History export as CSV or NDJSON, streamed to the web server a
+ *      block at a time. Each callback copies a small batch of samples out
+ *      of the history store, so memory use is the same for any range,
+ *      the lock is only held per batch and the server only asks for more
+ *      once the client has taken the last block. Optionally gzipped on
+ *      the fly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <microhttpd.h>
+
+#include "export.h"
+#include "history.h"
+#include "log.h"
+#include "thermostat.h"
+#include "units.h"
+
+// samples copied out of the store at once
+#define BATCH 64
+#define MAXROW 160
+// uncompressed text gathered before each deflate call
+#define GZIPINPUT 4096
+// small window, the Pi has other things to do with its memory
+#define GZIPWINDOW 12
+#define GZIPMEMLEVEL 5
+
+struct export
+{
+	int format;
+	// -1 for every zone
+	int onlyZone;
+	int zone;
+	uint32_t from;
+	uint32_t to;
+	// from, or later if the ring no longer reaches back that far
+	uint32_t start;
+	unsigned long pos;
+	unsigned long skipped;
+	int headerDone;
+	int done;
+
+	struct history_sample batch[BATCH];
+	int batchLen;
+	int batchNext;
+
+	// the row being sent, possibly split across blocks
+	char row[MAXROW];
+	int rowLen;
+	int rowSent;
+
+	int gzip;
+	int finishing;
+	z_stream stream;
+	char input[GZIPINPUT];
+};
+
+static void start_zone(struct export *e)
+{
+	e->pos = history_seek(e->zone, e->from);
+	e->batchLen = e->batchNext = 0;
+}
+
+struct export *export_open(int zone, uint32_t from, uint32_t to, int format, int gzip)
+{
+	struct export *e = calloc(1, sizeof(struct export));
+	uint32_t oldest;
+	int i;
+
+	if(e == NULL)
+		return NULL;
+
+	e->format = format;
+	e->onlyZone = zone;
+	e->zone = zone < 0 ? 0 : zone;
+	e->from = from;
+	e->to = to;
+	e->gzip = gzip;
+	if(gzip && deflateInit2(&e->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIPWINDOW + 16, GZIPMEMLEVEL,
+		Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		free(e);
+		return NULL;
+	}
+
+	// the ring may have moved past from, the client is told where the
+	// export really begins
+	e->start = from;
+	for(i = e->zone; i < (zone < 0 ? numZones : zone + 1); i++)
+	{
+		if(history_oldest(i, &oldest) && oldest > e->start)
+			e->start = oldest;
+	}
+
+	start_zone(e);
+
+	return e;
+}
+
+// earliest time every exported zone is complete from
+uint32_t export_start(const struct export *e)
+{
+	return e->start;
+}
+
+// format the next row, 0 once every zone is done
+static int next_row(struct export *e)
+{
+	const struct history_sample *s;
+	char temp[UNITTEXT], hum[UNITTEXT];
+
+	if(!e->headerDone)
+	{
+		e->headerDone = 1;
+		if(e->format == EXPORT_CSV)
+		{
+			e->rowLen = snprintf(e->row, sizeof(e->row), "zone,time,temperature,humidity,blower,ac,heat,hvacOn\n");
+			return 1;
+		}
+	}
+
+	while(e->batchNext == e->batchLen)
+	{
+		e->batchNext = 0;
+		e->batchLen = history_read(e->zone, &e->pos, e->to, e->batch, BATCH, &e->skipped);
+		if(e->batchLen > 0)
+			break;
+
+		// this zone is done, on to the next
+		if(e->onlyZone >= 0 || e->zone + 1 >= numZones)
+			return 0;
+		e->zone++;
+		start_zone(e);
+	}
+
+	s = &e->batch[e->batchNext++];
+	unit_format(temp, s->temperature);
+	unit_format(hum, s->humidity);
+	if(e->format == EXPORT_CSV)
+		e->rowLen = snprintf(e->row, sizeof(e->row), "%s,%lu,%s,%s,%d,%d,%d,%d\n", zones[e->zone].name,
+			(unsigned long)s->time, temp, hum, !!(s->relays & (1 << RELAY_BLOWER)), !!(s->relays & (1 << RELAY_AC)),
+			!!(s->relays & (1 << RELAY_HEAT)), s->hvacOn);
+	else
+		e->rowLen = snprintf(e->row, sizeof(e->row), "{\"zone\":\"%s\",\"time\":%lu,\"temperature\":%s,\"humidity\":%s,"
+			"\"blower\":%d,\"ac\":%d,\"heat\":%d,\"hvacOn\":%d}\n", zones[e->zone].name,
+			(unsigned long)s->time, temp, hum, !!(s->relays & (1 << RELAY_BLOWER)), !!(s->relays & (1 << RELAY_AC)),
+			!!(s->relays & (1 << RELAY_HEAT)), s->hvacOn);
+
+	return 1;
+}
+
+// fill buf with plain text, as much as fits
+static size_t fill_text(struct export *e, char *buf, size_t max)
+{
+	size_t len = 0, n;
+
+	while(len < max)
+	{
+		if(e->rowSent == e->rowLen)
+		{
+			e->rowSent = e->rowLen = 0;
+			if(e->done || !next_row(e))
+			{
+				e->done = 1;
+				break;
+			}
+		}
+		n = e->rowLen - e->rowSent;
+		if(n > max - len)
+			n = max - len;
+		memcpy(buf + len, e->row + e->rowSent, n);
+		e->rowSent += n;
+		len += n;
+	}
+
+	return len;
+}
+
+// deflate straight into the server's block
+static ssize_t fill_gzip(struct export *e, char *buf, size_t max)
+{
+	int ret;
+
+	e->stream.next_out = (Bytef *)buf;
+	e->stream.avail_out = max;
+	while(e->stream.avail_out > 0)
+	{
+		if(e->stream.avail_in == 0 && !e->finishing)
+		{
+			e->stream.next_in = (Bytef *)e->input;
+			e->stream.avail_in = fill_text(e, e->input, sizeof(e->input));
+			e->finishing = e->done;
+		}
+		ret = deflate(&e->stream, e->finishing ? Z_FINISH : Z_NO_FLUSH);
+		if(ret == Z_STREAM_END)
+			break;
+		if(ret != Z_OK && ret != Z_BUF_ERROR)
+			return MHD_CONTENT_READER_END_WITH_ERROR;
+	}
+
+	return max - e->stream.avail_out;
+}
+
+// content reader callback, called again whenever the client wants more
+ssize_t export_read(void *cls, uint64_t pos, char *buf, size_t max)
+{
+	struct export *e = cls;
+	ssize_t len;
+
+	if(e->gzip)
+		len = fill_gzip(e, buf, max);
+	else
+		len = fill_text(e, buf, max);
+
+	if(len == 0)
+		return MHD_CONTENT_READER_END_OF_STREAM;
+
+	return len;
+}
+
+void export_free(void *cls)
+{
+	struct export *e = cls;
+
+	if(e->skipped)
+		log_event(LVL_WARN, "export_overrun", "skipped=%lu", e->skipped);
+	if(e->gzip)
+		deflateEnd(&e->stream);
+	free(e);
+}
@@ -0,0 +1,22 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum export_format
+{
+	EXPORT_CSV, EXPORT_NDJSON
+};
+
+// bytes handed to the web server per callback
+#define EXPORTBLOCK (16 * 1024)
+
+struct export;
+
+struct export *export_open(int zone, uint32_t from, uint32_t to, int format, int gzip);
+ssize_t export_read(void *cls, uint64_t pos, char *buf, size_t max);
+uint32_t export_start(const struct export *e);
+void export_free(void *cls);
+
+#endif
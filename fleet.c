@@ -0,0 +1,485 @@
+/*
+ *      fleet.c:
+ *      Aggregator run mode. Listens for telemetry datagrams from any
+ *      number of thermostats, keeps the latest state of every zone it
+ *      hears about, counts lost, late and duplicate datagrams from each
+ *      sender's sequence numbers, and serves the combined view as JSON
+ *      over HTTP and as a table on the prompt.
+ *
+ *      A sender is its address and host name. Its source port changes
+ *      with every restart, so the port can't tell one thermostat from the
+ *      next run of it, and the boot id can. A new boot id only counts as
+ *      a restart if its sequence or uptime starts over, or the sender went
+ *      quiet first; anything else is a late datagram from a run before.
+ *      Senders quiet for EVICTAFTER are dropped, in a sweep once a
+ *      second, so the table never fills with the dead.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <microhttpd.h>
+
+#include "control.h"
+#include "event.h"
+#include "log.h"
+#include "telemetry.h"
+#include "thermostat.h"
+#include "units.h"
+
+// senders tracked at once, a power of two
+#define MAXNODES 4096
+// datagrams taken per recvmmsg call
+#define BATCH 64
+// a sender this quiet is reported as stale, in ms
+#define STALEAFTER 30000
+// and this quiet forgotten, sooner if the table fills up
+#define EVICTAFTER (10 * 60000)
+// time between eviction sweeps, in ms
+#define SWEEPEVERY 1000
+
+struct node
+{
+	int used;
+	uint32_t hash;
+	struct in_addr addr;
+	// of the latest datagram, it changes on restart
+	unsigned short port;
+	char host[HOSTNAME];
+	uint32_t boot;
+	// the run before this one, its stragglers are late rather than restarts
+	uint32_t prevBoot;
+	uint32_t lastSeq;
+	uint32_t uptime;
+	uint64_t lastSeen;
+	unsigned long received;
+	unsigned long lost;
+	unsigned long late;
+	unsigned long duplicates;
+	unsigned long restarts;
+	// zones heard from, by index
+	uint32_t zoneMask;
+	struct telemetry zones[MAXZONES];
+};
+
+static struct node nodes[MAXNODES];
+static int numNodes = 0;
+static unsigned long datagrams = 0;
+static unsigned long malformed = 0;
+static unsigned long dropped = 0;
+static unsigned long evicted = 0;
+static pthread_mutex_t fleetLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t node_hash(const struct sockaddr_in *from, const char *host)
+{
+	uint32_t hash = ntohl(from->sin_addr.s_addr) * 2654435761u;
+
+	while(*host)
+		hash = (hash ^ (unsigned char)*host++) * 16777619u;
+
+	return hash;
+}
+
+// open addressing on the sender's address and host name
+static struct node *find_node(const struct sockaddr_in *from, const char *host)
+{
+	uint32_t hash = node_hash(from, host);
+	int i, slot;
+
+	for(i = 0; i < MAXNODES; i++)
+	{
+		slot = (hash + i) & (MAXNODES - 1);
+		if(!nodes[slot].used)
+		{
+			// keep the table from filling, probes get long near the end
+			if(numNodes >= MAXNODES * 3 / 4)
+				return NULL;
+			memset(&nodes[slot], 0, sizeof(nodes[slot]));
+			nodes[slot].used = 1;
+			nodes[slot].hash = hash;
+			nodes[slot].addr = from->sin_addr;
+			memcpy(nodes[slot].host, host, HOSTNAME);
+			numNodes++;
+			return &nodes[slot];
+		}
+		if(nodes[slot].hash == hash && nodes[slot].addr.s_addr == from->sin_addr.s_addr &&
+			strncmp(nodes[slot].host, host, HOSTNAME) == 0)
+			return &nodes[slot];
+	}
+
+	return NULL;
+}
+
+// empty a slot, pulling back later entries of the probe run so lookups
+// never stop at the hole short of them
+static void remove_node(int hole)
+{
+	int j = hole, home;
+
+	for(;;)
+	{
+		j = (j + 1) & (MAXNODES - 1);
+		if(!nodes[j].used)
+			break;
+		home = nodes[j].hash & (MAXNODES - 1);
+		if(((j - home) & (MAXNODES - 1)) >= ((j - hole) & (MAXNODES - 1)))
+		{
+			nodes[hole] = nodes[j];
+			hole = j;
+		}
+	}
+	nodes[hole].used = 0;
+	numNodes--;
+}
+
+// forget senders quiet for longer than age, returns how many went
+static int evict(uint64_t now, uint64_t age)
+{
+	int i = 0, count = 0;
+
+	while(i < MAXNODES)
+	{
+		struct node *n = &nodes[i];
+
+		// a removal pulls the next entry into this slot, look again
+		if(n->used && now - n->lastSeen > age)
+		{
+			log_event(LVL_INFO, "node_evicted", "address=%s host=%s age_ms=%llu", inet_ntoa(n->addr), n->host,
+				(unsigned long long)(now - n->lastSeen));
+			remove_node(i);
+			count++;
+			continue;
+		}
+		i++;
+	}
+	evicted += count;
+
+	return count;
+}
+
+static void ingest(const unsigned char *buf, size_t len, const struct sockaddr_in *from, uint64_t now)
+{
+	struct telemetry t;
+	struct node *n;
+	uint32_t gap;
+
+	datagrams++;
+	if(!telemetry_decode(buf, len, &t) || t.zone >= MAXZONES)
+	{
+		malformed++;
+		return;
+	}
+
+	n = find_node(from, t.host);
+	if(n == NULL && evict(now, STALEAFTER))
+		n = find_node(from, t.host);
+	if(n == NULL)
+	{
+		dropped++;
+		return;
+	}
+
+	if(n->received > 0 && t.boot != n->boot)
+	{
+		if(t.boot == n->prevBoot ||
+			(t.sequence >= n->lastSeq && t.uptime >= n->uptime && now - n->lastSeen < STALEAFTER))
+		{
+			n->late++;
+			return;
+		}
+		// the sender restarted and its sequence started over
+		n->prevBoot = n->boot;
+		n->restarts++;
+	}
+	else if(n->received > 0)
+	{
+		gap = t.sequence - n->lastSeq;
+
+		if(gap == 0)
+		{
+			n->duplicates++;
+			return;
+		}
+		if(gap >= 0x80000000u)
+		{
+			// older than what we have, it was counted lost when skipped
+			n->late++;
+			if(n->lost)
+				n->lost--;
+			return;
+		}
+		n->lost += gap - 1;
+	}
+
+	n->received++;
+	n->boot = t.boot;
+	n->lastSeq = t.sequence;
+	n->uptime = t.uptime;
+	n->lastSeen = now;
+	n->port = ntohs(from->sin_port);
+	n->zoneMask |= 1u << t.zone;
+	n->zones[t.zone] = t;
+}
+
+static void receive_event(int fd, short revents, void *arg)
+{
+	unsigned char bufs[BATCH][TELEMETRYSIZE + 1];
+	struct sockaddr_in from[BATCH];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	uint64_t now = monotonic_ms();
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for(i = 0; i < BATCH; i++)
+	{
+		// one spare byte so oversized datagrams don't pass as the right size
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	}
+
+	// drain the socket, a busy fleet fills many batches per pass
+	do
+	{
+		n = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+		if(n <= 0)
+			break;
+
+		pthread_mutex_lock(&fleetLock);
+		for(i = 0; i < n; i++)
+		{
+			ingest(bufs[i], msgs[i].msg_len, &from[i], now);
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		pthread_mutex_unlock(&fleetLock);
+	}
+	while(n == BATCH);
+}
+
+static void fleet_json(FILE *out, uint64_t now)
+{
+	unsigned long lost = 0;
+	int i, j, first = 1, firstZone;
+
+	for(i = 0; i < MAXNODES; i++)
+	{
+		lost += nodes[i].lost;
+	}
+
+	fprintf(out, "{\"nodes\":%d,\"datagrams\":%lu,\"malformed\":%lu,\"dropped\":%lu,\"evicted\":%lu,\"lost\":%lu,\"fleet\":[",
+		numNodes, datagrams, malformed, dropped, evicted, lost);
+	for(i = 0; i < MAXNODES; i++)
+	{
+		struct node *n = &nodes[i];
+
+		if(!n->used)
+			continue;
+
+		fprintf(out, "%s{\"address\":\"%s:%u\",\"host\":\"%s\",\"sequence\":%lu,\"uptime\":%lu,\"ageMs\":%llu,\"stale\":%s,"
+			"\"received\":%lu,\"lost\":%lu,\"late\":%lu,\"duplicates\":%lu,\"restarts\":%lu,\"zones\":[",
+			first ? "" : ",", inet_ntoa(n->addr), n->port, n->host, (unsigned long)n->lastSeq,
+			(unsigned long)n->uptime, (unsigned long long)(now - n->lastSeen), now - n->lastSeen > STALEAFTER ? "true" : "false",
+			n->received, n->lost, n->late, n->duplicates, n->restarts);
+		first = 0;
+
+		firstZone = 1;
+		for(j = 0; j < MAXZONES; j++)
+		{
+			struct telemetry *t = &n->zones[j];
+			char temp[UNITTEXT], hum[UNITTEXT], heat[UNITTEXT], cool[UNITTEXT], offset[UNITTEXT];
+
+			if(!(n->zoneMask & (1u << j)))
+				continue;
+
+			// the reading is always C, setpoints are in the sender's unit
+			fprintf(out, "%s{\"id\":%d,\"name\":\"%s\",\"sensorReady\":%d,\"temperature\":%s,\"humidity\":%s,"
+				"\"hvacMode\":%d,\"fanMode\":%d,\"hvacOn\":%d,\"unit\":\"%s\",\"heatTemp\":%s,\"coolTemp\":%s,\"offsetVal\":%s,"
+				"\"relays\":{\"blower\":%d,\"ac\":%d,\"heat\":%d},\"reads\":%lu,\"failures\":%lu}",
+				firstZone ? "" : ",", j, t->zoneName, !!(t->flags & TELEMETRY_READY), unit_format(temp, t->temperature),
+				unit_format(hum, t->humidity), t->hvacMode, t->fanMode, !!(t->flags & TELEMETRY_HVACON),
+				unit_name(t->flags & TELEMETRY_CELSIUS ? UNIT_C : UNIT_F), unit_format(heat, t->heatTemp),
+				unit_format(cool, t->coolTemp), unit_format(offset, t->offsetVal),
+				!!(t->relays & (1 << RELAY_BLOWER)), !!(t->relays & (1 << RELAY_AC)), !!(t->relays & (1 << RELAY_HEAT)),
+				(unsigned long)t->reads, (unsigned long)t->failures);
+			firstZone = 0;
+		}
+		fputs("]}", out);
+	}
+	fputs("]}\n", out);
+}
+
+static void fleet_table(FILE *out, uint64_t now)
+{
+	unsigned long lost = 0;
+	int i, j;
+
+	fprintf(out, "%-21s %-15s %-10s %8s %6s %6s %6s\n", "sender", "host", "zone", "temp C", "recv", "lost", "age s");
+	for(i = 0; i < MAXNODES; i++)
+	{
+		struct node *n = &nodes[i];
+		char sender[32];
+		char temp[UNITTEXT];
+
+		if(!n->used)
+			continue;
+		lost += n->lost;
+		snprintf(sender, sizeof(sender), "%s:%u", inet_ntoa(n->addr), n->port);
+		for(j = 0; j < MAXZONES; j++)
+		{
+			if(n->zoneMask & (1u << j))
+				fprintf(out, "%-21s %-15s %-10s %8s %6lu %6lu %6llu\n", sender, n->host, n->zones[j].zoneName,
+					unit_format(temp, n->zones[j].temperature), n->received, n->lost, (unsigned long long)(now - n->lastSeen) / 1000);
+		}
+	}
+	fprintf(out, "%d senders, %lu datagrams, %lu malformed, %lu dropped, %lu evicted, %lu lost\n", numNodes, datagrams, malformed,
+		dropped, evicted, lost);
+}
+
+static int answer_fleet(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
+	const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls)
+{
+	struct MHD_Response *response;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *out;
+	int ret;
+
+	out = open_memstream(&body, &len);
+	if(out == NULL)
+		return MHD_NO;
+	pthread_mutex_lock(&fleetLock);
+	fleet_json(out, monotonic_ms());
+	pthread_mutex_unlock(&fleetLock);
+	fclose(out);
+
+	response = MHD_create_response_from_buffer(len, body, MHD_RESPMEM_MUST_FREE);
+	if(!response)
+	{
+		free(body);
+		return MHD_NO;
+	}
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+	MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+
+	return ret;
+}
+
+// p prints the fleet, j the JSON, q quits
+static void fleet_stdin(int fd, short revents, void *arg)
+{
+	char buf[256];
+	ssize_t n;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	if(n <= 0)
+	{
+		event_remove(fd);
+		return;
+	}
+	buf[n] = '\0';
+
+	pthread_mutex_lock(&fleetLock);
+	if(strchr(buf, 'q'))
+		*(int *)arg = 1;
+	else if(strchr(buf, 'j'))
+		fleet_json(stdout, monotonic_ms());
+	else
+		fleet_table(stdout, monotonic_ms());
+	pthread_mutex_unlock(&fleetLock);
+	fflush(stdout);
+}
+
+// listen on "[address:]port", joining the group if the address is multicast
+int fleet_run(const char *spec, int port)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	struct MHD_Daemon *daemon;
+	uint64_t now, lastSweep = 0;
+	int fd, quit = 0;
+	int one = 1, rcvbuf = 4 << 20;
+
+	if(!telemetry_address(spec, &addr))
+	{
+		printf("Bad aggregator address %s, expected [address:]port\n", spec);
+		return 0;
+	}
+
+	log_init(getenv("THERMOSTAT_LOG"), LVL_INFO);
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+	{
+		printf("Error opening aggregator socket\n");
+		return 0;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	// room for bursts from thousands of senders between passes
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&mreq, 0, sizeof(mreq));
+	if(IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+	{
+		mreq.imr_multiaddr = addr.sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	}
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		(mreq.imr_multiaddr.s_addr && setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0))
+	{
+		printf("Error listening for telemetry on %s: %s\n", spec, strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, port, NULL, NULL, &answer_fleet, NULL, MHD_OPTION_END);
+	if(daemon == NULL)
+	{
+		printf("Error initializing webserver\n");
+		close(fd);
+		return 0;
+	}
+
+	printf("Aggregating telemetry from %s, fleet view on port %d\n", spec, port);
+	printf("p: print fleet, j: print fleet JSON, q: quit\n");
+	fflush(stdout);
+	log_event(LVL_INFO, "aggregator", "address=%s port=%d", spec, port);
+
+	event_add(fd, POLLIN, receive_event, NULL);
+	event_add(fileno(stdin), POLLIN, fleet_stdin, &quit);
+	while(!quit)
+	{
+		event_poll(SWEEPEVERY);
+
+		// every wake is a batch of datagrams on a busy fleet, sweep by the clock
+		now = monotonic_ms();
+		if(now - lastSweep < SWEEPEVERY)
+			continue;
+		lastSweep = now;
+		pthread_mutex_lock(&fleetLock);
+		evict(now, EVICTAFTER);
+		pthread_mutex_unlock(&fleetLock);
+	}
+
+	MHD_stop_daemon(daemon);
+	event_remove(fd);
+	close(fd);
+	log_shutdown();
+
+	return 1;
+}
@@ -0,0 +1,149 @@
+/*
+ *      history.c:
+ *      Recent readings of every zone, one ring of fixed size samples per
+ *      zone in time order, so a time range is found by binary search.
+ *      Written from the main loop, read from the web server thread.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "history.h"
+#include "thermostat.h"
+
+struct history
+{
+	// samples written so far, the ring holds the last HISTORYSIZE
+	unsigned long head;
+	struct history_sample samples[HISTORYSIZE];
+};
+
+static struct history history[MAXZONES];
+static pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+void history_add(int zone, uint32_t time, int t, int h, int relays, int hvacOn)
+{
+	struct history *hist = &history[zone];
+	struct history_sample *s;
+
+	pthread_mutex_lock(&historyLock);
+	// a clock stepped backwards would break the ordering, hold the last time
+	if(hist->head && time < hist->samples[(hist->head - 1) & (HISTORYSIZE - 1)].time)
+		time = hist->samples[(hist->head - 1) & (HISTORYSIZE - 1)].time;
+
+	s = &hist->samples[hist->head & (HISTORYSIZE - 1)];
+	s->time = time;
+	s->temperature = t;
+	s->humidity = h;
+	s->relays = relays;
+	s->hvacOn = hvacOn;
+	hist->head++;
+	pthread_mutex_unlock(&historyLock);
+}
+
+int history_count(int zone)
+{
+	int count;
+
+	pthread_mutex_lock(&historyLock);
+	count = history[zone].head < HISTORYSIZE ? history[zone].head : HISTORYSIZE;
+	pthread_mutex_unlock(&historyLock);
+
+	return count;
+}
+
+// time of the oldest sample still kept, 0 if there are none yet
+int history_oldest(int zone, uint32_t *time)
+{
+	struct history *hist = &history[zone];
+	int found;
+
+	pthread_mutex_lock(&historyLock);
+	found = hist->head > 0;
+	if(found)
+		*time = hist->samples[(hist->head > HISTORYSIZE ? hist->head - HISTORYSIZE : 0) & (HISTORYSIZE - 1)].time;
+	pthread_mutex_unlock(&historyLock);
+
+	return found;
+}
+
+// position of the first sample at or after from, lock held
+static unsigned long find(const struct history *hist, uint32_t from)
+{
+	unsigned long lo, hi, mid;
+
+	lo = hist->head > HISTORYSIZE ? hist->head - HISTORYSIZE : 0;
+	hi = hist->head;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(hist->samples[mid & (HISTORYSIZE - 1)].time < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// copy up to max samples with from <= time < to, oldest first
+int history_query(int zone, uint32_t from, uint32_t to, struct history_sample *out, int max)
+{
+	struct history *hist = &history[zone];
+	unsigned long lo;
+	int count = 0;
+
+	pthread_mutex_lock(&historyLock);
+	for(lo = find(hist, from); lo < hist->head && count < max; lo++)
+	{
+		const struct history_sample *s = &hist->samples[lo & (HISTORYSIZE - 1)];
+
+		if(s->time >= to)
+			break;
+		out[count++] = *s;
+	}
+	pthread_mutex_unlock(&historyLock);
+
+	return count;
+}
+
+// where a reader walking forward from time from starts, see history_read
+unsigned long history_seek(int zone, uint32_t from)
+{
+	unsigned long pos;
+
+	pthread_mutex_lock(&historyLock);
+	pos = find(&history[zone], from);
+	pthread_mutex_unlock(&historyLock);
+
+	return pos;
+}
+
+// copy up to max samples from *pos on with time < to and advance *pos,
+// so a long range is read in pieces without holding the lock. Samples
+// overwritten since the last call are counted in skipped.
+int history_read(int zone, unsigned long *pos, uint32_t to, struct history_sample *out, int max, unsigned long *skipped)
+{
+	struct history *hist = &history[zone];
+	unsigned long tail;
+	int count = 0;
+
+	pthread_mutex_lock(&historyLock);
+	tail = hist->head > HISTORYSIZE ? hist->head - HISTORYSIZE : 0;
+	if(*pos < tail)
+	{
+		*skipped += tail - *pos;
+		*pos = tail;
+	}
+	for(; *pos < hist->head && count < max; (*pos)++)
+	{
+		const struct history_sample *s = &hist->samples[*pos & (HISTORYSIZE - 1)];
+
+		if(s->time >= to)
+			break;
+		out[count++] = *s;
+	}
+	pthread_mutex_unlock(&historyLock);
+
+	return count;
+}
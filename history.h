@@ -0,0 +1,28 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+// samples kept per zone, a power of two
+#define HISTORYSIZE 4096
+
+struct history_sample
+{
+	// wall clock, seconds since the epoch
+	uint32_t time;
+	// tenths of a degree C and percent
+	int16_t temperature;
+	uint16_t humidity;
+	// relay bits, 1 << RELAY_*
+	uint8_t relays;
+	uint8_t hvacOn;
+};
+
+void history_add(int zone, uint32_t time, int t, int h, int relays, int hvacOn);
+int history_query(int zone, uint32_t from, uint32_t to, struct history_sample *out, int max);
+int history_count(int zone);
+int history_oldest(int zone, uint32_t *time);
+unsigned long history_seek(int zone, uint32_t from);
+int history_read(int zone, unsigned long *pos, uint32_t to, struct history_sample *out, int max, unsigned long *skipped);
+
+#endif
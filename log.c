@@ -0,0 +1,325 @@
+/*
+ *      log.c:
+ *      Asynchronous event log. Producers format a key=value record into a
+ *      lock-free ring and return, a background thread does the blocking
+ *      I/O to stderr, a size-rotated file or syslog. When the ring is full
+ *      the record is dropped and counted rather than stalling the caller.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+#define LOGSLOTS 256
+#define LOGEVENT 24
+#define LOGTEXT 200
+#define LOGROTATESIZE (1024 * 1024)
+
+enum log_output
+{
+	OUT_STREAM, OUT_FILE, OUT_SYSLOG
+};
+
+// one ring slot, seq tells producers and the writer who owns it
+struct log_slot
+{
+	unsigned long seq;
+	uint64_t timestamp;
+	int level;
+	char event[LOGEVENT];
+	char text[LOGTEXT];
+};
+
+static struct log_slot ring[LOGSLOTS];
+static unsigned long head = 0;
+static unsigned long tail = 0;
+static unsigned long dropped = 0;
+static int minLevel = LVL_INFO;
+static int running = 0;
+static pthread_t writer;
+
+// stderr by default, stdout belongs to the command prompt
+static int output = OUT_STREAM;
+static FILE *logFile = NULL;
+static char logPath[256];
+
+static const char *levelNames[] = { "debug", "info", "warn", "error" };
+static const int syslogLevels[] = { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR };
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// move the current file to .1 once it grows past the limit
+static void rotate_file(void)
+{
+	char old[sizeof(logPath) + 2];
+	struct stat st;
+
+	if(fstat(fileno(logFile), &st) < 0 || st.st_size < LOGROTATESIZE)
+		return;
+
+	snprintf(old, sizeof(old), "%s.1", logPath);
+	fclose(logFile);
+	rename(logPath, old);
+	logFile = fopen(logPath, "a");
+	if(logFile == NULL)
+	{
+		// fall back rather than lose everything
+		logFile = stderr;
+		output = OUT_STREAM;
+	}
+}
+
+static void write_record(struct log_slot *slot)
+{
+	char line[LOGEVENT + LOGTEXT + 64];
+
+	snprintf(line, sizeof(line), "ts=%llu.%06llu level=%s event=%s%s%s",
+		(unsigned long long)(slot->timestamp / 1000000000ULL),
+		(unsigned long long)(slot->timestamp % 1000000000ULL / 1000),
+		levelNames[slot->level], slot->event,
+		slot->text[0] ? " " : "", slot->text);
+
+	switch(output)
+	{
+		case OUT_SYSLOG:
+		{
+			syslog(syslogLevels[slot->level], "%s", line + strcspn(line, " ") + 1);
+		}
+		break;
+
+		default:
+		{
+			fprintf(logFile, "%s\n", line);
+		}
+		break;
+	}
+}
+
+// drain the ring, returns number of records written
+static int drain(void)
+{
+	int count = 0;
+
+	while(1)
+	{
+		struct log_slot *slot = &ring[tail % LOGSLOTS];
+
+		// slot not published yet
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		write_record(slot);
+		__atomic_store_n(&slot->seq, tail + LOGSLOTS, __ATOMIC_RELEASE);
+		tail++;
+		count++;
+	}
+
+	return count;
+}
+
+static void *writer_thread(void *arg)
+{
+	unsigned long reported = 0;
+	struct timespec idle = { 0, 20 * 1000000 };
+
+	while(1)
+	{
+		int stop = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+		unsigned long lost;
+		int count = drain();
+
+		lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+		if(lost != reported)
+		{
+			struct log_slot note;
+
+			note.timestamp = monotonic_ns();
+			note.level = LVL_WARN;
+			strcpy(note.event, "log_dropped");
+			snprintf(note.text, sizeof(note.text), "count=%lu total=%lu", lost - reported, lost);
+			write_record(&note);
+			reported = lost;
+			count++;
+		}
+
+		if(count)
+		{
+			if(output != OUT_SYSLOG)
+			{
+				fflush(logFile);
+			}
+			if(output == OUT_FILE)
+			{
+				rotate_file();
+			}
+		}
+		else if(stop)
+		{
+			break;
+		}
+		else
+		{
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+// target is "stderr" (the default), "stdout", "syslog" or a file path
+int log_init(const char *target, int level)
+{
+	unsigned long i;
+
+	minLevel = level;
+	for(i = 0; i < LOGSLOTS; i++)
+	{
+		ring[i].seq = i;
+	}
+
+	if(target == NULL || strcmp(target, "stderr") == 0 || strcmp(target, "stdout") == 0)
+	{
+		logFile = target && strcmp(target, "stdout") == 0 ? stdout : stderr;
+		output = OUT_STREAM;
+	}
+	else if(strcmp(target, "syslog") == 0)
+	{
+		output = OUT_SYSLOG;
+		openlog("thermostat", LOG_PID, LOG_DAEMON);
+	}
+	else
+	{
+		snprintf(logPath, sizeof(logPath), "%s", target);
+		logFile = fopen(logPath, "a");
+		if(logFile == NULL)
+		{
+			printf("Error opening log file %s\n", logPath);
+			return 0;
+		}
+		output = OUT_FILE;
+	}
+
+	running = 1;
+	if(pthread_create(&writer, NULL, writer_thread, NULL) != 0)
+	{
+		printf("Error starting log writer\n");
+		running = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+// flush everything queued and stop the writer
+void log_shutdown(void)
+{
+	if(!running)
+		return;
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+
+	if(output == OUT_FILE)
+	{
+		fclose(logFile);
+	}
+	else if(output == OUT_SYSLOG)
+	{
+		closelog();
+	}
+}
+
+// queue a record, never blocks, safe from any thread
+void log_event(int level, const char *event, const char *fmt, ...)
+{
+	struct log_slot *slot;
+	unsigned long pos;
+	va_list args;
+
+	if(level < minLevel)
+		return;
+
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	while(1)
+	{
+		long diff;
+
+		slot = &ring[pos % LOGSLOTS];
+		diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if(diff == 0)
+		{
+			// slot is free, claim it
+			if(__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if(diff < 0)
+		{
+			// ring full, writer is behind
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->timestamp = monotonic_ns();
+	slot->level = level;
+	snprintf(slot->event, sizeof(slot->event), "%s", event);
+	va_start(args, fmt);
+	vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+	va_end(args);
+
+	// publish to the writer
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long log_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// outside input as one quoted value, so spaces, quotes, key= or line
+// breaks in it can't pass for fields or records of their own; text that
+// doesn't fit in size is cut short
+const char *log_quote(char *buf, size_t size, const char *text)
+{
+	size_t len = 0;
+	unsigned char c;
+
+	buf[len++] = '"';
+	// room for the longest escape, the closing quote and the terminator
+	for(; *text && len + 6 <= size; text++)
+	{
+		c = *text;
+		if(c == '"' || c == '\\')
+		{
+			buf[len++] = '\\';
+			buf[len++] = c;
+		}
+		else if(c < 0x20 || c >= 0x7F)
+			len += snprintf(buf + len, size - len, "\\x%02x", c);
+		else
+			buf[len++] = c;
+	}
+	buf[len++] = '"';
+	buf[len] = '\0';
+
+	return buf;
+}
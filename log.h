@@ -0,0 +1,22 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+
+// a log_quote buffer that fits any setting value
+#define LOGQUOTE 72
+
+// log levels, records below the configured level are discarded
+enum log_level
+{
+	LVL_DEBUG, LVL_INFO, LVL_WARN, LVL_ERROR
+};
+
+int log_init(const char *target, int level);
+void log_shutdown(void);
+void log_event(int level, const char *event, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+unsigned long log_dropped(void);
+const char *log_quote(char *buf, size_t size, const char *text);
+
+#endif
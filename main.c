@@ -11,7 +11,28 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "commands.h"
+#include "config.h"
+#include "control.h"
+#include "ctlsock.h"
+#include "event.h"
+#include "export.h"
 #include "locking.h"
+#include "record.h"
+#include "rules.h"
+#include "sensor.h"
+#include "shmstate.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "watch.h"
+#include "log.h"
+#include "mqtt.h"
+#include "render.h"
+#include "thermostat.h"
+#include "trace.h"
 
 // libmicrohttpd stuff
 #include <sys/types.h>
@@ -19,217 +40,198 @@
 #include <sys/socket.h>
 #include <microhttpd.h>
 #define PORT 8888
+#define TEMPLATEFILE "main.html"
 #define GET 0
 #define POST 1
-#define MAXANSWERSIZE 512
 #define POSTBUFFERSIZE 512
+#define JSONSIZE (512 * MAXZONES)
 
 #define MAXBYTES 80
 
+// longest the main loop sleeps between control passes, in ms
+#define LOOPINTERVAL 100
+
 struct connection_info_struct
 {
   int connectiontype;
-  char *answerstring;
+  int zone;
   struct MHD_PostProcessor *postprocessor;
+#ifdef THERMOSTAT_TRACE
+  uint64_t traceStart;
+#endif
 };
 
-// enum for hvac mode
-enum hvac
+// rendered responses, shared by every client until the state version moves
+struct response_cache
 {
-	AC, HEAT, OFF
+	pthread_mutex_t lock;
+	unsigned long version;
+	char etag[24];
+	struct MHD_Response *html[MAXZONES];
+	struct MHD_Response *json;
+	struct MHD_Response *notModified;
 };
 
-// enum for fan mode
-enum fan
+static struct response_cache cache = { PTHREAD_MUTEX_INITIALIZER, 0, "", { NULL }, NULL, NULL };
+
+// every sensor, relay set and its settings
+struct zone zones[MAXZONES];
+int numZones = 0;
+
+// zone the stdin prompt is working on
+static int promptZone = 0;
+
+// starts at 1 so the empty cache is always stale
+static unsigned long stateVersion = 1;
+
+unsigned long state_version(void)
 {
-	ON, AUTO
-};
+	return __sync_add_and_fetch(&stateVersion, 0);
+}
 
-// config data
-int hvacReady = 0;
-int hvacOn = 0;
-int sensorReady = 0;
-int hvacMode = AC;
-int fanMode = ON;
-float heatTemp = 0.0;
-float coolTemp = 0.0;
-float offsetVal = 0.0;
-
-// data from am2302
-float temperature;
-float humidity;
-
-// load html file
-char *loadHTML(char *filename)
+void state_changed(void)
 {
-	FILE *file = fopen(filename, "rb");
-	if(file == NULL)
-	{
-		printf("File couldn't be opened\n");
-		return NULL;
-	}
-	int prev = ftell(file);
-	fseek(file, 0L, SEEK_END);
-	long int size = ftell(file);
-	fseek(file, prev, SEEK_SET);
+	__sync_add_and_fetch(&stateVersion, 1);
+}
 
-	char *data = malloc(sizeof(char)*size);
-	if(data == NULL)
+// wrap a rendered buffer in a response, MHD frees it with the last reference
+static struct MHD_Response *make_response(char *body, size_t len, const char *type, const char *etag)
+{
+	struct MHD_Response *response;
+
+	response = MHD_create_response_from_buffer (len, body, MHD_RESPMEM_MUST_FREE);
+	if (!response)
 	{
-		printf("Memory alloc error\n");
+		free(body);
 		return NULL;
 	}
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+	MHD_add_response_header (response, MHD_HTTP_HEADER_ETAG, etag);
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
 
-  	fread(data, 1, size, file);
-
-	return data;
+	return response;
 }
 
-static int send_page (struct MHD_Connection *connection, const char *page)
+// drop responses from an older state version, cache lock held
+static void refresh_cache()
 {
-  	int ret;
-  	struct MHD_Response *response;
+	unsigned long version = state_version();
+	int i;
 
-  	response = MHD_create_response_from_buffer (strlen (page), (void *) page, MHD_RESPMEM_PERSISTENT);
-  	if (!response)
-    		return MHD_NO;
+	if (version == cache.version)
+		return;
 
-  	ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
-  	MHD_destroy_response (response);
+	snprintf(cache.etag, sizeof(cache.etag), "\"v%lu\"", version);
 
-	return ret;
+	// in-flight connections keep their own reference to the old responses
+	for (i = 0; i < MAXZONES; i++)
+	{
+		if (cache.html[i])
+			MHD_destroy_response (cache.html[i]);
+		cache.html[i] = NULL;
+	}
+	if (cache.json)
+		MHD_destroy_response (cache.json);
+	if (cache.notModified)
+		MHD_destroy_response (cache.notModified);
+	cache.json = cache.notModified = NULL;
+
+	cache.notModified = MHD_create_response_from_buffer (0, (void *) "", MHD_RESPMEM_PERSISTENT);
+	if (cache.notModified)
+		MHD_add_response_header (cache.notModified, MHD_HTTP_HEADER_ETAG, cache.etag);
+
+	// a change during rendering leaves the version stale and renders again
+	cache.version = version;
 }
 
-static int iterate_post (void *coninfo_cls, enum MHD_ValueKind kind, const char *key,
-              const char *filename, const char *content_type,
-              const char *transfer_encoding, const char *data, uint64_t off,
-              size_t size)
+// render a body once per state version, the first request after a change pays for it
+static struct MHD_Response *cached_body (int zone, int json)
 {
-	struct connection_info_struct *con_info = coninfo_cls;
-	char *page = loadHTML("main.html");
+	char *body;
+	size_t len;
 
-	if (0 == strcmp (key, "hvacmode"))
+	if (json)
 	{
-      		if (size > 0)
-        	{
-          		char *answerstring;
-          		answerstring = malloc (MAXANSWERSIZE);
-          		if (!answerstring)
-            			return MHD_NO;
-
-          		con_info->answerstring = page;
-			puts("");
-			printf("New HVAC mode is: %s\n", data);
-			printf("-> ");
-
-			// actually update data
-			if (0 == strcmp (data, "ac"))
-			{
-				hvacMode = AC;
-			}
-			else if (0 == strcmp (data, "heat"))
-			{
-				hvacMode = HEAT;
-			}
-			else if (0 == strcmp (data, "off"))
-			{
-				hvacMode = OFF;
-			}
-        	}
-      		else
-        		con_info->answerstring = NULL;
+		if (!cache.json && (body = malloc(JSONSIZE)))
+		{
+			TRACE_START(start);
+			config_lock();
+			len = render_json(body, JSONSIZE, cache.version);
+			config_unlock();
+			TRACE_END(start, TR_RENDER, TR_NOZONE, 1);
+			cache.json = make_response(body, len, "application/json", cache.etag);
+		}
+		return cache.json;
 	}
-	if (0 == strcmp (key, "fanmode"))
+
+	if (!cache.html[zone] && (body = malloc(render_html_size())))
 	{
-      		if (size > 0)
-        	{
-          		char *answerstring;
-          		answerstring = malloc (MAXANSWERSIZE);
-          		if (!answerstring)
-            			return MHD_NO;
+		TRACE_START(start);
+		config_lock();
+		len = render_html(zone, body, render_html_size());
+		config_unlock();
+		TRACE_END(start, TR_RENDER, zone, 0);
+		cache.html[zone] = make_response(body, len, "text/html", cache.etag);
+	}
+	return cache.html[zone];
+}
 
-          		con_info->answerstring = page;
-			puts("");
-			printf("New fan mode is: %s\n", data);
-			printf("-> ");
+static int send_cached (struct MHD_Connection *connection, int zone, int json)
+{
+	struct MHD_Response *response;
+	const char *match;
+	unsigned int status = MHD_HTTP_OK;
+	int ret;
 
-			// actually update data
-			if (0 == strcmp (data, "auto"))
-			{
-				fanMode = AUTO;
-			}
-			else
-			{
-				fanMode = ON;
-			}
-        	}
-      		else
-        		con_info->answerstring = NULL;
-	}
-  	if (0 == strcmp (key, "cooltemp"))
-    	{
-      		if (size > 0)
-        	{
-          		char *answerstring;
-          		answerstring = malloc (MAXANSWERSIZE);
-          		if (!answerstring)
-            			return MHD_NO;
+	match = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
 
-          		con_info->answerstring = page;
-			puts("");
-			printf("New Cool temp is: %s\n", data);
-			printf("-> ");
+	pthread_mutex_lock(&cache.lock);
+	refresh_cache();
+	if (match && 0 == strcmp (match, cache.etag))
+	{
+		response = cache.notModified;
+		status = MHD_HTTP_NOT_MODIFIED;
+	}
+	else
+		response = cached_body(zone, json);
 
-			// actually update data
-			coolTemp = atof(data);
-        	}
-      		else
-        		con_info->answerstring = NULL;
-    	}
-	if (0 == strcmp (key, "hightemp"))
+	if (!response)
 	{
-		if (size > 0)
-		{
-          		char *answerstring;
-          		answerstring = malloc (MAXANSWERSIZE);
-          		if (!answerstring)
-            			return MHD_NO;
+		pthread_mutex_unlock(&cache.lock);
+		return MHD_NO;
+	}
 
-          		con_info->answerstring = page;
-			puts("");
-			printf("New High temp is: %s\n", data);
-			printf("-> ");
+	// queueing takes a reference, so the response outlives a cache refresh
+	ret = MHD_queue_response (connection, status, response);
+	pthread_mutex_unlock(&cache.lock);
 
-			// actually update data
-			heatTemp = atof(data);
-		}
-		else
-			con_info->answerstring = NULL;
-	}
-	if (0 == strcmp (key, "offsetvalue"))
-	{
-		if (size > 0)
-		{
-          		char *answerstring;
-          		answerstring = malloc (MAXANSWERSIZE);
-          		if (!answerstring)
-            			return MHD_NO;
+	return ret;
+}
 
-          		con_info->answerstring = page;
-			puts("");
-			printf("New sensor offset value is: %s\n", data);
-			printf("-> ");
+static int send_error (struct MHD_Connection *connection, unsigned int status, const char *message)
+{
+	struct MHD_Response *response;
+	int ret;
 
-			// actually update data
-			offsetVal = atof(data);
+	response = MHD_create_response_from_buffer (strlen (message), (void *) message, MHD_RESPMEM_PERSISTENT);
+	if (!response)
+		return MHD_NO;
 
-			return MHD_NO;
-		}
-		else
-			con_info->answerstring = NULL;
-	}
+	ret = MHD_queue_response (connection, status, response);
+	MHD_destroy_response (response);
 
-	free(page);
+	return ret;
+}
+
+static int iterate_post (void *coninfo_cls, enum MHD_ValueKind kind, const char *key,
+              const char *filename, const char *content_type,
+              const char *transfer_encoding, const char *data, uint64_t off,
+              size_t size)
+{
+	struct connection_info_struct *con_info = coninfo_cls;
+
+	if (size > 0)
+		settings_apply(con_info->zone, key, data, "http");
 
 	return MHD_YES;
 }
@@ -242,100 +244,117 @@ static void request_completed (void *cls, struct MHD_Connection *connection,
   	if (NULL == con_info)
     		return;
 
+	TRACE_END(con_info->traceStart, TR_HTTP_REQUEST, con_info->zone, con_info->connectiontype == POST);
+
   	if (con_info->connectiontype == POST)
     	{
-      	MHD_destroy_post_processor (con_info->postprocessor);
-      		if (con_info->answerstring)
-        		free (con_info->answerstring);
+      		MHD_destroy_post_processor (con_info->postprocessor);
     	}
 
   	free (con_info);
 	*con_cls = NULL;
 }
 
-// connection answer function
-int answer_to_connection(void *cls, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls)
+// parse a from/to argument, seconds since the epoch
+static int time_arg (struct MHD_Connection *connection, const char *name, unsigned long *out)
+{
+	const char *arg = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, name);
+	char *end;
+
+	if (arg == NULL)
+		return 1;
+	errno = 0;
+	*out = strtoul (arg, &end, 10);
+
+	return end != arg && *end == '\0' && errno == 0 && *out <= 0xFFFFFFFFUL;
+}
+
+// history as CSV or NDJSON, streamed block by block as the client reads,
+// gzipped if the client takes it
+static int send_export (struct MHD_Connection *connection)
 {
-	// load main html
-	char *page = loadHTML("main.html");
-	char *newPage = malloc(strlen(page)*sizeof(char)+100);
-	
-	// add current data to web page
-	char *hvacModeString;
-	char *fanModeString;
-	switch(hvacMode)
+	struct MHD_Response *response;
+	struct export *e;
+	const char *arg;
+	unsigned long from = 0, to = 0xFFFFFFFFUL;
+	char start[16];
+	int zone = -1, format = EXPORT_CSV, gzip;
+	int ret;
+
+	if (!time_arg (connection, "from", &from) || !time_arg (connection, "to", &to))
+		return send_error (connection, MHD_HTTP_BAD_REQUEST, "Bad time range\n");
+
+	arg = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, "format");
+	if (arg && 0 == strcmp (arg, "ndjson"))
+		format = EXPORT_NDJSON;
+	else if (arg && 0 != strcmp (arg, "csv"))
+		return send_error (connection, MHD_HTTP_BAD_REQUEST, "Format is csv or ndjson\n");
+
+	// every zone unless one is asked for
+	arg = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, "zone");
+	if (arg)
+		zone = config_zone (arg);
+
+	arg = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+	gzip = arg && strstr (arg, "gzip");
+
+	e = export_open (zone, from, to, format, gzip);
+	if (e == NULL)
+		return send_error (connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Out of memory\n");
+
+	response = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN, EXPORTBLOCK, export_read, e, export_free);
+	if (!response)
 	{
-		case AC:
-		{
-			hvacModeString = "AC";
-			switch(fanMode)
-			{
-				case AUTO:
-				{
-					fanModeString = "Auto";
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "selected", "", "", "selected", "", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-
-				case ON:
-				{
-					fanModeString = "On";
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "selected", "", "", "", "selected", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-			}
-		}
-		break;
+		export_free (e);
+		return MHD_NO;
+	}
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE,
+			format == EXPORT_CSV ? "text/csv" : "application/x-ndjson");
+	if (gzip)
+		MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	// later than from when older samples have already been overwritten
+	snprintf (start, sizeof (start), "%lu", (unsigned long) export_start (e));
+	MHD_add_response_header (response, "X-Export-Start", start);
+	ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+	MHD_destroy_response (response);
 
-		case HEAT:
-		{
-			hvacModeString = "Heat";
-			switch(fanMode)
-			{
-				case AUTO:
-				{
-					fanModeString = "Auto";
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "", "selected", "", "selected", "", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-
-				case ON:
-				{
-					fanModeString = "On";
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "", "selected", "", "", "selected", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-			}
-		}
-		break;
+	return ret;
+}
 
-		case OFF:
-		{
-			hvacModeString = "Off";
-			switch(fanMode)
-			{
-				case AUTO:
-				{
-					fanModeString = "Auto";
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "", "", "selected", "selected", "", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-
-				case ON:
-				{
-					fanModeString = "On";
-
-					snprintf(newPage, strlen(page)+20, page, CtoF(temperature)+offsetVal, hvacModeString, fanModeString, "", "", "selected", "", "selected", heatTemp, coolTemp, offsetVal);
-				}
-				break;
-			}
-		}
-		break;
+// JSON written by a dump function, like the span rings, never cached
+static int send_dump (struct MHD_Connection *connection, void (*dump)(FILE *out))
+{
+	struct MHD_Response *response;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *out;
+	int ret;
+
+	out = open_memstream (&body, &len);
+	if (out == NULL)
+		return send_error (connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Out of memory\n");
+	dump (out);
+	fclose (out);
+
+	response = MHD_create_response_from_buffer (len, body, MHD_RESPMEM_MUST_FREE);
+	if (!response)
+	{
+		free (body);
+		return MHD_NO;
 	}
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+	MHD_add_response_header (response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+	ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+	MHD_destroy_response (response);
 
-	//free(page);
-	//free(hvacModeString);
-	//free(fanModeString);
+	return ret;
+}
+
+// connection answer function
+int answer_to_connection(void *cls, struct MHD_Connection *connection, const char *url, const char *method, const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls)
+{
+	const char *zoneArg;
 
 	if (NULL == *con_cls)
     	{
@@ -344,7 +363,21 @@ int answer_to_connection(void *cls, struct MHD_Connection *connection, const cha
       		con_info = malloc (sizeof (struct connection_info_struct));
       		if (NULL == con_info)
         		return MHD_NO;
-      		con_info->answerstring = NULL;
+
+		// the span runs from the first callback to request_completed
+		TRACE_THREAD("http");
+#ifdef THERMOSTAT_TRACE
+		con_info->traceStart = trace_clock();
+#endif
+
+		// ?zone=NAME or index picks the zone, the first one otherwise
+		zoneArg = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, "zone");
+		con_info->zone = zoneArg ? config_zone(zoneArg) : 0;
+		if (con_info->zone < 0)
+		{
+			free (con_info);
+			return send_error (connection, MHD_HTTP_NOT_FOUND, "No such zone\n");
+		}
 
       		if (0 == strcmp (method, "POST"))
         	{
@@ -367,11 +400,6 @@ int answer_to_connection(void *cls, struct MHD_Connection *connection, const cha
       		return MHD_YES;
     	}
 
-  	if (0 == strcmp (method, "GET"))
-    	{
-     		return send_page (connection, newPage);
-    	}
-
 	if (0 == strcmp (method, "POST"))
     	{
       		struct connection_info_struct *con_info = *con_cls;
@@ -384,187 +412,184 @@ int answer_to_connection(void *cls, struct MHD_Connection *connection, const cha
 
        			return MHD_YES;
         	}
-      		else if (NULL != con_info->answerstring)
-       			return send_page (connection, newPage);
     	}
 
-	return send_page (connection, newPage);
+#ifdef THERMOSTAT_TRACE
+	if (0 == strcmp (url, "/api/v1/trace"))
+		return send_dump (connection, trace_dump);
+#endif
+	if (0 == strcmp (url, "/api/v1/sensors"))
+		return send_dump (connection, sensor_dump);
+	if (0 == strcmp (url, "/api/v1/export"))
+		return send_export (connection);
+
+	return send_cached (connection, ((struct connection_info_struct *) *con_cls)->zone,
+			0 == strcmp (url, "/api/v1/state"));
 }
 
-// LED Yellow
-void blowerOn()
+// drive the relays, and let rules watching a run see it start and stop
+static void relay_live(struct zone *z, int relay, int on, uint64_t now)
 {
-	// PIN  13/GPIO 27
-	digitalWrite(27, HIGH);
+	relay_gpio(z, relay, on, now);
+	rules_relay(z - zones, relay, on, now);
 }
 
-// LED Yellow
-void blowerOff()
+// read a command line from the prompt
+static void stdin_event(int fd, short revents, void *arg)
 {
-	// PIN 13/GPIO 27
-	digitalWrite(27, LOW);
-}
-
-// LED Green
-void ACOn()
-{
-	// PIN 11/GPIO 17
-	digitalWrite(17, HIGH);
-
-	// Safety turn heater off
-	HeatOff();
-}
-
-// LED Green
-void ACoff()
-{
-	// PIN 11/GPIO 17
-	digitalWrite(17, LOW);
-}
+	char buf[MAXBYTES];
+	char *line;
+	ssize_t num_bytes;
 
-// LED Red
-void HeatOn()
-{
-	// PIN 15/GPIO 22
-	digitalWrite(22, HIGH);
+	num_bytes = read(fd, buf, sizeof(buf) - 1);
+	if(num_bytes <= 0)
+	{
+		// stdin closed, keep running as a daemon
+		event_remove(fd);
+		return;
+	}
+	buf[num_bytes] = '\0';
 
-	// Safety turn AC off
-	ACoff();
-}
+	// new line
+	puts("");
 
-// LED Red
-void HeatOff()
-{
-	// PIN 15/GPIO 22
-	digitalWrite(22, LOW);
-}
+	// pasted input can hold several lines
+	for(line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"))
+	{
+		if(command_exec(line, stdout, &promptZone) == CMD_QUIT)
+		{
+			*(int *)arg = 1;
+			return;
+		}
+	}
 
-// default settings
-void defaultSettings(FILE *p)
-{
-	fprintf(p, "hvacMode = 2\n");
-	fprintf(p, "fanMode = 1\n");
-	fprintf(p, "heatTemp = 74.00\n");
-	fprintf(p, "coolTemp = 70.00\n");
-	fprintf(p, "offsetVal = 0.0\n");
+	printf("-> ");
+	fflush(stdout);
 }
 
-// print command line help
-void printHelp()
+// command line usage
+static void usage(const char *name)
 {
-	printf("Valid command options\n");
-    	printf("Note: commands are case sensitive\n");
-	printf("h: help\n");
-	printf("sht = XX.XX: set high temp\n");
-	printf("slt = XX.XX: set low temp\n");
-	printf("sov = XX.XX: set offset value\n");
-	printf("shm = AC/HEAT/OFF: set hvac mode\n");
-	printf("sfm = AUTO/ON: set blower mode\n");
-	printf("ps: print settings\n");
-	printf("p: print temp\n");
-    	printf("s: save settings\n");
-	printf("q: quit\n");
+	printf("usage: %s [-r trace]   run, recording inputs to trace\n", name);
+	printf("       %s -p trace     replay trace, print relay transitions\n", name);
+	printf("       %s -t addr:port also send telemetry datagrams to addr\n", name);
+	printf("       %s -a [addr:]port  aggregate telemetry, serve the fleet view\n", name);
+	printf("       %s -m host[:port][/prefix]  also publish to an MQTT broker\n", name);
+	printf("events go to stderr, THERMOSTAT_LOG=stdout|syslog|path sends them elsewhere\n");
 }
 
 // main loop
-int main()
+int main(int argc, char *argv[])
 {
 	int lockfd;
-	int tries = 100;
-
-	// libmicrohttpd daemon
-	struct MHD_Daemon *daemon;
-
-	daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL, &answer_to_connection, NULL, MHD_OPTION_END);
-	if(daemon == NULL)
-	{
-		printf("Error initializing webserver\n");
-		return 1;
-	}
-
-	// timer counter for reading
-	struct timespec lastReset, currentTime;
-
-	// select data
-	int fd_stdin;
-	fd_set readfds;
-	struct timeval tv;
-	int num_readable;
-	int num_bytes;
-	char buf[MAXBYTES];
-	char *command = malloc(sizeof(char)*MAXBYTES);
-
-	fd_stdin = fileno(stdin);
+	int quit = 0;
+	int opt, i;
+	const char *recordPath = NULL;
+	const char *replayPath = NULL;
+	const char *telemetrySpec = NULL;
+	const char *fleetSpec = NULL;
+	const char *mqttSpec = NULL;
 
-	printf("RPIThermostat v1.0\n");
-	printf("Copyright 2017 ioshomebrew\n");
-	printf("Note: AM2302 sensor takes 5 min to correctly read temperature\n");
+	TRACE_THREAD("main");
 
-	// load config file if exists
-	FILE *config = fopen("config.ini", "r");
-	if(config)
+	while((opt = getopt(argc, argv, "r:p:t:a:m:h")) != -1)
 	{
-		// Read config
-		char *line = malloc(15*sizeof(char));
-		char equal;
-
-		fscanf(config, "%s %c %i", line, &equal, &hvacMode);
-		fscanf(config, "%s %c %i", line, &equal, &fanMode);
-		fscanf(config, "%s %c %f", line, &equal, &heatTemp);
-		fscanf(config, "%s %c %f", line, &equal, &coolTemp);
-		fscanf(config, "%s %c %f", line, &equal, &offsetVal);
-		free(line);
-
-		// Print read settings
-		printf("Settings are: \n");
-		switch(hvacMode)
+		switch(opt)
 		{
-			case AC:
+			case 'r':
 			{
-				printf("AC On\n");
+				recordPath = optarg;
 			}
 			break;
-			
-			case HEAT:
+
+			case 'p':
 			{
-				printf("Heat on\n");
+				replayPath = optarg;
 			}
 			break;
 
-			case OFF:
+			case 't':
 			{
-				printf("HVAC Off\n");
+				telemetrySpec = optarg;
 			}
 			break;
-		}
 
-		switch(fanMode)
-		{
-			case ON:
+			case 'a':
 			{
-				printf("Fan On\n");
+				fleetSpec = optarg;
 			}
 			break;
 
-			case AUTO:
+			case 'm':
 			{
-				printf("Auto Fan\n");
+				mqttSpec = optarg;
 			}
 			break;
+
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+			}
 		}
+	}
+
+	// replay runs headless, no hardware, web server or lock; zones still come from config
+	if(replayPath)
+	{
+		config_load(CONFIGFILE);
+		return replay_run(replayPath, stdout) ? 0 : 1;
+	}
 
-		printf("Heat temp is: %.2f\n", heatTemp);
-		printf("Cool temp is: %.2f\n", coolTemp);		
-		printf("Offset Val is: %.2f\n", offsetVal);
-		puts("");
+	// aggregator only listens, it drives no hardware of its own
+	if(fleetSpec)
+	{
+		return fleet_run(fleetSpec, PORT) ? 0 : 1;
+	}
+
+	// libmicrohttpd daemon
+	struct MHD_Daemon *daemon;
+
+	// event log, written from a background thread
+	if(!log_init(getenv("THERMOSTAT_LOG"), LVL_INFO))
+	{
+		return 1;
+	}
+
+	// load page template once, pages are rendered per state version
+	if(!render_load_template(TEMPLATEFILE))
+	{
+		printf("Error loading %s\n", TEMPLATEFILE);
+		return 1;
+	}
+
+	daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL, &answer_to_connection, NULL,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL, MHD_OPTION_END);
+	if(daemon == NULL)
+	{
+		printf("Error initializing webserver\n");
+		return 1;
+	}
+
+	printf("RPIThermostat v1.0\n");
+	printf("Copyright 2017 ioshomebrew\n");
+	printf("Note: AM2302 sensor takes 5 min to correctly read temperature\n");
+
+	// load config file if exists
+	if(config_load(CONFIGFILE))
+	{
+		// Print read settings
+		for(i = 0; i < numZones; i++)
+		{
+			print_settings(stdout, i);
+			puts("");
+		}
 	}
 	else
 	{
 		// Create config
 		printf("config.ini not found, loading default settings, and creating config file\n");
-		config = fopen("config.ini", "w");
-		defaultSettings(config);
-		fclose(config);
+		config_save();
 	}
 
 	// open lockfile
@@ -579,14 +604,39 @@ int main()
 	wiringPiSetupGpio();
 
 	// setup HVAC Output
-	pinMode(17, OUTPUT);
-	pinMode(27, OUTPUT);
-	pinMode(22, OUTPUT);
+	for(i = 0; i < numZones; i++)
+	{
+		relay_setup(&zones[i]);
+	}
+
+	// i2c devices need root too, open every zone's sensors now
+	if(getenv("THERMOSTAT_W1_ROOT"))
+	{
+		ds18b20_set_root(getenv("THERMOSTAT_W1_ROOT"));
+	}
+	sensor_setup();
 
-	// reset HVAC system
-	blowerOff();
-	ACoff();
-	HeatOff();
+	// alerts and automation, none without a rules file
+	rules_load(RULESFILE);
+
+	// resume from a fresh snapshot, otherwise reset HVAC system
+	control_init(monotonic_ms(), relay_live);
+	snapshot_open(SNAPSHOTFILE);
+	if(!snapshot_restore(monotonic_ms()))
+	{
+		for(i = 0; i < numZones; i++)
+		{
+			blowerOff(&zones[i]);
+			ACoff(&zones[i]);
+			HeatOff(&zones[i]);
+		}
+	}
+
+	// control socket lives in /var/run, create it while still privileged
+	ctlsock_open(CTLSOCKET, &quit);
+
+	// state for local readers, a missing /dev/shm only costs them
+	shmstate_open(SHMNAME);
 
 	// make sure sudo access works
 	if(setuid(getuid()) < 0)
@@ -595,315 +645,86 @@ int main()
 		return -1;
 	}
 
+	// pick up edits to config.ini and the page without a restart
+	if(watch_init())
+	{
+		watch_file(CONFIGFILE, config_reload);
+		watch_file(TEMPLATEFILE, render_reload);
+		watch_file(RULESFILE, rules_reload);
+	}
+
 	// print help menu
-	printHelp();
-	
-	// get current time for lastReset
-	clock_gettime(CLOCK_REALTIME, &lastReset);
+	command_help(stdout);
+
+	// stdin prompt and control socket share the command table
+	event_add(fileno(stdin), POLLIN, stdin_event, &quit);
+
+	if(recordPath && !record_open(recordPath, monotonic_ms()))
+	{
+		return 1;
+	}
+
+	if(telemetrySpec && !telemetry_open(telemetrySpec))
+	{
+		return 1;
+	}
+
+	if(mqttSpec && !mqtt_open(mqttSpec))
+	{
+		return 1;
+	}
 
 	// main loop
 	printf("-> ");
-	while(1)
+	fflush(stdout);
+	while(!quit)
 	{
-		// get current time
-		clock_gettime(CLOCK_REALTIME, &currentTime);
+		// get data from temp sensors
+		sensor_service(monotonic_ms());
 
-		// get data from temp sensor
-		if((currentTime.tv_sec) - (lastReset.tv_sec) >= 3)
-		{
-			clock_gettime(CLOCK_REALTIME, &lastReset);
-			if(read_dht22_dat(&temperature, &humidity))
-			{
-				sensorReady = 1;
-			}
-		}
-
-		// check if program has run long enough to activate HVAC
-		if(clock()/CLOCKS_PER_SEC >= 1)
-		{
-			if(!hvacReady)
-			{
-				printf("HVAC Ready\n");
-				hvacReady = 1;
-			}
-	
-			// see if AC, Heater, or Blower need to be activated
-			switch(fanMode)
-			{
-				case ON:
-				{
-					blowerOn();
-				}
-				break;
-
-				case AUTO:
-				{
-					if(hvacOn)
-					{
-						blowerOn();
-					}
-					else
-					{
-						blowerOff();
-					}
-				}
-				break;
-			}
+		control_step(monotonic_ms());
 
-			switch(hvacMode)
-			{
-				case HEAT:
-				{
-					if(CtoF(temperature)+offsetVal < heatTemp)
-					{
-						// turn heat on
-						hvacOn = 1;
-						HeatOn();
-					}
-					else if(CtoF(temperature)+offsetVal > heatTemp)
-					{
-						// turn heat off
-						hvacOn = 0;
-						HeatOff();
-					}
-				}
-				break;
-
-				case AC:
-				{
-					if(CtoF(temperature)+offsetVal > coolTemp)
-					{
-						// turn ac on
-						hvacOn = 1;
-						ACOn();
-					}
-					else if(CtoF(temperature)+offsetVal < coolTemp)
-					{
-						// turn ac off
-						hvacOn = 0;
-						ACoff();
-					}
-				}
-				break;
-				
-				case OFF:
-				{
-					// make sure ac and heat are off
-					hvacOn = 0;
-					ACoff();
-					HeatOff();
-				}
-				break;
-			}
-		}
+		// write back settings changed from the CLI or web
+		config_service(monotonic_ms());
 
-		// check for input
-		FD_ZERO(&readfds);
-		FD_SET(fileno(stdin), &readfds);
+		// keep the warm start snapshot current
+		snapshot_update(monotonic_ms());
 
-		// pause every 1ms to check for input
-		tv.tv_sec = 0;
-		tv.tv_usec = 1;
+		// and the shared memory copy local readers map
+		shmstate_update(monotonic_ms());
 
-		fflush(stdout);
-		num_readable = select(fd_stdin + 1, &readfds, NULL, NULL, &tv);
-		if (num_readable == -1)
-		{
-			// if error in select function
-			printf("error in select\n");
-		}
-		if (num_readable == 0)
-		{
-			// if no data is entered
-		}
-		else
-		{
-			// get data user entered
-			char equal;
-			num_bytes = read(fd_stdin, buf, MAXBYTES);
-			sscanf(buf, "%s", command);
-		
-			// new line
-			puts("");
-	
-			// process command
-			if(strcmp(command, "p") == 0)
-			{
-               			// print current temperature
-				if(sensorReady)
-				{
-					printf("Current temp is: %.2f\n", CtoF(temperature)+offsetVal);
-				}
-				else
-				{
-					printf("Sensor not ready\n");
-				}
-			}
-			else if(strcmp(command, "h") == 0)
-			{
-                		// print help menu
-				printHelp();
-			}
-			else if(strcmp(command, "q") == 0)
-			{
-		                // print quit menu
-				printf("Quiting now\n");
-				break;
-			}
-            		else if(strcmp(command, "s") == 0)
-            		{
-                		// save settings
-                		config = fopen("config.ini", "w");
-				if(config)
-				{
-                			fprintf(config, "hvacMode = %i\n", hvacMode);
-                			fprintf(config, "fanMode = %i\n", fanMode);
-                			fprintf(config, "heatTemp = %.2f\n", heatTemp);
-                			fprintf(config, "coolTemp = %.2f\n", coolTemp);
-                			fprintf(config, "offsetVal = %.2f\n", offsetVal);
-                			fclose(config);
-					printf("Settings saved\n");
-				}
-				else
-				{
-					printf("Error writing settings\n");
-				}
-            		}
-			else if(strcmp(command, "sht") == 0)
-			{
-				// set high temperature
-				sscanf(buf, "%s %c %f", command, &equal, &heatTemp);
-				printf("New high temp is: %.2f\n", heatTemp);
-			} 
-			else if(strcmp(command, "slt") == 0)
-			{
-				// set low temperature
-				sscanf(buf, "%s %c %f", command, &equal, &coolTemp);
-				printf("New low temp is: %.2f\n", coolTemp);
-			}
-			else if(strcmp(command, "sov") == 0)
-			{
-				// set offset value
-				sscanf(buf, "%s %c %f", command, &equal, &offsetVal);
-				printf("New offset value is: %.2f\n", offsetVal);
-			}
-			else if(strcmp(command, "shm") == 0)
-			{
-				// set hvac mode
-
-				// reset HVAC
-				blowerOff();
-				ACoff();
-				HeatOff();				
-
-				char *mode = malloc(sizeof(char)*10);
-				sscanf(buf, "%s %c %s", command, &equal, mode);
-				if(strcmp(mode, "AC") == 0)
-				{
-					// setting hvac mode to AC
-					hvacMode = AC;
-					printf("hvacMode is now AC\n");
-				}
-				else if(strcmp(mode, "HEAT") == 0)
-				{
-					// setting HVAC mode to heat
-					hvacMode = HEAT;
-					printf("hvacMode is now HEAT\n");
-				}
-				else if(strcmp(mode, "OFF") == 0)
-				{
-					// setting HVAC mode to off
-					hvacMode = OFF;
-					printf("hvacMode is now OFF\n");
-				}
-				else
-				{
-					printf("Invalid mode set\n");
-				}
-				free(mode);
-			}
-			else if(strcmp(command, "sfm") == 0)
-			{
-				// set blower mode
-				char *mode = malloc(sizeof(char)*10);
-				sscanf(buf, "%s %c %s", command, &equal, mode);
-				
-				if(strcmp(mode, "ON") == 0)
-				{
-					fanMode = ON;
-					printf("fanMode is now ON\n");
-				}
-				else if(strcmp(mode, "AUTO") == 0)
-				{
-					fanMode = AUTO;
-					printf("fanMode is now AUTO\n");
-				}
-				else
-				{
-					printf("Invalid mode set\n");
-				}
-				free(mode);
-			}
-			else if(strcmp(command, "ps") == 0)
-			{
-                		printf("Settings are: \n");
-                		switch(hvacMode)
-                		{
-                    			case AC:
-                    			{
-                        			printf("AC On\n");
-                    			}
-                        		break;
-                        
-                    			case HEAT:
-                    			{
-                        			printf("Heat on\n");
-                    			}
-                        		break;
-                        
-                    			case OFF:
-                    			{
-                        			printf("HVAC Off\n");
-                    			}
-                        		break;
-                		}
-                
-                		switch(fanMode)
-                		{
-                    			case ON:
-                    			{
-                        			printf("Fan On\n");
-                    			}
-                        		break;
-                        
-                   			case AUTO:
-                    			{
-                        			printf("Auto Fan\n");
-                    			}
-                        		break;
-                		}
-                
-                		printf("Heat temp is: %.2f\n", heatTemp);
-                		printf("Cool temp is: %.2f\n", coolTemp);
-                		printf("Offset Val is: %.2f\n", offsetVal);
-            		}
-			else
-			{
-				printf("Invalid command\n");
-			}
+		// publish settled state changes and telemetry, reconnect if needed
+		mqtt_service(monotonic_ms());
 
-			printf("-> ");
-		}
+		// wait for stdin, control clients, or the next control pass
+		event_poll(LOOPINTERVAL);
 	}
 
+	// snapshot the running state so a restart resumes it
+	snapshot_update(monotonic_ms());
+	snapshot_close();
+
 	// turn HVAC system off
-	ACoff();
-	HeatOff();
-	blowerOff();
+	for(i = 0; i < numZones; i++)
+	{
+		ACoff(&zones[i]);
+		HeatOff(&zones[i]);
+		blowerOff(&zones[i]);
+	}
+	shmstate_update(monotonic_ms());
+	shmstate_close();
+	rules_close();
+	sensor_close();
+	telemetry_close();
+	mqtt_close();
+	record_close();
+	config_service(UINT64_MAX);
 
 	delay(1500);
 	MHD_stop_daemon(daemon);
+	ctlsock_close();
 	close_lockfile(lockfd);
+	log_shutdown();
 
 	return 0;
 }
@@ -0,0 +1,800 @@
+/*
+ *      mqtt.c:
+ *      Minimal MQTT 3.1.1 client driven by the event loop. Each zone's
+ *      state is published retained to PREFIX/ZONE/state once a burst of
+ *      changes settles; sensor samples are batched into one QoS 0
+ *      PREFIX/telemetry message. PREFIX/ZONE/set/KEY takes the same keys
+ *      and values as the web form. PREFIX/status is "online", or
+ *      "offline" through the will when the connection drops.
+ *
+ *      Nothing here blocks: the broker is resolved on a helper thread,
+ *      the socket is non-blocking, output queues in a buffer written as
+ *      the socket drains, and a lost broker is retried with exponential
+ *      backoff.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "commands.h"
+#include "config.h"
+#include "control.h"
+#include "event.h"
+#include "log.h"
+#include "mqtt.h"
+#include "render.h"
+#include "thermostat.h"
+#include "units.h"
+
+// packet types, high nibble of the fixed header
+#define CONNECT 0x10
+#define CONNACK 0x20
+#define PUBLISH 0x30
+#define PUBACK 0x40
+#define SUBSCRIBE 0x82
+#define SUBACK 0x90
+#define PINGREQ 0xC0
+#define PINGRESP 0xD0
+#define DISCONNECT 0xE0
+
+// seconds, pings go out at half of it
+#define KEEPALIVE 60
+#define CONNECTTIMEOUT 10000
+#define BACKOFFMIN 1000
+#define BACKOFFMAX 60000
+// largest packet taken from the broker
+#define MAXPACKET 4096
+// queued output past which QoS 0 telemetry is dropped
+#define MAXPENDING (64 * 1024)
+// unacknowledged QoS 1 publishes before state waits its turn
+#define MAXINFLIGHT 16
+// let a burst of changes settle before publishing state, in ms
+#define COALESCE 250
+// telemetry goes out this often, or sooner once the batch fills
+#define BATCHINTERVAL 10000
+#define MAXBATCH 32
+#define STATESIZE 512
+
+enum mqtt_state
+{
+	MQTT_OFF, MQTT_WAITING, MQTT_RESOLVING, MQTT_CONNECTING, MQTT_HANDSHAKE, MQTT_CONNECTED
+};
+
+static int state = MQTT_OFF;
+static int mqttFd = -1;
+static char host[64];
+static char port[8] = MQTTPORT;
+static char prefix[64];
+static char clientId[24];
+
+static unsigned char in[MAXPACKET];
+static size_t inLen;
+static char *out;
+static size_t outLen, outSent;
+
+static uint16_t nextId = 1;
+static int inflight;
+static uint64_t retryAt, backoff = BACKOFFMIN;
+static uint64_t stateSince, lastSent, pingSent;
+
+// what each zone's retained state was last published as
+static char published[MAXZONES][STATESIZE];
+static unsigned long publishedVersion;
+static uint64_t changedAt;
+
+static char batch[MAXBATCH * 96];
+static size_t batchLen;
+static int batchCount;
+static uint64_t batchStart;
+static unsigned long droppedBatches;
+
+// getaddrinfo can take seconds on a DNS outage, so it runs on its own
+// thread and hands the result over here
+static pthread_mutex_t resolveLock = PTHREAD_MUTEX_INITIALIZER;
+static int resolveDone;
+static int resolveStatus;
+static struct addrinfo *resolved;
+
+static void update_events(void)
+{
+	event_modify(mqttFd, state == MQTT_CONNECTING || outSent < outLen ? POLLIN | POLLOUT : POLLIN);
+}
+
+// append one packet to the output buffer
+static int queue_packet(int type, const unsigned char *head, size_t headLen, const void *payload, size_t payloadLen)
+{
+	unsigned char fixed[5];
+	size_t remaining = headLen + payloadLen;
+	size_t fixedLen = 1;
+	char *grown;
+
+	fixed[0] = type;
+	do
+	{
+		fixed[fixedLen] = remaining & 0x7F;
+		remaining >>= 7;
+		if(remaining)
+			fixed[fixedLen] |= 0x80;
+		fixedLen++;
+	}
+	while(remaining);
+
+	grown = realloc(out, outLen + fixedLen + headLen + payloadLen);
+	if(grown == NULL)
+		return 0;
+	out = grown;
+	memcpy(out + outLen, fixed, fixedLen);
+	memcpy(out + outLen + fixedLen, head, headLen);
+	memcpy(out + outLen + fixedLen + headLen, payload, payloadLen);
+	outLen += fixedLen + headLen + payloadLen;
+
+	if(mqttFd >= 0)
+		update_events();
+
+	return 1;
+}
+
+static size_t put_string(unsigned char *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	p[0] = len >> 8;
+	p[1] = len & 0xFF;
+	memcpy(p + 2, s, len);
+
+	return len + 2;
+}
+
+static int publish(const char *topic, const char *payload, size_t len, int qos, int retain)
+{
+	unsigned char head[2 + 128 + 2];
+	size_t headLen;
+
+	if(strlen(topic) > 128)
+		return 0;
+
+	// telemetry is the first thing to go when the broker can't keep up
+	if(qos == 0 && outLen - outSent > MAXPENDING)
+		return 0;
+
+	headLen = put_string(head, topic);
+	if(qos)
+	{
+		head[headLen++] = nextId >> 8;
+		head[headLen++] = nextId & 0xFF;
+	}
+	if(!queue_packet(PUBLISH | qos << 1 | retain, head, headLen, payload, len))
+		return 0;
+
+	// only a publish that went out waits for a PUBACK
+	if(qos)
+	{
+		nextId = nextId == 0xFFFF ? 1 : nextId + 1;
+		inflight++;
+	}
+
+	return 1;
+}
+
+static void disconnect(const char *reason, uint64_t now)
+{
+	if(mqttFd >= 0)
+	{
+		event_remove(mqttFd);
+		close(mqttFd);
+	}
+	mqttFd = -1;
+	free(out);
+	out = NULL;
+	outLen = outSent = inLen = 0;
+	inflight = 0;
+
+	// jitter keeps a fleet from reconnecting in lockstep after a broker restart
+	retryAt = now + backoff + rand() % (backoff / 4 + 1);
+	log_event(LVL_WARN, "mqtt_disconnected", "broker=%s:%s reason=%s retry_ms=%llu", host, port, reason, (unsigned long long)(retryAt - now));
+	backoff = backoff * 2 > BACKOFFMAX ? BACKOFFMAX : backoff * 2;
+	state = MQTT_WAITING;
+}
+
+static void send_connect(void)
+{
+	unsigned char head[10] = { 0, 4, 'M', 'Q', 'T', 'T', 4, 0, KEEPALIVE >> 8, KEEPALIVE & 0xFF };
+	unsigned char payload[2 + sizeof(clientId) + 2 + sizeof(prefix) + 8 + 2 + 8];
+	char willTopic[sizeof(prefix) + 8];
+	size_t len;
+
+	// clean session, retained QoS 1 will
+	head[7] = 0x02 | 0x04 | 0x08 | 0x20;
+	snprintf(willTopic, sizeof(willTopic), "%s/status", prefix);
+	len = put_string(payload, clientId);
+	len += put_string(payload + len, willTopic);
+	len += put_string(payload + len, "offline");
+
+	queue_packet(CONNECT, head, sizeof(head), payload, len);
+}
+
+static void publish_states(void)
+{
+	char topic[sizeof(prefix) + ZONENAME + 8];
+	char buf[STATESIZE];
+	int i, len;
+
+	publishedVersion = state_version();
+	changedAt = 0;
+
+	for(i = 0; i < numZones; i++)
+	{
+		len = render_zone_json(i, buf, sizeof(buf));
+		if(len == 0 || strcmp(buf, published[i]) == 0)
+			continue;
+
+		// out of window, try the rest on a later pass
+		if(inflight >= MAXINFLIGHT)
+		{
+			publishedVersion = 0;
+			return;
+		}
+
+		if(snprintf(topic, sizeof(topic), "%s/%s/state", prefix, zones[i].name) >= (int)sizeof(topic))
+			continue;
+		if(publish(topic, buf, len, 1, 1))
+			strcpy(published[i], buf);
+	}
+}
+
+static void connected(uint64_t now)
+{
+	unsigned char head[2 + sizeof(prefix) + 16];
+	char topic[sizeof(prefix) + 16];
+	size_t len;
+
+	state = MQTT_CONNECTED;
+	backoff = BACKOFFMIN;
+	log_event(LVL_INFO, "mqtt_connected", "broker=%s:%s prefix=%s dropped_batches=%lu", host, port, prefix, droppedBatches);
+
+	// every subscription and retained state starts over on a clean session
+	head[0] = nextId >> 8;
+	head[1] = nextId & 0xFF;
+	nextId = nextId == 0xFFFF ? 1 : nextId + 1;
+	snprintf(topic, sizeof(topic), "%s/+/set/+", prefix);
+	len = 2 + put_string(head + 2, topic);
+	head[len++] = 1;
+	queue_packet(SUBSCRIBE, head, len, NULL, 0);
+
+	snprintf(topic, sizeof(topic), "%s/status", prefix);
+	publish(topic, "online", 6, 1, 1);
+
+	memset(published, 0, sizeof(published));
+	publish_states();
+}
+
+// PREFIX/ZONE/set/KEY, applied through the same setter as the web form
+static void handle_command(const char *topic, const unsigned char *payload, size_t len)
+{
+	char zoneName[ZONENAME];
+	char key[32];
+	char value[64];
+	const char *p;
+	size_t n;
+	int zone;
+
+	if(strncmp(topic, prefix, strlen(prefix)) != 0 || topic[strlen(prefix)] != '/')
+		return;
+	p = topic + strlen(prefix) + 1;
+
+	n = strcspn(p, "/");
+	if(n == 0 || n >= sizeof(zoneName) || strncmp(p + n, "/set/", 5) != 0)
+		return;
+	memcpy(zoneName, p, n);
+	zoneName[n] = '\0';
+	p += n + 5;
+	if(*p == '\0' || strlen(p) >= sizeof(key) || strchr(p, '/'))
+		return;
+	strcpy(key, p);
+
+	if(len >= sizeof(value))
+		len = sizeof(value) - 1;
+	memcpy(value, payload, len);
+	value[len] = '\0';
+
+	zone = config_zone(zoneName);
+	if(zone < 0)
+	{
+		log_event(LVL_WARN, "mqtt_unknown_zone", "topic=%s", topic);
+		return;
+	}
+	settings_apply(zone, key, value, "mqtt");
+}
+
+static void handle_packet(const unsigned char *p, size_t len, uint64_t now)
+{
+	int type = p[0] & 0xF0;
+	int qos = (p[0] >> 1) & 3;
+	size_t headLen = 1;
+	char topic[256];
+	size_t topicLen, off;
+
+	// skip the remaining length, already checked by the caller
+	while(p[headLen++] & 0x80)
+		;
+	p += headLen;
+	len -= headLen;
+
+	switch(type)
+	{
+		case CONNACK:
+		{
+			if(state != MQTT_HANDSHAKE || len < 2 || p[1] != 0)
+			{
+				char reason[24];
+
+				snprintf(reason, sizeof(reason), "refused_%d", len >= 2 ? p[1] : -1);
+				disconnect(reason, now);
+				return;
+			}
+			connected(now);
+		}
+		break;
+
+		case PUBLISH:
+		{
+			if(len < 2)
+				return;
+			topicLen = p[0] << 8 | p[1];
+			off = 2 + topicLen + (qos ? 2 : 0);
+			if(off > len)
+				return;
+			if(topicLen < sizeof(topic))
+			{
+				memcpy(topic, p + 2, topicLen);
+				topic[topicLen] = '\0';
+				handle_command(topic, p + off, len - off);
+			}
+			else
+				log_event(LVL_WARN, "mqtt_topic_too_long", "length=%zu", topicLen);
+			// acked even when dropped, or the broker sends it again forever
+			if(qos == 1)
+				queue_packet(PUBACK, p + 2 + topicLen, 2, NULL, 0);
+		}
+		break;
+
+		case PUBACK:
+		{
+			if(inflight)
+				inflight--;
+		}
+		break;
+
+		case SUBACK:
+		{
+			if(len >= 3 && p[2] == 0x80)
+				log_event(LVL_ERROR, "mqtt_subscribe_refused", "prefix=%s", prefix);
+		}
+		break;
+
+		case PINGRESP:
+		{
+			pingSent = 0;
+		}
+		break;
+	}
+}
+
+// split complete packets off the input buffer
+static int parse_input(uint64_t now)
+{
+	size_t pos = 0;
+
+	while(pos < inLen)
+	{
+		size_t remaining = 0, headLen = 1;
+		int shift = 0;
+
+		do
+		{
+			if(pos + headLen >= inLen)
+				goto partial;
+			if(headLen > 4)
+				return 0;
+			remaining |= (size_t)(in[pos + headLen] & 0x7F) << shift;
+			shift += 7;
+		}
+		while(in[pos + headLen++] & 0x80);
+
+		if(headLen + remaining > sizeof(in))
+			return 0;
+		if(pos + headLen + remaining > inLen)
+			break;
+
+		handle_packet(in + pos, headLen + remaining, now);
+		if(state == MQTT_WAITING)
+			return 1;
+		pos += headLen + remaining;
+	}
+
+partial:
+	inLen -= pos;
+	memmove(in, in + pos, inLen);
+
+	return 1;
+}
+
+static void mqtt_event(int fd, short revents, void *arg)
+{
+	uint64_t now = monotonic_ms();
+	int err = 0;
+	socklen_t errLen = sizeof(err);
+	ssize_t n;
+
+	if(state == MQTT_CONNECTING)
+	{
+		if(!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err)
+		{
+			disconnect("connect_failed", now);
+			return;
+		}
+		state = MQTT_HANDSHAKE;
+		send_connect();
+	}
+
+	if(revents & POLLIN)
+	{
+		n = read(fd, in + inLen, sizeof(in) - inLen);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		{
+			disconnect(n == 0 ? "closed" : "read_failed", now);
+			return;
+		}
+		if(n > 0)
+		{
+			inLen += n;
+			if(!parse_input(now))
+			{
+				disconnect("bad_packet", now);
+				return;
+			}
+			if(state == MQTT_WAITING)
+				return;
+		}
+	}
+	else if(revents & (POLLHUP | POLLERR))
+	{
+		disconnect("hangup", now);
+		return;
+	}
+
+	while(outSent < outLen)
+	{
+		n = write(fd, out + outSent, outLen - outSent);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			disconnect("write_failed", now);
+			return;
+		}
+		outSent += n;
+		lastSent = now;
+	}
+	if(outSent == outLen)
+	{
+		free(out);
+		out = NULL;
+		outLen = outSent = 0;
+	}
+	update_events();
+}
+
+static void *resolve_thread(void *arg)
+{
+	struct addrinfo hints, *res = NULL;
+	int status;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	status = getaddrinfo(host, port, &hints, &res);
+
+	pthread_mutex_lock(&resolveLock);
+	resolved = res;
+	resolveStatus = status;
+	resolveDone = 1;
+	pthread_mutex_unlock(&resolveLock);
+
+	return NULL;
+}
+
+static void start_resolve(uint64_t now)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ok;
+
+	resolveDone = 0;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ok = pthread_create(&thread, &attr, resolve_thread, NULL) == 0;
+	pthread_attr_destroy(&attr);
+	if(!ok)
+	{
+		disconnect("resolve_failed", now);
+		return;
+	}
+
+	state = MQTT_RESOLVING;
+	stateSince = now;
+}
+
+// take the address list once the helper is done with it
+static struct addrinfo *take_resolved(int *done, int *status)
+{
+	struct addrinfo *res;
+
+	pthread_mutex_lock(&resolveLock);
+	*done = resolveDone;
+	*status = resolveStatus;
+	res = resolved;
+	if(resolveDone)
+	{
+		resolveDone = 0;
+		resolved = NULL;
+	}
+	pthread_mutex_unlock(&resolveLock);
+
+	return res;
+}
+
+static void start_connect(struct addrinfo *res, uint64_t now)
+{
+	struct addrinfo *ai;
+	int fd = -1;
+
+	for(ai = res; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if(fd < 0)
+			continue;
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if(fd < 0 || !event_add(fd, POLLOUT, mqtt_event, NULL))
+	{
+		if(fd >= 0)
+			close(fd);
+		disconnect("connect_failed", now);
+		return;
+	}
+
+	mqttFd = fd;
+	state = MQTT_CONNECTING;
+	stateSince = now;
+	lastSent = now;
+	pingSent = 0;
+}
+
+// broker as "host[:port][/prefix]", prefix defaults to thermostat/HOSTNAME
+int mqtt_open(const char *spec)
+{
+	char name[HOST_NAME_MAX + 1];
+	const char *slash = strchr(spec, '/');
+	const char *colon;
+	size_t len = slash ? (size_t)(slash - spec) : strlen(spec);
+
+	colon = memchr(spec, ':', len);
+	if(len == 0 || colon == spec || (colon ? (size_t)(colon - spec) : len) >= sizeof(host) ||
+		(colon && (len - (colon - spec) - 1 == 0 || len - (colon - spec) - 1 >= sizeof(port))))
+	{
+		printf("Bad MQTT broker %s, expected host[:port][/prefix]\n", spec);
+		return 0;
+	}
+	if(colon)
+	{
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+		memcpy(port, colon + 1, len - (colon - spec) - 1);
+		port[len - (colon - spec) - 1] = '\0';
+	}
+	else
+	{
+		memcpy(host, spec, len);
+		host[len] = '\0';
+	}
+
+	gethostname(name, sizeof(name));
+	name[HOST_NAME_MAX] = '\0';
+	if(slash && slash[1])
+		snprintf(prefix, sizeof(prefix), "%s", slash + 1);
+	else
+		snprintf(prefix, sizeof(prefix), "thermostat/%.40s", name);
+	snprintf(clientId, sizeof(clientId), "thermostat-%.11s", name);
+
+	srand(time(NULL) ^ getpid());
+	state = MQTT_WAITING;
+	retryAt = 0;
+
+	return 1;
+}
+
+// queue a sample for the next telemetry batch
+void mqtt_sample(int zone, int ok, uint64_t now)
+{
+	struct zone *z = &zones[zone];
+	char temp[UNITTEXT], hum[UNITTEXT];
+	struct timespec ts;
+	int n;
+
+	if(state == MQTT_OFF)
+		return;
+
+	if(batchCount == MAXBATCH)
+	{
+		droppedBatches++;
+		batchLen = batchCount = 0;
+	}
+	if(batchCount == 0)
+		batchStart = now;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	n = snprintf(batch + batchLen, sizeof(batch) - batchLen, "%s{\"zone\":\"%s\",\"ts\":%lld,\"ok\":%d,\"temperature\":%s,\"humidity\":%s}",
+		batchCount ? "," : "", z->name, (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000, ok,
+		unit_format(temp, z->temperature), unit_format(hum, z->humidity));
+	if(n < 0 || (size_t)n >= sizeof(batch) - batchLen)
+		return;
+	batchLen += n;
+	batchCount++;
+}
+
+static void flush_batch(void)
+{
+	char topic[sizeof(prefix) + 16];
+	char payload[sizeof(batch) + 2];
+	int len;
+
+	len = snprintf(payload, sizeof(payload), "[%s]", batch);
+	snprintf(topic, sizeof(topic), "%s/telemetry", prefix);
+	if(!publish(topic, payload, len, 0, 0))
+		droppedBatches++;
+	batchLen = batchCount = 0;
+}
+
+// called every pass of the main loop
+void mqtt_service(uint64_t now)
+{
+	switch(state)
+	{
+		case MQTT_OFF:
+			return;
+
+		case MQTT_WAITING:
+		{
+			if(now >= retryAt)
+				start_resolve(now);
+		}
+		break;
+
+		case MQTT_RESOLVING:
+		{
+			int done, status;
+			struct addrinfo *res = take_resolved(&done, &status);
+
+			// the resolver keeps its own timeouts, the loop never waits on it
+			if(!done)
+				break;
+			if(status != 0 || res == NULL)
+			{
+				if(res)
+					freeaddrinfo(res);
+				disconnect("resolve_failed", now);
+				break;
+			}
+			start_connect(res, now);
+		}
+		break;
+
+		case MQTT_CONNECTING:
+		case MQTT_HANDSHAKE:
+		{
+			if(now - stateSince > CONNECTTIMEOUT)
+				disconnect("timeout", now);
+		}
+		break;
+
+		case MQTT_CONNECTED:
+		{
+			// no answer to a ping within the keepalive, the link is dead
+			if(pingSent && now - pingSent > KEEPALIVE * 1000)
+			{
+				disconnect("ping_timeout", now);
+				break;
+			}
+			if(!pingSent && now - lastSent >= KEEPALIVE * 1000 / 2)
+			{
+				queue_packet(PINGREQ, NULL, 0, NULL, 0);
+				pingSent = now;
+				lastSent = now;
+			}
+
+			if(state_version() != publishedVersion)
+			{
+				if(changedAt == 0)
+					changedAt = now;
+				if(now - changedAt >= COALESCE)
+					publish_states();
+			}
+
+			if(batchCount && (batchCount == MAXBATCH || now - batchStart >= BATCHINTERVAL))
+				flush_batch();
+		}
+		break;
+	}
+
+	// nobody to send to while the broker is away, stale batches go
+	if(state != MQTT_CONNECTED && batchCount && now - batchStart >= BATCHINTERVAL)
+	{
+		droppedBatches++;
+		batchLen = batchCount = 0;
+	}
+}
+
+// clean disconnect so the broker doesn't send the will
+void mqtt_close(void)
+{
+	if(state == MQTT_CONNECTED)
+	{
+		char topic[sizeof(prefix) + 16];
+		struct timeval timeout = { 1, 0 };
+
+		snprintf(topic, sizeof(topic), "%s/status", prefix);
+		publish(topic, "offline", 7, 0, 1);
+		queue_packet(DISCONNECT, NULL, 0, NULL, 0);
+
+		// a last blocking flush, bounded so a dead broker can't hold up shutdown
+		setsockopt(mqttFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		fcntl(mqttFd, F_SETFL, fcntl(mqttFd, F_GETFL) & ~O_NONBLOCK);
+		while(outSent < outLen)
+		{
+			ssize_t n = write(mqttFd, out + outSent, outLen - outSent);
+			if(n <= 0)
+				break;
+			outSent += n;
+		}
+	}
+	if(mqttFd >= 0)
+	{
+		event_remove(mqttFd);
+		close(mqttFd);
+	}
+	mqttFd = -1;
+	free(out);
+	out = NULL;
+	outLen = outSent = 0;
+
+	// an address that came in since, a resolver still out just exits
+	if(state == MQTT_RESOLVING)
+	{
+		int done, status;
+		struct addrinfo *res = take_resolved(&done, &status);
+
+		if(res)
+			freeaddrinfo(res);
+	}
+	state = MQTT_OFF;
+}
@@ -0,0 +1,13 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdint.h>
+
+#define MQTTPORT "1883"
+
+int mqtt_open(const char *spec);
+void mqtt_sample(int zone, int ok, uint64_t now);
+void mqtt_service(uint64_t now);
+void mqtt_close(void);
+
+#endif
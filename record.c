@@ -0,0 +1,355 @@
+/*
+ *      record.c:
+ *      Records every input to the control logic (sensor readings, CLI
+ *      commands and web setting changes) into a compact binary trace, and
+ *      replays a trace through the same logic with a virtual clock.
+ *
+ *      Trace layout, little endian:
+ *        header  "RPTR" u16 version u16 preamble records u32 control clock ms
+ *        record  u8 type, u8 length, u32 ms since previous record, payload
+ *      Every payload starts with the u8 zone index.
+ *      Samples are the DHT22's native tenths: i16 temperature, u16 humidity.
+ *      Commands are the raw line, settings are "key\0value".
+ *      The preamble puts back each zone's state and settings, applied
+ *      together before any decision. A zone's state is u8 flags
+ *      (STATE_*), i16 temperature, u16 humidity, then per relay an i8
+ *      state (-1 unknown) and u32 control clock ms of its last change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "commands.h"
+#include "control.h"
+#include "log.h"
+#include "record.h"
+#include "thermostat.h"
+#include "units.h"
+
+#define TRACEMAGIC "RPTR"
+#define TRACEVERSION 3
+#define TRACEHEADER 12
+// a state record and six settings per zone
+#define PREAMBLE 7
+#define MAXPAYLOAD 255
+
+// zone state flags
+#define STATE_SENSORREADY 1
+#define STATE_HVACREADY 2
+#define STATE_HVACON 4
+
+static FILE *trace = NULL;
+static uint64_t lastTime;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static unsigned int get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// control clock ms, a change from before the clock started counts as 0
+static uint32_t control_ms(uint64_t t)
+{
+	uint64_t start = control_started();
+
+	if(t <= start)
+		return 0;
+	return t - start > UINT32_MAX ? UINT32_MAX : t - start;
+}
+
+static void write_record(int type, const void *payload, size_t len)
+{
+	unsigned char head[6];
+	uint64_t now = monotonic_ms();
+	uint32_t delta;
+
+	if(len > MAXPAYLOAD)
+		len = MAXPAYLOAD;
+
+	pthread_mutex_lock(&traceLock);
+	if(trace)
+	{
+		delta = now - lastTime;
+		lastTime = now;
+		head[0] = type;
+		head[1] = len;
+		put32(head + 2, delta);
+		fwrite(head, 1, sizeof(head), trace);
+		fwrite(payload, 1, len, trace);
+	}
+	pthread_mutex_unlock(&traceLock);
+}
+
+// start a trace, the live state and current settings go first so replay
+// starts where the daemon was, warm start and all
+int record_open(const char *path, uint64_t now)
+{
+	unsigned char head[TRACEHEADER];
+	unsigned char state[6 + RELAYS * 5];
+	char value[32];
+	int i, k;
+
+	trace = fopen(path, "wb");
+	if(trace == NULL)
+	{
+		printf("Error opening trace file %s\n", path);
+		return 0;
+	}
+
+	memcpy(head, TRACEMAGIC, 4);
+	put16(head + 4, TRACEVERSION);
+	put16(head + 6, numZones * PREAMBLE);
+	put32(head + 8, control_ms(now));
+	fwrite(head, 1, sizeof(head), trace);
+	lastTime = now;
+
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+
+		state[0] = i;
+		state[1] = (z->sensorReady ? STATE_SENSORREADY : 0) | (z->hvacReady ? STATE_HVACREADY : 0) |
+			(z->hvacOn ? STATE_HVACON : 0);
+		put16(state + 2, (unsigned int)z->temperature & 0xFFFF);
+		put16(state + 4, z->humidity);
+		for(k = 0; k < RELAYS; k++)
+		{
+			state[6 + k * 5] = (int8_t)z->relays[k];
+			put32(state + 7 + k * 5, control_ms(z->relayChanged[k]));
+		}
+		write_record(REC_STATE, state, sizeof(state));
+	}
+
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+
+		record_setting(i, "hvacmode", z->hvacMode == AC ? "ac" : z->hvacMode == HEAT ? "heat" : "off");
+		record_setting(i, "fanmode", z->fanMode == AUTO ? "auto" : "on");
+		// the unit first, the setpoints that follow are in it
+		record_setting(i, "unit", unit_name(z->unit));
+		record_setting(i, "hightemp", unit_format(value, z->heatTemp));
+		record_setting(i, "cooltemp", unit_format(value, z->coolTemp));
+		record_setting(i, "offsetvalue", unit_format(value, z->offsetVal));
+	}
+
+	log_event(LVL_INFO, "recording", "file=%s", path);
+
+	return 1;
+}
+
+// readings are tenths all the way from the sensor, so this round trip is exact
+void record_sample(int zone, int ok, int t, int h)
+{
+	unsigned char payload[5];
+
+	if(trace == NULL)
+		return;
+
+	payload[0] = zone;
+	if(!ok)
+	{
+		write_record(REC_SAMPLE_FAILED, payload, 1);
+		return;
+	}
+
+	put16(payload + 1, (unsigned int)t & 0xFFFF);
+	put16(payload + 3, h);
+	write_record(REC_SAMPLE, payload, sizeof(payload));
+}
+
+void record_command(int zone, const char *line)
+{
+	char payload[MAXPAYLOAD];
+	int len;
+
+	if(trace == NULL)
+		return;
+
+	len = snprintf(payload, sizeof(payload), "%c%.*s", zone, (int)strcspn(line, "\r\n"), line);
+	if(len > (int)sizeof(payload))
+		len = sizeof(payload);
+	write_record(REC_COMMAND, payload, len);
+}
+
+void record_setting(int zone, const char *key, const char *value)
+{
+	char payload[MAXPAYLOAD];
+	int len;
+
+	if(trace == NULL)
+		return;
+
+	len = snprintf(payload, sizeof(payload), "%c%s%c%s", zone, key, '\0', value);
+	if(len > (int)sizeof(payload))
+		len = sizeof(payload);
+	write_record(REC_SETTING, payload, len);
+}
+
+void record_flush(void)
+{
+	pthread_mutex_lock(&traceLock);
+	if(trace)
+		fflush(trace);
+	pthread_mutex_unlock(&traceLock);
+}
+
+void record_close(void)
+{
+	pthread_mutex_lock(&traceLock);
+	if(trace)
+		fclose(trace);
+	trace = NULL;
+	pthread_mutex_unlock(&traceLock);
+}
+
+// relay transitions during replay
+static FILE *replayOut;
+
+static void replay_relay(struct zone *z, int relay, int on, uint64_t now)
+{
+	fprintf(replayOut, "%llu %s %s %s\n", (unsigned long long)now, z->name, relay_name(relay), on ? "on" : "off");
+}
+
+// feed a trace through the control logic, no hardware and no sleeping
+int replay_run(const char *path, FILE *out)
+{
+	unsigned char head[TRACEHEADER];
+	unsigned char payload[MAXPAYLOAD + 1];
+	uint64_t start, now;
+	unsigned long preamble;
+	unsigned long records = 0;
+	unsigned long skipped = 0;
+	int zone;
+	FILE *in, *devnull;
+
+	in = fopen(path, "rb");
+	if(in == NULL)
+	{
+		printf("Error opening trace file %s\n", path);
+		return 0;
+	}
+	if(fread(head, 1, sizeof(head), in) != sizeof(head) ||
+		memcmp(head, TRACEMAGIC, 4) != 0 || get16(head + 4) != TRACEVERSION)
+	{
+		printf("%s is not a trace file\n", path);
+		fclose(in);
+		return 0;
+	}
+
+	// command replies are not part of the result
+	devnull = fopen("/dev/null", "w");
+	command_set_dry_run(1);
+
+	// the clock picks up where the recording daemon's was, so the HVAC
+	// start delay and relay timestamps line up with the live run
+	replayOut = out;
+	control_init(0, replay_relay);
+	start = now = get32(head + 8);
+	preamble = get16(head + 6);
+
+	while(fread(head, 1, 6, in) == 6)
+	{
+		int type = head[0];
+		size_t len = head[1];
+
+		if(fread(payload, 1, len, in) != len)
+		{
+			printf("Truncated trace record %lu\n", records);
+			break;
+		}
+		payload[len] = '\0';
+		records++;
+
+		// catch up with decisions due before this input, then apply it;
+		// the preamble all lands before any decision
+		now += get32(head + 2);
+		if(records > preamble)
+			control_step(now);
+
+		// a zone that isn't configured here can't be replayed
+		zone = len > 0 ? payload[0] : 0;
+		if(zone >= numZones)
+		{
+			skipped++;
+			continue;
+		}
+
+		switch(type)
+		{
+			case REC_SAMPLE:
+			{
+				if(len < 5)
+					break;
+				control_sample(&zones[zone], (int16_t)get16(payload + 1), get16(payload + 3));
+			}
+			break;
+
+			case REC_STATE:
+			{
+				struct zone *z = &zones[zone];
+				uint64_t changed[RELAYS];
+				int states[RELAYS], k;
+
+				if(len < 6 + RELAYS * 5)
+					break;
+				z->temperature = (int16_t)get16(payload + 2);
+				z->humidity = get16(payload + 4);
+				z->sensorReady = (payload[1] & STATE_SENSORREADY) != 0;
+				z->hvacOn = (payload[1] & STATE_HVACON) != 0;
+				for(k = 0; k < RELAYS; k++)
+				{
+					states[k] = (int8_t)payload[6 + k * 5];
+					changed[k] = get32(payload + 7 + k * 5);
+				}
+				control_restore(z, (payload[1] & STATE_HVACREADY) != 0, states, changed);
+			}
+			break;
+
+			case REC_COMMAND:
+			{
+				int session = zone;
+				command_exec((char *)payload + 1, devnull, &session);
+			}
+			break;
+
+			case REC_SETTING:
+			{
+				size_t keyLen = strlen((char *)payload + 1);
+				if(keyLen + 1 < len)
+					settings_apply(zone, (char *)payload + 1, (char *)payload + keyLen + 2, "replay");
+			}
+			break;
+		}
+
+		if(records >= preamble)
+			control_step(now);
+	}
+
+	fprintf(out, "# %lu records, %llu ms replayed\n", records, (unsigned long long)(now - start));
+	if(skipped)
+		fprintf(out, "# %lu records for unconfigured zones skipped\n", skipped);
+	fclose(devnull);
+	fclose(in);
+
+	return 1;
+}
@@ -0,0 +1,21 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// trace record types
+enum record_type
+{
+	REC_SAMPLE = 1, REC_SAMPLE_FAILED, REC_COMMAND, REC_SETTING, REC_STATE
+};
+
+int record_open(const char *path, uint64_t now);
+void record_sample(int zone, int ok, int t, int h);
+void record_command(int zone, const char *line);
+void record_setting(int zone, const char *key, const char *value);
+void record_flush(void);
+void record_close(void);
+int replay_run(const char *path, FILE *out);
+
+#endif
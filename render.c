@@ -0,0 +1,228 @@
+/*
+ *      render.c:
+ *      Formats the web page and JSON state from the current settings.
+ *      The template is a printf format, checked for exactly the
+ *      conversions render_html passes before it's used, so an edited page
+ *      can't crash the daemon. Callers cache the output per state version
+ *      so formatting only happens when something changed.
+ *      Temperatures are integer tenths, formatted without floats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "render.h"
+#include "thermostat.h"
+#include "units.h"
+
+// the %s conversions render_html fills in
+#define TEMPLATEFIELDS 16
+
+static char *template = NULL;
+static size_t templateSize = 0;
+static pthread_mutex_t templateLock = PTHREAD_MUTEX_INITIALIZER;
+
+// only %s conversions and exactly as many as render_html passes, %% is
+// a literal percent; returns why not, or NULL
+static const char *template_check(const char *data)
+{
+	const char *p;
+	int fields = 0;
+
+	for(p = strchr(data, '%'); p; p = strchr(p + 2, '%'))
+	{
+		if(p[1] == 's')
+			fields++;
+		else if(p[1] != '%')
+			return "conversion";
+	}
+
+	return fields == TEMPLATEFIELDS ? NULL : "field_count";
+}
+
+// load html template, a template that doesn't check out keeps the old one
+int render_load_template(const char *filename)
+{
+	const char *reason;
+	FILE *file = fopen(filename, "rb");
+	if(file == NULL)
+	{
+		printf("File couldn't be opened\n");
+		return 0;
+	}
+	fseek(file, 0L, SEEK_END);
+	long int size = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+
+	char *data = malloc(size + 1);
+	if(data == NULL)
+	{
+		printf("Memory alloc error\n");
+		fclose(file);
+		return 0;
+	}
+
+	size = fread(data, 1, size, file);
+	data[size] = '\0';
+	fclose(file);
+
+	if((reason = template_check(data)))
+	{
+		log_event(LVL_ERROR, "template_rejected", "file=%s reason=%s", filename, reason);
+		free(data);
+		return 0;
+	}
+
+	pthread_mutex_lock(&templateLock);
+	free(template);
+	template = data;
+	templateSize = size;
+	pthread_mutex_unlock(&templateLock);
+
+	return 1;
+}
+
+// template changed on disk, a failed load keeps the old one
+void render_reload(const char *filename)
+{
+	if(render_load_template(filename))
+	{
+		log_event(LVL_INFO, "template_reloaded", "file=%s", filename);
+		state_changed();
+	}
+}
+
+static const char *hvacModeName(int mode)
+{
+	switch(mode)
+	{
+		case AC:
+			return "AC";
+		case HEAT:
+			return "Heat";
+		default:
+			return "Off";
+	}
+}
+
+// links to every zone's page, empty with a single zone
+static void zone_links(char *buf, size_t size)
+{
+	size_t len = 0;
+	int i;
+
+	buf[0] = '\0';
+	if(numZones < 2)
+		return;
+
+	for(i = 0; i < numZones && len < size; i++)
+	{
+		len += snprintf(buf + len, size - len, "%s<a href=\"/?zone=%d\">%s</a>",
+			i ? " | " : "", i, zones[i].name);
+	}
+}
+
+// render one zone's html page, returns length written or 0 on error
+size_t render_html(int zone, char *buf, size_t size)
+{
+	struct zone *z = &zones[zone];
+	char links[MAXZONES * (ZONENAME + 32)];
+	char temp[UNITTEXT], heat[UNITTEXT], cool[UNITTEXT], offset[UNITTEXT];
+	int len;
+
+	zone_links(links, sizeof(links));
+
+	pthread_mutex_lock(&templateLock);
+	if(template == NULL)
+	{
+		pthread_mutex_unlock(&templateLock);
+		return 0;
+	}
+
+	// the unit select comes after the setpoints so a form changing both
+	// applies them in the old unit before converting
+	len = snprintf(buf, size, template, links, z->name,
+		unit_format(temp, unit_from_c(z->temperature, z->unit) + z->offsetVal), unit_name(z->unit),
+		hvacModeName(z->hvacMode), z->fanMode == AUTO ? "Auto" : "On",
+		z->hvacMode == AC ? "selected" : "",
+		z->hvacMode == HEAT ? "selected" : "",
+		z->hvacMode == OFF ? "selected" : "",
+		z->fanMode == AUTO ? "selected" : "",
+		z->fanMode == ON ? "selected" : "",
+		unit_format(heat, z->heatTemp), unit_format(cool, z->coolTemp), unit_format(offset, z->offsetVal),
+		z->unit == UNIT_F ? "selected" : "",
+		z->unit == UNIT_C ? "selected" : "");
+	pthread_mutex_unlock(&templateLock);
+	if(len < 0 || (size_t)len >= size)
+		return 0;
+
+	return len;
+}
+
+// one zone's state as a JSON object
+int render_zone_json(int zone, char *buf, size_t size)
+{
+	struct zone *z = &zones[zone];
+	char temp[UNITTEXT], hum[UNITTEXT], heat[UNITTEXT], cool[UNITTEXT], offset[UNITTEXT];
+	int n;
+
+	n = snprintf(buf, size,
+		"{\"id\":%d,\"name\":\"%s\",\"sensorReady\":%d,\"unit\":\"%s\","
+		"\"temperature\":%s,\"humidity\":%s,\"hvacMode\":\"%s\","
+		"\"fanMode\":\"%s\",\"hvacOn\":%d,\"heatTemp\":%s,"
+		"\"coolTemp\":%s,\"offsetVal\":%s,"
+		"\"relays\":{\"blower\":%d,\"ac\":%d,\"heat\":%d}}",
+		zone, z->name, z->sensorReady, unit_name(z->unit),
+		unit_format(temp, unit_from_c(z->temperature, z->unit) + z->offsetVal), unit_format(hum, z->humidity),
+		hvacModeName(z->hvacMode), z->fanMode == AUTO ? "Auto" : "On",
+		z->hvacOn, unit_format(heat, z->heatTemp), unit_format(cool, z->coolTemp), unit_format(offset, z->offsetVal),
+		z->relays[RELAY_BLOWER] > 0, z->relays[RELAY_AC] > 0,
+		z->relays[RELAY_HEAT] > 0);
+	if(n < 0 || (size_t)n >= size)
+		return 0;
+
+	return n;
+}
+
+// render every zone as json, returns length written or 0 on error
+size_t render_json(char *buf, size_t size, unsigned long version)
+{
+	size_t len;
+	int i, n;
+
+	n = snprintf(buf, size, "{\"version\":%lu,\"zones\":[", version);
+	if(n < 0 || (size_t)n >= size)
+		return 0;
+	len = n;
+
+	for(i = 0; i < numZones; i++)
+	{
+		if(i)
+			buf[len++] = ',';
+		n = render_zone_json(i, buf + len, size - len);
+		if(n == 0)
+			return 0;
+		len += n;
+	}
+
+	n = snprintf(buf + len, size - len, "]}\n");
+	if(n < 0 || (size_t)n >= size - len)
+		return 0;
+
+	return len + n;
+}
+
+// size needed to render the page, template plus room for the values
+size_t render_html_size(void)
+{
+	size_t size;
+
+	pthread_mutex_lock(&templateLock);
+	size = templateSize + 256 + MAXZONES * (ZONENAME + 32);
+	pthread_mutex_unlock(&templateLock);
+
+	return size;
+}
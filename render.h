@@ -0,0 +1,13 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stddef.h>
+
+int render_load_template(const char *filename);
+void render_reload(const char *filename);
+size_t render_html(int zone, char *buf, size_t size);
+int render_zone_json(int zone, char *buf, size_t size);
+size_t render_json(char *buf, size_t size, unsigned long version);
+size_t render_html_size(void);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ *      rules.c:
+ *      Alert and automation rules, one per line of rules.conf:
+ *
+ *        ZONE: CONDITION [for DURATION] -> ACTION
+ *
+ *      ZONE is a zone name or * for every zone. Conditions are
+ *      temperature < or > VALUE, humidity < or > VALUE, no_reading, and
+ *      heating or cooling with an optional rise or drop < VALUE since the
+ *      run began. Temperatures take an F or C suffix, otherwise the
+ *      zone's unit. Actions are log, webhook http://ADDRESS[:PORT]/PATH,
+ *      mode AC|HEAT|OFF and shutdown.
+ *
+ *      Rules are compiled once at load. Each keeps only the time its
+ *      condition started holding and whether it fired, so a sample or a
+ *      relay change costs O(1) per rule of that zone and nothing rescans
+ *      history. A rule fires once per episode and re-arms when its
+ *      condition stops holding.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "commands.h"
+#include "config.h"
+#include "control.h"
+#include "log.h"
+#include "rules.h"
+#include "thermostat.h"
+#include "units.h"
+#include "webhook.h"
+
+#define RULETEXT 96
+#define MAXLINE 256
+#define MAXHOOKS 16
+// a week, in ms
+#define MAXHOLD (7 * 24 * 3600 * 1000ULL)
+
+enum rule_metric
+{
+	METRIC_TEMPERATURE, METRIC_HUMIDITY, METRIC_NOREADING, METRIC_HEATING, METRIC_COOLING
+};
+
+enum rule_action
+{
+	ACTION_LOG, ACTION_WEBHOOK, ACTION_MODE, ACTION_SHUTDOWN
+};
+
+struct rule
+{
+	int metric;
+	// '<' or '>', 0 for a plain heating or cooling run
+	int op;
+	// temperatures are in unit, -1 until bound to a zone
+	int unit;
+	int value;
+	uint64_t hold;
+	int action;
+	int mode;
+	int hook;
+	int line;
+	char text[RULETEXT];
+
+	// since when the condition has held, 0 while it doesn't
+	uint64_t since;
+	int fired;
+};
+
+struct zone_rules
+{
+	struct rule *rules;
+	int count;
+	int size;
+	// last good reading, and the temperature each relay's run is measured
+	// from and since when; a run already going when the rules came in is
+	// measured from the first reading after, runSince is 0 until then
+	uint64_t lastGood;
+	int runTemp[RELAYS];
+	uint64_t runSince[RELAYS];
+};
+
+static struct zone_rules zoneRules[MAXZONES];
+static struct webhook hooks[MAXHOOKS];
+static int numHooks = 0;
+static const char *modeNames[] = { "ac", "heat", "off" };
+
+static void rules_clear(void)
+{
+	int i;
+
+	for(i = 0; i < MAXZONES; i++)
+	{
+		free(zoneRules[i].rules);
+		memset(&zoneRules[i], 0, sizeof(zoneRules[i]));
+	}
+	numHooks = 0;
+}
+
+// "55", "55F", "12.5C"; unit is left alone without a suffix
+static int parse_temperature(const char *text, int *value, int *unit)
+{
+	char buf[16];
+	size_t len = strlen(text);
+
+	if(len == 0 || len >= sizeof(buf))
+		return 0;
+	memcpy(buf, text, len + 1);
+	if(toupper((unsigned char)buf[len - 1]) == 'F' || toupper((unsigned char)buf[len - 1]) == 'C')
+	{
+		*unit = toupper((unsigned char)buf[len - 1]) == 'F' ? UNIT_F : UNIT_C;
+		buf[len - 1] = '\0';
+	}
+
+	return unit_parse(buf, value);
+}
+
+// "90", "90s", "10m", "2h", in ms
+static int parse_duration(const char *text, uint64_t *ms)
+{
+	char *end;
+	unsigned long v = strtoul(text, &end, 10);
+
+	if(end == text || !isdigit((unsigned char)*text))
+		return 0;
+	if(*end == 'h')
+		*ms = v * 3600000ULL;
+	else if(*end == 'm')
+		*ms = v * 60000ULL;
+	else if(*end == 's' || *end == '\0')
+		*ms = v * 1000ULL;
+	else
+		return 0;
+
+	return (*end == '\0' || end[1] == '\0') && *ms <= MAXHOLD;
+}
+
+// webhooks are shared between rules posting to the same url
+static int find_hook(const char *url)
+{
+	struct webhook w;
+	int i;
+
+	if(!webhook_parse(url, &w))
+		return -1;
+	for(i = 0; i < numHooks; i++)
+	{
+		if(memcmp(&hooks[i].addr, &w.addr, sizeof(w.addr)) == 0 && strcmp(hooks[i].path, w.path) == 0)
+			return i;
+	}
+	if(numHooks == MAXHOOKS)
+		return -1;
+	hooks[numHooks] = w;
+
+	return numHooks++;
+}
+
+static int append(int zone, const struct rule *r)
+{
+	struct zone_rules *zr = &zoneRules[zone];
+	struct rule *grown;
+
+	if(zr->count == zr->size)
+	{
+		grown = realloc(zr->rules, sizeof(struct rule) * (zr->size ? zr->size * 2 : 16));
+		if(grown == NULL)
+			return 0;
+		zr->rules = grown;
+		zr->size = zr->size ? zr->size * 2 : 16;
+	}
+	zr->rules[zr->count] = *r;
+	if(zr->rules[zr->count].unit < 0)
+		zr->rules[zr->count].unit = zones[zone].unit;
+	zr->count++;
+
+	return 1;
+}
+
+// start measuring relays that are running but have no start temperature
+static void seed_runs(int zone, uint64_t now)
+{
+	struct zone_rules *zr = &zoneRules[zone];
+	int j;
+
+	for(j = 0; j < RELAYS; j++)
+	{
+		if(zr->runSince[j] == 0 && zones[zone].relays[j] > 0 && zones[zone].sensorReady)
+		{
+			zr->runTemp[j] = zones[zone].temperature;
+			zr->runSince[j] = now;
+		}
+	}
+}
+
+// compile one rule line, returns 0 and logs why if it doesn't parse
+int rules_add(const char *text, const char *path, int line, uint64_t now)
+{
+	char buf[MAXLINE];
+	char *colon, *tok, *save;
+	const char *reason = NULL;
+	struct rule r;
+	int zone = -1, i;
+
+	memset(&r, 0, sizeof(r));
+	r.unit = -1;
+	r.hook = -1;
+	r.line = line;
+	snprintf(r.text, sizeof(r.text), "%s", text);
+	snprintf(buf, sizeof(buf), "%s", text);
+
+	// quotes would need escaping in the log and the webhook body
+	colon = strchr(buf, ':');
+	if(strpbrk(buf, "\"\\") || colon == NULL)
+	{
+		reason = "syntax";
+		goto bad;
+	}
+	*colon = '\0';
+	tok = strtok_r(buf, " \t", &save);
+	if(tok == NULL || strtok_r(NULL, " \t", &save))
+	{
+		reason = "zone";
+		goto bad;
+	}
+	if(strcmp(tok, "*") != 0 && (zone = config_zone(tok)) < 0)
+	{
+		reason = "unknown_zone";
+		goto bad;
+	}
+
+	// condition
+	tok = strtok_r(colon + 1, " \t", &save);
+	if(tok == NULL)
+		reason = "condition";
+	else if(strcmp(tok, "temperature") == 0 || strcmp(tok, "humidity") == 0)
+	{
+		char *op = strtok_r(NULL, " \t", &save);
+		char *value = strtok_r(NULL, " \t", &save);
+
+		r.metric = tok[0] == 't' ? METRIC_TEMPERATURE : METRIC_HUMIDITY;
+		if(op == NULL || value == NULL || (strcmp(op, "<") != 0 && strcmp(op, ">") != 0))
+			reason = "condition";
+		else if(r.metric == METRIC_TEMPERATURE ? !parse_temperature(value, &r.value, &r.unit) : !unit_parse(value, &r.value))
+			reason = "value";
+		else
+			r.op = *op;
+	}
+	else if(strcmp(tok, "no_reading") == 0)
+		r.metric = METRIC_NOREADING;
+	else if(strcmp(tok, "heating") == 0 || strcmp(tok, "cooling") == 0)
+		r.metric = tok[0] == 'h' ? METRIC_HEATING : METRIC_COOLING;
+	else
+		reason = "condition";
+	if(reason)
+		goto bad;
+
+	tok = strtok_r(NULL, " \t", &save);
+
+	// heating rise < VALUE, cooling drop < VALUE
+	if(tok && ((r.metric == METRIC_HEATING && strcmp(tok, "rise") == 0) || (r.metric == METRIC_COOLING && strcmp(tok, "drop") == 0)))
+	{
+		char *op = strtok_r(NULL, " \t", &save);
+		char *value = strtok_r(NULL, " \t", &save);
+
+		if(op == NULL || value == NULL || (strcmp(op, "<") != 0 && strcmp(op, ">") != 0) ||
+			!parse_temperature(value, &r.value, &r.unit))
+		{
+			reason = "value";
+			goto bad;
+		}
+		r.op = *op;
+		tok = strtok_r(NULL, " \t", &save);
+	}
+
+	if(tok && strcmp(tok, "for") == 0)
+	{
+		tok = strtok_r(NULL, " \t", &save);
+		if(tok == NULL || !parse_duration(tok, &r.hold))
+		{
+			reason = "duration";
+			goto bad;
+		}
+		tok = strtok_r(NULL, " \t", &save);
+	}
+	if(r.metric == METRIC_NOREADING && r.hold == 0)
+	{
+		reason = "duration";
+		goto bad;
+	}
+
+	// action
+	if(tok == NULL || strcmp(tok, "->") != 0 || (tok = strtok_r(NULL, " \t", &save)) == NULL)
+		reason = "action";
+	else if(strcmp(tok, "log") == 0)
+		r.action = ACTION_LOG;
+	else if(strcmp(tok, "shutdown") == 0)
+		r.action = ACTION_SHUTDOWN;
+	else if(strcmp(tok, "webhook") == 0)
+	{
+		r.action = ACTION_WEBHOOK;
+		tok = strtok_r(NULL, " \t", &save);
+		if(tok == NULL || (r.hook = find_hook(tok)) < 0)
+			reason = "webhook";
+	}
+	else if(strcmp(tok, "mode") == 0)
+	{
+		r.action = ACTION_MODE;
+		tok = strtok_r(NULL, " \t", &save);
+		for(r.mode = 0; tok && r.mode < 3 && strcasecmp(tok, modeNames[r.mode]) != 0; r.mode++)
+			;
+		if(tok == NULL || r.mode == 3)
+			reason = "mode";
+	}
+	else
+		reason = "action";
+	if(reason == NULL && strtok_r(NULL, " \t", &save))
+		reason = "trailing";
+	if(reason)
+		goto bad;
+
+	for(i = 0; i < numZones; i++)
+	{
+		if(zone >= 0 && i != zone)
+			continue;
+		if(zoneRules[i].lastGood == 0)
+			zoneRules[i].lastGood = now;
+		// nothing tracked the relays while the zone had no rules
+		if(zoneRules[i].count == 0)
+			seed_runs(i, now);
+		if(!append(i, &r))
+		{
+			reason = "memory";
+			goto bad;
+		}
+	}
+
+	return 1;
+
+bad:
+	log_event(LVL_WARN, "rules_bad_line", "file=%s line=%d reason=%s", path, line, reason);
+	return 0;
+}
+
+// load or replace every rule, a missing file just means none
+int rules_load(const char *path)
+{
+	char line[MAXLINE];
+	uint64_t now = monotonic_ms();
+	int lineNo = 0, count = 0;
+	char *start, *end;
+	FILE *file;
+
+	rules_clear();
+	file = fopen(path, "r");
+	if(file == NULL)
+		return 0;
+
+	while(fgets(line, sizeof(line), file))
+	{
+		lineNo++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		start = line + strspn(line, " \t");
+		for(end = start + strlen(start); end > start && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		if(*start == '\0')
+			continue;
+		count += rules_add(start, path, lineNo, now);
+	}
+	fclose(file);
+
+	log_event(LVL_INFO, "rules_loaded", "file=%s rules=%d", path, count);
+
+	return 1;
+}
+
+// edits take effect at once, every rule starts over unfired
+void rules_reload(const char *path)
+{
+	rules_load(path);
+}
+
+int rules_count(int zone)
+{
+	return zoneRules[zone].count;
+}
+
+// whether the condition holds; start is set for conditions that carry
+// their own start time rather than the first evaluation that saw them
+static int holds(const struct rule *r, const struct zone_rules *zr, const struct zone *z, uint64_t now, uint64_t *start)
+{
+	int relay, diff, cmp;
+
+	*start = 0;
+	switch(r->metric)
+	{
+		case METRIC_TEMPERATURE:
+		{
+			if(!z->sensorReady)
+				return 0;
+			// like the display: reading plus offset, exactly
+			cmp = unit_compare(z->temperature, unit_convert_delta(z->offsetVal, z->unit, r->unit), r->value, r->unit);
+		}
+		break;
+
+		case METRIC_HUMIDITY:
+		{
+			if(!z->sensorReady)
+				return 0;
+			cmp = (z->humidity > r->value) - (z->humidity < r->value);
+		}
+		break;
+
+		case METRIC_NOREADING:
+		{
+			*start = zr->lastGood;
+			return now - zr->lastGood >= r->hold;
+		}
+
+		default:
+		{
+			relay = r->metric == METRIC_HEATING ? RELAY_HEAT : RELAY_AC;
+			if(z->relays[relay] <= 0)
+				return 0;
+			*start = z->relayChanged[relay];
+			if(r->op == 0)
+				return 1;
+			if(zr->runSince[relay] == 0)
+				return 0;
+			*start = zr->runSince[relay];
+
+			// rise while heating, drop while cooling, tenths C against the
+			// threshold in its own unit
+			diff = z->temperature - zr->runTemp[relay];
+			if(r->metric == METRIC_COOLING)
+				diff = -diff;
+			cmp = r->unit == UNIT_F ? diff * 9 - r->value * 5 : diff - r->value;
+			cmp = (cmp > 0) - (cmp < 0);
+		}
+		break;
+	}
+
+	return r->op == '<' ? cmp < 0 : cmp > 0;
+}
+
+static void fire(const struct rule *r, int zone)
+{
+	struct zone *z = &zones[zone];
+	char body[WEBHOOKBODY], temp[UNITTEXT];
+
+	log_event(r->action == ACTION_SHUTDOWN ? LVL_ERROR : LVL_WARN, "rule_fired", "zone=%s line=%d rule=\"%s\"",
+		z->name, r->line, r->text);
+
+	switch(r->action)
+	{
+		case ACTION_WEBHOOK:
+		{
+			// no temperature yet is null, not a reading of zero
+			if(z->sensorReady)
+				unit_format(temp, unit_from_c(z->temperature, z->unit) + z->offsetVal);
+			else
+				strcpy(temp, "null");
+			snprintf(body, sizeof(body), "{\"zone\":\"%s\",\"line\":%d,\"rule\":\"%s\",\"unit\":\"%s\",\"temperature\":%s,\"hvacOn\":%d}",
+				z->name, r->line, r->text, unit_name(z->unit), temp, z->hvacOn);
+			webhook_post(&hooks[r->hook], body);
+		}
+		break;
+
+		case ACTION_MODE:
+		{
+			settings_apply(zone, "hvacmode", modeNames[r->mode], "rule");
+		}
+		break;
+
+		case ACTION_SHUTDOWN:
+		{
+			// through the controller, so relays still get their usual protection
+			settings_apply(zone, "hvacmode", "off", "rule");
+			settings_apply(zone, "fanmode", "auto", "rule");
+		}
+		break;
+	}
+}
+
+// relayOnly skips the rules a relay change can't affect
+static void evaluate(int zone, uint64_t now, int relayOnly)
+{
+	struct zone_rules *zr = &zoneRules[zone];
+	struct zone *z = &zones[zone];
+	uint64_t start;
+	int i;
+
+	for(i = 0; i < zr->count; i++)
+	{
+		struct rule *r = &zr->rules[i];
+
+		if(relayOnly && r->metric != METRIC_HEATING && r->metric != METRIC_COOLING)
+			continue;
+
+		if(!holds(r, zr, z, now, &start))
+		{
+			if(r->fired)
+				log_event(LVL_INFO, "rule_cleared", "zone=%s line=%d", z->name, r->line);
+			r->since = 0;
+			r->fired = 0;
+			continue;
+		}
+
+		if(start)
+			r->since = start;
+		else if(r->since == 0)
+			r->since = now;
+		if(!r->fired && now - r->since >= r->hold)
+		{
+			r->fired = 1;
+			fire(r, zone);
+		}
+	}
+}
+
+// after every sensor sample, good or not
+void rules_sample(int zone, int ok, uint64_t now)
+{
+	struct zone_rules *zr = &zoneRules[zone];
+
+	if(zr->count == 0)
+		return;
+	if(ok)
+	{
+		zr->lastGood = now;
+		seed_runs(zone, now);
+	}
+	evaluate(zone, now, 0);
+}
+
+// after every relay change, a run's rise is measured from here
+void rules_relay(int zone, int relay, int on, uint64_t now)
+{
+	if(zoneRules[zone].count == 0)
+		return;
+	zoneRules[zone].runSince[relay] = 0;
+	if(on && zones[zone].sensorReady)
+	{
+		zoneRules[zone].runTemp[relay] = zones[zone].temperature;
+		zoneRules[zone].runSince[relay] = now;
+	}
+	evaluate(zone, now, 1);
+}
+
+void rules_close(void)
+{
+	webhook_stop();
+	rules_clear();
+}
@@ -0,0 +1,16 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#define RULESFILE "rules.conf"
+
+int rules_load(const char *path);
+void rules_reload(const char *path);
+int rules_add(const char *text, const char *path, int line, uint64_t now);
+int rules_count(int zone);
+void rules_sample(int zone, int ok, uint64_t now);
+void rules_relay(int zone, int relay, int on, uint64_t now);
+void rules_close(void);
+
+#endif
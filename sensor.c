@@ -0,0 +1,459 @@
+/*
+ *      sensor.c:
+ *      Sensor driver registry and scheduler. Each zone lists its sensors
+ *      as "driver@argument" items; every sensor is started once per
+ *      SENSORINTERVAL and polled until its conversion is done, so slow
+ *      conversions on different sensors overlap. Bit-banged drivers are
+ *      exclusive and staggered so their timing windows never overlap.
+ *      Once every sensor in a zone has finished its conversion for the
+ *      interval, the zone's fresh readings are fused, weighted by sensor
+ *      accuracy, and the zone reports once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "control.h"
+#include "history.h"
+#include "log.h"
+#include "mqtt.h"
+#include "record.h"
+#include "rules.h"
+#include "sensor.h"
+#include "telemetry.h"
+#include "thermostat.h"
+#include "trace.h"
+
+// time between conversions on the same sensor, in ms
+#define SENSORINTERVAL 3000
+// give up on a conversion that takes longer than this
+#define SENSORTIMEOUT 2000
+// poll interval for a conversion that isn't done yet
+#define SENSORREPOLL 50
+// readings older than this don't take part in fusion
+#define SENSORSTALE (2 * SENSORINTERVAL + 1000)
+// integer fusion weights are this over the squared accuracy
+#define FUSESCALE 1000000
+
+struct sensor sensors[MAXSENSORS];
+int numSensors = 0;
+// when the zone's first sensor finished this interval, 0 before that
+static uint64_t roundStart[MAXZONES];
+
+static const struct sensor_driver *drivers[] =
+{
+	&dht22_driver, &ds18b20_driver, &bme280_driver,
+};
+
+#define NUMDRIVERS (sizeof(drivers) / sizeof(drivers[0]))
+
+const struct sensor_driver *sensor_driver(const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < NUMDRIVERS; i++)
+	{
+		if(strcmp(drivers[i]->name, name) == 0)
+			return drivers[i];
+	}
+
+	return NULL;
+}
+
+// split one "driver@argument" item and fill in the sensor, returns 0 if malformed
+static int parse_item(const char *item, struct sensor *s)
+{
+	char name[16];
+	const char *at = strchr(item, '@');
+	char *end;
+	size_t len;
+
+	if(at == NULL || at == item || (size_t)(at - item) >= sizeof(name) || at[1] == '\0')
+		return 0;
+	len = at - item;
+	memcpy(name, item, len);
+	name[len] = '\0';
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	s->pin = -1;
+	s->driver = sensor_driver(name);
+	if(s->driver == NULL)
+		return 0;
+	if(strlen(at + 1) >= sizeof(s->device))
+		return 0;
+	strcpy(s->device, at + 1);
+
+	// dht22@PIN
+	if(s->driver == &dht22_driver)
+	{
+		long pin = strtol(s->device, &end, 10);
+		if(end == s->device || *end != '\0' || pin < 0 || pin > 40)
+			return 0;
+		s->pin = pin;
+	}
+
+	// bme280@/dev/i2c-N[:ADDRESS]
+	if(s->driver == &bme280_driver)
+	{
+		char *colon = strrchr(s->device, ':');
+
+		s->address = 0x76;
+		if(colon)
+		{
+			s->address = strtol(colon + 1, &end, 0);
+			if(end == colon + 1 || *end != '\0' || s->address < 0x03 || s->address > 0x77)
+				return 0;
+			*colon = '\0';
+		}
+	}
+
+	return 1;
+}
+
+// walk a spec, calling back for each parsed sensor; returns items or -1 if malformed
+static int parse_spec(const char *spec, int (*cb)(struct sensor *s, void *arg), void *arg)
+{
+	char item[SENSORSPEC];
+	struct sensor s;
+	int count = 0;
+	size_t len;
+
+	while(*spec)
+	{
+		spec += strspn(spec, " \t,");
+		len = strcspn(spec, " \t,");
+		if(len == 0)
+			break;
+		if(len >= sizeof(item))
+			return -1;
+		memcpy(item, spec, len);
+		item[len] = '\0';
+		spec += len;
+
+		if(!parse_item(item, &s))
+			return -1;
+		if(cb && !cb(&s, arg))
+			return -1;
+		count++;
+	}
+
+	return count;
+}
+
+// empty means the zone's default dht22 on sensorPin
+int sensor_spec_valid(const char *spec)
+{
+	return parse_spec(spec, NULL, NULL) >= 0;
+}
+
+struct pin_list
+{
+	int *pins;
+	int max;
+	int count;
+};
+
+static int collect_pin(struct sensor *s, void *arg)
+{
+	struct pin_list *list = arg;
+
+	if(s->pin >= 0 && list->count < list->max)
+		list->pins[list->count++] = s->pin;
+
+	return 1;
+}
+
+// GPIO pins a spec claims, so zones can't share them
+int sensor_spec_pins(const char *spec, int *pins, int max)
+{
+	struct pin_list list = { pins, max, 0 };
+
+	if(parse_spec(spec, collect_pin, &list) < 0)
+		return -1;
+
+	return list.count;
+}
+
+static int add_sensor(struct sensor *s, void *arg)
+{
+	int zone = *(int *)arg;
+
+	if(numSensors == MAXSENSORS)
+	{
+		log_event(LVL_WARN, "sensor_dropped", "zone=%s reason=too_many_sensors", zones[zone].name);
+		return 1;
+	}
+
+	s->zone = zone;
+	if(s->driver->init && !s->driver->init(s))
+	{
+		// keep it, conversions will fail and count until the hardware shows up
+		log_event(LVL_WARN, "sensor_init_failed", "zone=%s driver=%s device=%s", zones[zone].name, s->driver->name, s->device);
+	}
+	sensors[numSensors++] = *s;
+
+	return 1;
+}
+
+// build every zone's sensors and schedule their first conversions
+int sensor_setup(void)
+{
+	char spec[SENSORSPEC];
+	uint64_t now = monotonic_ms();
+	int i, exclusive = 0, stagger = 0;
+
+	memset(roundStart, 0, sizeof(roundStart));
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+
+		if(z->sensors[0])
+			snprintf(spec, sizeof(spec), "%s", z->sensors);
+		else
+			snprintf(spec, sizeof(spec), "dht22@%d", z->sensorPin);
+
+		if(parse_spec(spec, add_sensor, &i) < 0)
+			log_event(LVL_ERROR, "sensor_spec_invalid", "zone=%s spec=%s", z->name, spec);
+	}
+
+	for(i = 0; i < numSensors; i++)
+	{
+		if(sensors[i].driver->exclusive)
+			exclusive++;
+	}
+
+	// exclusive sensors spread over the interval, the rest start together
+	for(i = 0; i < numSensors; i++)
+	{
+		struct sensor *s = &sensors[i];
+
+		s->nextStart = now + SENSORINTERVAL;
+		if(s->driver->exclusive)
+			s->nextStart += stagger++ * (SENSORINTERVAL / exclusive);
+
+		log_event(LVL_INFO, "sensor", "zone=%s driver=%s device=%s", zones[s->zone].name, s->driver->name, s->device);
+	}
+
+	return numSensors;
+}
+
+// a / b rounded to nearest, b > 0
+static long long div_round(long long a, long long b)
+{
+	return a >= 0 ? (a + b / 2) / b : -((-a + b / 2) / b);
+}
+
+// fold the zone's fresh readings into one, weighted by inverse variance,
+// returns 0 if no sensor in the zone has a fresh temperature
+static int fuse_zone(int zone, uint64_t now)
+{
+	struct zone *z = &zones[zone];
+	long long tSum = 0, tWeight = 0;
+	long hSum = 0;
+	int hCount = 0;
+	int t, h;
+	int i;
+
+	for(i = 0; i < numSensors; i++)
+	{
+		struct sensor *s = &sensors[i];
+		long long w;
+
+		if(s->zone != zone || s->lastOk == 0 || now - s->lastOk > SENSORSTALE)
+			continue;
+
+		if(s->driver->caps & CAP_TEMPERATURE)
+		{
+			w = FUSESCALE / ((long long)s->driver->accuracy * s->driver->accuracy);
+			tSum += s->last.temperature * w;
+			tWeight += w;
+		}
+		if(s->driver->caps & CAP_HUMIDITY)
+		{
+			hSum += s->last.humidity;
+			hCount++;
+		}
+	}
+
+	if(tWeight == 0)
+		return 0;
+
+	TRACE_START(start);
+
+	// tenths in, tenths out, so traces replay exactly
+	t = div_round(tSum, tWeight);
+	h = z->humidity;
+	if(hCount)
+		h = div_round(hSum, hCount);
+
+	record_sample(zone, 1, t, h);
+	control_sample(z, t, h);
+	history_add(zone, time(NULL), t, h, relay_bits(z), z->hvacOn);
+	TRACE_END(start, TR_FUSE, zone, 0);
+
+	return 1;
+}
+
+// one reading per zone and interval, a failure only if nothing in the
+// zone is fresh
+static void report_zone(int zone, uint64_t now)
+{
+	int i, ok;
+
+	for(i = 0; i < numSensors; i++)
+	{
+		if(sensors[i].zone == zone)
+			sensors[i].reported = 0;
+	}
+	roundStart[zone] = 0;
+
+	ok = fuse_zone(zone, now);
+	if(!ok)
+		record_sample(zone, 0, 0, 0);
+	telemetry_send(zone, now);
+	mqtt_sample(zone, ok, now);
+	rules_sample(zone, ok, now);
+}
+
+static void finish(struct sensor *s, int status, struct sensor_reading *r, uint64_t now)
+{
+	int i;
+
+	s->busy = 0;
+	s->reads++;
+
+	if(status != SENSOR_OK)
+	{
+		s->failures++;
+		log_event(LVL_DEBUG, "sensor_failed", "zone=%s driver=%s device=%s", zones[s->zone].name, s->driver->name, s->device);
+	}
+	else
+	{
+		s->last = *r;
+		s->lastOk = now;
+	}
+
+	s->reported = 1;
+	if(roundStart[s->zone] == 0)
+		roundStart[s->zone] = now;
+	for(i = 0; i < numSensors; i++)
+	{
+		if(sensors[i].zone == s->zone && !sensors[i].reported)
+			return;
+	}
+	report_zone(s->zone, now);
+}
+
+// called every pass of the main loop
+void sensor_service(uint64_t now)
+{
+	struct sensor_reading r;
+	int exclusiveStarted = 0;
+	int i, wait, status;
+
+	// collect finished conversions
+	for(i = 0; i < numSensors; i++)
+	{
+		struct sensor *s = &sensors[i];
+
+		if(!s->busy || now < s->pollAt)
+			continue;
+
+		TRACE_START(pollStart);
+		status = s->driver->poll(s, &r);
+		TRACE_END(pollStart, TR_SENSOR_POLL, s->zone, i);
+		if(status == SENSOR_PENDING)
+		{
+			if(now - s->startedAt > SENSORTIMEOUT)
+				finish(s, SENSOR_FAILED, &r, now);
+			else
+				s->pollAt = now + SENSORREPOLL;
+			continue;
+		}
+		finish(s, status, &r, now);
+	}
+
+	// start due conversions, at most one bit-banged read per pass
+	for(i = 0; i < numSensors; i++)
+	{
+		struct sensor *s = &sensors[i];
+
+		if(s->busy || now < s->nextStart)
+			continue;
+		if(s->driver->exclusive && exclusiveStarted)
+			continue;
+
+		s->nextStart += SENSORINTERVAL;
+		// fell behind, skip rather than read back to back
+		if(s->nextStart <= now)
+			s->nextStart = now + SENSORINTERVAL;
+
+		if(s->driver->exclusive)
+			exclusiveStarted = 1;
+
+		TRACE_START(start);
+		wait = s->driver->start(s);
+		TRACE_END(start, TR_SENSOR_START, s->zone, i);
+		if(wait < 0)
+		{
+			finish(s, SENSOR_FAILED, &r, now);
+			continue;
+		}
+		s->busy = 1;
+		s->startedAt = now;
+		s->pollAt = now + wait;
+
+		// synchronous drivers are done already
+		if(wait == 0)
+		{
+			status = s->driver->poll(s, &r);
+			if(status != SENSOR_PENDING)
+				finish(s, status, &r, now);
+		}
+	}
+
+	// a sensor that skipped its start doesn't hold the zone up past the interval
+	for(i = 0; i < numZones; i++)
+	{
+		if(roundStart[i] && now - roundStart[i] >= SENSORINTERVAL)
+			report_zone(i, now);
+	}
+	record_flush();
+}
+
+void sensor_close(void)
+{
+	int i;
+
+	for(i = 0; i < numSensors; i++)
+	{
+		if(sensors[i].driver->close)
+			sensors[i].driver->close(&sensors[i]);
+	}
+	numSensors = 0;
+}
+
+// counters and driver calibration for every sensor, as JSON
+void sensor_dump(FILE *out)
+{
+	uint64_t now = monotonic_ms();
+	int i;
+
+	fprintf(out, "{\"sensors\":[");
+	for(i = 0; i < numSensors; i++)
+	{
+		struct sensor *s = &sensors[i];
+
+		fprintf(out, "%s{\"zone\":\"%s\",\"driver\":\"%s\",\"device\":\"%s\",\"reads\":%lu,\"failures\":%lu",
+			i ? "," : "", zones[s->zone].name, s->driver->name, s->device, s->reads, s->failures);
+		if(s->lastOk)
+			fprintf(out, ",\"lastOkMs\":%llu", (unsigned long long)(now - s->lastOk));
+		if(s->driver->stats)
+			s->driver->stats(s, out);
+		fprintf(out, "}");
+	}
+	fprintf(out, "]}\n");
+}
@@ -0,0 +1,91 @@
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAXSENSORS 64
+#define SENSORDEVICE 64
+
+// what a driver can measure
+#define CAP_TEMPERATURE 1
+#define CAP_HUMIDITY 2
+#define CAP_PRESSURE 4
+
+// poll results
+enum sensor_status
+{
+	SENSOR_PENDING, SENSOR_OK, SENSOR_FAILED
+};
+
+// tenths of a degree C and of a percent, pressure in Pa
+struct sensor_reading
+{
+	int temperature;
+	int humidity;
+	long pressure;
+};
+
+struct sensor;
+
+struct sensor_driver
+{
+	const char *name;
+	int caps;
+	// accuracy in tenths of a degree C, weights the zone's fused reading
+	int accuracy;
+	// bit-banged, must never run alongside another exclusive read
+	int exclusive;
+	int (*init)(struct sensor *s);
+	// begin a conversion, returns ms until the result is worth polling or -1
+	int (*start)(struct sensor *s);
+	int (*poll)(struct sensor *s, struct sensor_reading *r);
+	void (*close)(struct sensor *s);
+	// extra JSON members for sensor_dump, each starting with a comma
+	void (*stats)(struct sensor *s, FILE *out);
+};
+
+struct sensor
+{
+	const struct sensor_driver *driver;
+	int zone;
+	// driver argument: pin number, 1-Wire id or i2c device
+	char device[SENSORDEVICE];
+	int pin;
+	int address;
+	int fd;
+	// driver private state
+	void *priv;
+	// result of a driver that converts synchronously in start()
+	struct sensor_reading result;
+	int resultStatus;
+
+	uint64_t nextStart;
+	uint64_t startedAt;
+	uint64_t pollAt;
+	int busy;
+	// finished this interval, the zone reports once all of its sensors have
+	int reported;
+	struct sensor_reading last;
+	uint64_t lastOk;
+	unsigned long reads;
+	unsigned long failures;
+};
+
+extern struct sensor sensors[MAXSENSORS];
+extern int numSensors;
+
+const struct sensor_driver *sensor_driver(const char *name);
+int sensor_spec_valid(const char *spec);
+int sensor_spec_pins(const char *spec, int *pins, int max);
+int sensor_setup(void);
+void sensor_service(uint64_t now);
+void sensor_close(void);
+void sensor_dump(FILE *out);
+void ds18b20_set_root(const char *root);
+
+extern const struct sensor_driver dht22_driver;
+extern const struct sensor_driver ds18b20_driver;
+extern const struct sensor_driver bme280_driver;
+
+#endif
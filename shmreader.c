@@ -0,0 +1,110 @@
+/*
+ *      shmreader.c:
+ *      Reader side of the shared memory state, built into
+ *      libthermostat-shm.a for local consumers. Reads are plain loads
+ *      from the mapping, only waiting for a change makes a syscall.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmstate.h"
+
+// map the daemon's segment read only, NULL if it isn't there or is a
+// layout this library doesn't know
+const struct shm_state *shm_attach(const char *name)
+{
+	struct shm_state *s;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name ? name : SHMNAME, O_RDONLY, 0);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct shm_state))
+	{
+		close(fd);
+		return NULL;
+	}
+	s = mmap(NULL, sizeof(struct shm_state), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(s == MAP_FAILED)
+		return NULL;
+
+	if(__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHMMAGIC || s->version != SHMVERSION ||
+		s->size != sizeof(struct shm_state))
+	{
+		munmap(s, sizeof(struct shm_state));
+		return NULL;
+	}
+
+	return s;
+}
+
+void shm_detach(const struct shm_state *s)
+{
+	munmap((void *)s, sizeof(struct shm_state));
+}
+
+// start of a read, waits out an update in progress
+uint32_t shm_read_begin(const struct shm_state *s)
+{
+	uint32_t seq;
+
+	while((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+
+	return seq;
+}
+
+// nonzero if the fields read since shm_read_begin may be torn
+int shm_read_retry(const struct shm_state *s, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// a consistent copy of the whole state
+void shm_read(const struct shm_state *s, struct shm_state *out)
+{
+	uint32_t seq;
+
+	do
+	{
+		seq = shm_read_begin(s);
+		memcpy(out, (const void *)s, sizeof(*out));
+	}
+	while(shm_read_retry(s, seq));
+}
+
+// sleep until changes moves on from the value given, or timeout ms pass,
+// -1 waits for ever; returns 1 on a change, 0 on timeout
+int shm_wait(const struct shm_state *s, uint32_t changes, int timeout)
+{
+	struct timespec ts, *tsp = NULL;
+
+	if(timeout >= 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	// returns at once if it already moved, a wake can't be missed
+	while(__atomic_load_n(&s->changes, __ATOMIC_ACQUIRE) == changes)
+	{
+		if(syscall(SYS_futex, &s->changes, FUTEX_WAIT, changes, tsp, NULL, 0) < 0 && errno == ETIMEDOUT)
+			return 0;
+	}
+
+	return 1;
+}
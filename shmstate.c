@@ -0,0 +1,161 @@
+/*
+ *      shmstate.c:
+ *      Publishes the live state into shared memory for local readers,
+ *      see shmstate.h for the layout and the read protocol. Updated from
+ *      the main loop whenever the state version moves, and once a second
+ *      for the sensor counters.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "control.h"
+#include "log.h"
+#include "sensor.h"
+#include "shmstate.h"
+#include "thermostat.h"
+
+#define COUNTERINTERVAL 1000
+
+typedef char shm_zones_fit[MAXZONES <= SHMZONES ? 1 : -1];
+typedef char shm_layout[sizeof(struct shm_state) == 64 + 64 * SHMZONES ? 1 : -1];
+
+static struct shm_state *shm = NULL;
+static char shmName[64];
+static unsigned long publishedVersion = 0;
+static uint64_t lastPublish = 0;
+
+int shmstate_open(const char *name)
+{
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+	{
+		log_event(LVL_WARN, "shmstate_failed", "name=%s errno=%d", name, errno);
+		return 0;
+	}
+	if(ftruncate(fd, sizeof(struct shm_state)) < 0)
+	{
+		log_event(LVL_WARN, "shmstate_failed", "name=%s errno=%d", name, errno);
+		close(fd);
+		shm_unlink(name);
+		return 0;
+	}
+	shm = mmap(NULL, sizeof(struct shm_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm == MAP_FAILED)
+	{
+		log_event(LVL_WARN, "shmstate_failed", "name=%s errno=%d", name, errno);
+		shm = NULL;
+		shm_unlink(name);
+		return 0;
+	}
+	snprintf(shmName, sizeof(shmName), "%s", name);
+
+	// a segment left by a crashed run may have readers, keep its counters going
+	if(shm->magic != SHMMAGIC || shm->version != SHMVERSION || shm->size != sizeof(struct shm_state))
+	{
+		memset(shm, 0, sizeof(struct shm_state));
+		shm->version = SHMVERSION;
+		shm->size = sizeof(struct shm_state);
+	}
+	// an update cut short by the crash leaves seq odd
+	shm->seq += shm->seq & 1;
+	shm->pid = getpid();
+	shm->running = 1;
+	__atomic_store_n(&shm->magic, SHMMAGIC, __ATOMIC_RELEASE);
+	publishedVersion = 0;
+
+	return 1;
+}
+
+static void wake_readers(void)
+{
+	__atomic_add_fetch(&shm->changes, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &shm->changes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void publish(uint64_t now)
+{
+	struct timespec ts;
+	uint32_t seq = shm->seq;
+	int i, j;
+
+	// odd, and ordered before any field is touched
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	shm->stateVersion = state_version();
+	shm->updated = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	shm->numZones = numZones;
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+		struct shm_zone *sz = &shm->zones[i];
+
+		memcpy(sz->name, z->name, sizeof(sz->name));
+		sz->temperature = z->temperature;
+		sz->humidity = z->humidity;
+		sz->heatTemp = z->heatTemp;
+		sz->coolTemp = z->coolTemp;
+		sz->offsetVal = z->offsetVal;
+		sz->unit = z->unit;
+		sz->hvacMode = z->hvacMode;
+		sz->fanMode = z->fanMode;
+		sz->sensorReady = z->sensorReady;
+		sz->hvacOn = z->hvacOn;
+		sz->relays = relay_bits(z);
+		sz->reads = sz->failures = 0;
+		for(j = 0; j < numSensors; j++)
+		{
+			if(sensors[j].zone == i)
+			{
+				sz->reads += sensors[j].reads;
+				sz->failures += sensors[j].failures;
+			}
+		}
+	}
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+	wake_readers();
+	lastPublish = now;
+}
+
+// called from the main loop
+void shmstate_update(uint64_t now)
+{
+	unsigned long version = state_version();
+
+	if(shm == NULL)
+		return;
+
+	if(version != publishedVersion || now - lastPublish >= COUNTERINTERVAL)
+	{
+		publish(now);
+		publishedVersion = version;
+	}
+}
+
+// readers still mapping the old segment see running drop and re-attach
+void shmstate_close(void)
+{
+	if(shm == NULL)
+		return;
+
+	shm->running = 0;
+	wake_readers();
+	munmap(shm, sizeof(struct shm_state));
+	shm_unlink(shmName);
+	shm = NULL;
+}
@@ -0,0 +1,88 @@
+#ifndef SHMSTATE_H
+#define SHMSTATE_H
+
+/*
+ *      Live state in POSIX shared memory, for processes on the same Pi.
+ *      Fixed layout, native byte order, every field at its natural
+ *      alignment; nothing moves within a version. Only the daemon writes.
+ *
+ *      seq is a seqlock: odd while an update is in progress. Read seq,
+ *      read the fields, read seq again, and retry if it was odd or
+ *      changed. changes is bumped after every update and doubles as a
+ *      futex word, so a reader can sleep until the next one. When the
+ *      daemon exits it clears running and bumps changes once more; the
+ *      next run creates a fresh segment, so attach again.
+ *
+ *      Build libthermostat-shm.a with make shmlib and link against it.
+ */
+
+#include <stdint.h>
+
+#define SHMNAME "/thermostat"
+// "RPSM"
+#define SHMMAGIC 0x4D535052
+#define SHMVERSION 1
+#define SHMZONES 16
+
+// relay bits
+#define SHM_BLOWER 1
+#define SHM_AC 2
+#define SHM_HEAT 4
+
+// 64 bytes
+struct shm_zone
+{
+	char name[16];
+	// tenths of a degree C and of a percent
+	int16_t temperature;
+	uint16_t humidity;
+	// tenths in the zone's unit, 0 F, 1 C
+	int16_t heatTemp;
+	int16_t coolTemp;
+	int16_t offsetVal;
+	uint8_t unit;
+	// 0 AC, 1 HEAT, 2 OFF; fan 0 ON, 1 AUTO
+	uint8_t hvacMode;
+	uint8_t fanMode;
+	uint8_t sensorReady;
+	uint8_t hvacOn;
+	uint8_t relays;
+	// sensor conversions and failures, over all of the zone's sensors
+	uint32_t reads;
+	uint32_t failures;
+	uint8_t reserved[24];
+};
+
+struct shm_state
+{
+	uint32_t magic;
+	uint16_t version;
+	// sizeof(struct shm_state)
+	uint16_t size;
+	uint32_t seq;
+	uint32_t changes;
+	// the daemon's state version, bumped on anything shown to clients
+	uint64_t stateVersion;
+	// wall clock ms of the last update
+	uint64_t updated;
+	uint32_t pid;
+	uint32_t running;
+	uint32_t numZones;
+	uint8_t reserved[20];
+	struct shm_zone zones[SHMZONES];
+};
+
+// reader library
+const struct shm_state *shm_attach(const char *name);
+void shm_detach(const struct shm_state *s);
+uint32_t shm_read_begin(const struct shm_state *s);
+int shm_read_retry(const struct shm_state *s, uint32_t seq);
+void shm_read(const struct shm_state *s, struct shm_state *out);
+int shm_wait(const struct shm_state *s, uint32_t changes, int timeout);
+
+// daemon side
+int shmstate_open(const char *name);
+void shmstate_update(uint64_t now);
+void shmstate_close(void);
+
+#endif
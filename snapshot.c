@@ -0,0 +1,245 @@
+/*
+ *      snapshot.c:
+ *      Warm start state. The last readings, relay states and control
+ *      timers live in a small memory mapped file that is refreshed in
+ *      place as the state changes and synced periodically and at exit.
+ *      A fresh snapshot lets a restarted daemon resume control at once
+ *      instead of forcing the relays off and waiting for the sensor.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "control.h"
+#include "log.h"
+#include "snapshot.h"
+#include "thermostat.h"
+
+#define SNAPSHOTMAGIC "RPSS"
+#define SNAPSHOTVERSION 3
+// older than this and the house has moved on, start cold
+#define SNAPSHOTMAXAGE (5 * 60 * 1000)
+#define SYNCINTERVAL 10000
+
+// per zone state, matched back up by name
+struct snapshot_zone
+{
+	char name[ZONENAME];
+	uint64_t relayChanged[RELAYS];
+	// tenths of a degree C and of a percent
+	int16_t temperature;
+	uint16_t humidity;
+	int8_t relays[RELAYS];
+	uint8_t sensorReady;
+	uint8_t hvacOn;
+	uint8_t pad[7];
+};
+
+// fixed layout, times are wall clock ms so they survive a reboot
+struct snapshot
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t size;
+	uint32_t checksum;
+	uint32_t numZones;
+	uint64_t savedAt;
+	struct snapshot_zone zones[MAXZONES];
+};
+
+static struct snapshot *snap = NULL;
+static int snapFd = -1;
+static unsigned long savedVersion = 0;
+static uint64_t lastSync = 0;
+
+static uint64_t wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a over everything after the checksum, catches a torn write
+static uint32_t snapshot_checksum(const struct snapshot *s)
+{
+	const unsigned char *p = (const unsigned char *)&s->numZones;
+	const unsigned char *end = (const unsigned char *)(s + 1);
+	uint32_t hash = 2166136261u;
+
+	while(p < end)
+	{
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// map the snapshot file, creating it if needed
+int snapshot_open(const char *path)
+{
+	snapFd = open(path, O_RDWR | O_CREAT, 0644);
+	if(snapFd < 0)
+	{
+		log_event(LVL_WARN, "snapshot_open_failed", "file=%s errno=%d", path, errno);
+		return 0;
+	}
+	if(ftruncate(snapFd, sizeof(struct snapshot)) < 0)
+	{
+		log_event(LVL_WARN, "snapshot_open_failed", "file=%s errno=%d", path, errno);
+		close(snapFd);
+		snapFd = -1;
+		return 0;
+	}
+
+	snap = mmap(NULL, sizeof(struct snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, snapFd, 0);
+	if(snap == MAP_FAILED)
+	{
+		log_event(LVL_WARN, "snapshot_map_failed", "file=%s errno=%d", path, errno);
+		snap = NULL;
+		close(snapFd);
+		snapFd = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+// resume from the snapshot if it is valid and fresh, returns 1 on a warm start
+int snapshot_restore(uint64_t now)
+{
+	uint64_t wall = wall_ms();
+	uint64_t age;
+	uint64_t changed[RELAYS];
+	int states[RELAYS];
+	unsigned int j;
+	int i, k;
+
+	if(snap == NULL)
+		return 0;
+
+	if(memcmp(snap->magic, SNAPSHOTMAGIC, 4) != 0 || snap->version != SNAPSHOTVERSION ||
+		snap->size != sizeof(struct snapshot) || snap->checksum != snapshot_checksum(snap) ||
+		snap->numZones > MAXZONES)
+	{
+		log_event(LVL_INFO, "snapshot_cold_start", "reason=invalid");
+		return 0;
+	}
+
+	age = wall - snap->savedAt;
+	if(snap->savedAt > wall || age > SNAPSHOTMAXAGE)
+	{
+		log_event(LVL_INFO, "snapshot_cold_start", "reason=stale age_ms=%llu", (unsigned long long)age);
+		return 0;
+	}
+
+	// every zone must have a good reading to resume, or they all start cold
+	for(i = 0; i < numZones; i++)
+	{
+		for(j = 0; j < snap->numZones; j++)
+		{
+			if(strncmp(snap->zones[j].name, zones[i].name, ZONENAME) == 0)
+				break;
+		}
+		if(j == snap->numZones || !snap->zones[j].sensorReady)
+		{
+			log_event(LVL_INFO, "snapshot_cold_start", "reason=zone zone=%s", zones[i].name);
+			return 0;
+		}
+	}
+
+	for(i = 0; i < numZones; i++)
+	{
+		struct zone *z = &zones[i];
+		struct snapshot_zone *sz = snap->zones;
+
+		while(strncmp(sz->name, z->name, ZONENAME) != 0)
+			sz++;
+
+		z->temperature = sz->temperature;
+		z->humidity = sz->humidity;
+		z->sensorReady = 1;
+		z->hvacOn = sz->hvacOn;
+		for(k = 0; k < RELAYS; k++)
+		{
+			uint64_t ago = wall - sz->relayChanged[k];
+
+			// a switch from before this boot predates the control clock
+			states[k] = sz->relays[k] > 0;
+			changed[k] = ago < now ? now - ago : 0;
+		}
+
+		control_resume(z, now, states, changed);
+	}
+
+	state_changed();
+	log_event(LVL_INFO, "snapshot_warm_start", "age_ms=%llu zones=%d", (unsigned long long)age, numZones);
+
+	return 1;
+}
+
+// refresh the mapping when state moved, sync to disk now and then
+void snapshot_update(uint64_t now)
+{
+	unsigned long version = state_version();
+	uint64_t wall;
+	int i, k;
+
+	if(snap == NULL)
+		return;
+
+	if(version != savedVersion || now - lastSync >= SYNCINTERVAL)
+	{
+		wall = wall_ms();
+		memset(snap, 0, sizeof(struct snapshot));
+		memcpy(snap->magic, SNAPSHOTMAGIC, 4);
+		snap->version = SNAPSHOTVERSION;
+		snap->size = sizeof(struct snapshot);
+		snap->numZones = numZones;
+		snap->savedAt = wall;
+		for(i = 0; i < numZones; i++)
+		{
+			struct zone *z = &zones[i];
+			struct snapshot_zone *sz = &snap->zones[i];
+
+			memcpy(sz->name, z->name, ZONENAME);
+			sz->temperature = z->temperature;
+			sz->humidity = z->humidity;
+			sz->sensorReady = z->sensorReady;
+			sz->hvacOn = z->hvacOn;
+			for(k = 0; k < RELAYS; k++)
+			{
+				sz->relays[k] = z->relays[k];
+				sz->relayChanged[k] = wall - (now - z->relayChanged[k]);
+			}
+		}
+		snap->checksum = snapshot_checksum(snap);
+		savedVersion = version;
+	}
+
+	// the page cache writes it back anyway, this bounds the loss on power cut
+	if(now - lastSync >= SYNCINTERVAL)
+	{
+		msync(snap, sizeof(struct snapshot), MS_ASYNC);
+		lastSync = now;
+	}
+}
+
+// final write at shutdown
+void snapshot_close(void)
+{
+	if(snap == NULL)
+		return;
+
+	msync(snap, sizeof(struct snapshot), MS_SYNC);
+	munmap(snap, sizeof(struct snapshot));
+	close(snapFd);
+	snap = NULL;
+	snapFd = -1;
+}
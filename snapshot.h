@@ -0,0 +1,13 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOTFILE "snapshot.bin"
+
+int snapshot_open(const char *path);
+int snapshot_restore(uint64_t now);
+void snapshot_update(uint64_t now);
+void snapshot_close(void);
+
+#endif
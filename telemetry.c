@@ -0,0 +1,257 @@
+/*
+ *      telemetry.c:
+ *      Binary telemetry datagrams, sent over UDP to a unicast or
+ *      multicast address after every sensor sample, so a fleet can be
+ *      watched without scraping each thermostat's page.
+ *
+ *      Datagram layout, version 1, big endian, TELEMETRYSIZE bytes:
+ *        0  "RPTM"        4  u8 version     5  u8 zone
+ *        6  u8 hvacMode   7  u8 fanMode     8  u32 sequence
+ *        12 u32 uptime ms 16 i16 temp C/10  18 u16 humidity/10
+ *        20 i16 heatTemp/10  22 i16 coolTemp/10  24 i16 offsetVal/10
+ *                         (setpoints in F, or C with TELEMETRY_CELSIUS)
+ *        26 u8 relay bits 27 u8 flags       28 u32 sensor reads
+ *        32 u32 sensor failures             36 u32 boot id
+ *        40 char host[16] 56 char zone[16]
+ *      The sequence counts every datagram from one sender, so a
+ *      receiver can spot gaps; it starts over with a new boot id.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "control.h"
+#include "log.h"
+#include "sensor.h"
+#include "telemetry.h"
+#include "thermostat.h"
+#include "units.h"
+
+static int telemetryFd = -1;
+static uint32_t sequence = 0;
+static uint64_t startTime;
+static uint32_t bootId;
+static char hostName[HOSTNAME];
+static unsigned long sendErrors = 0;
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xFF;
+	p[1] = v & 0xFF;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v & 0xFFFF);
+}
+
+static unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)get16(p) << 16) | get16(p + 2);
+}
+
+void telemetry_encode(const struct telemetry *t, unsigned char *buf)
+{
+	memset(buf, 0, TELEMETRYSIZE);
+	memcpy(buf, TELEMETRYMAGIC, 4);
+	buf[4] = TELEMETRYVERSION;
+	buf[5] = t->zone;
+	buf[6] = t->hvacMode;
+	buf[7] = t->fanMode;
+	put32(buf + 8, t->sequence);
+	put32(buf + 12, t->uptime);
+	put16(buf + 16, t->temperature & 0xFFFF);
+	put16(buf + 18, t->humidity);
+	put16(buf + 20, t->heatTemp & 0xFFFF);
+	put16(buf + 22, t->coolTemp & 0xFFFF);
+	put16(buf + 24, t->offsetVal & 0xFFFF);
+	buf[26] = t->relays;
+	buf[27] = t->flags;
+	put32(buf + 28, t->reads);
+	put32(buf + 32, t->failures);
+	put32(buf + 36, t->boot);
+	strncpy((char *)buf + 40, t->host, HOSTNAME);
+	strncpy((char *)buf + 56, t->zoneName, 16);
+}
+
+// names from the network end up in JSON and logs, anything but a plain
+// name character becomes '_'
+static void plain(char *s)
+{
+	for(; *s; s++)
+	{
+		if(!isalnum((unsigned char)*s) && !strchr("_-.", *s))
+			*s = '_';
+	}
+}
+
+// returns 0 for anything that isn't a version 1 datagram
+int telemetry_decode(const unsigned char *buf, size_t len, struct telemetry *t)
+{
+	if(len != TELEMETRYSIZE || memcmp(buf, TELEMETRYMAGIC, 4) != 0 || buf[4] != TELEMETRYVERSION)
+		return 0;
+
+	t->zone = buf[5];
+	t->hvacMode = buf[6];
+	t->fanMode = buf[7];
+	t->sequence = get32(buf + 8);
+	t->uptime = get32(buf + 12);
+	t->temperature = (int16_t)get16(buf + 16);
+	t->humidity = get16(buf + 18);
+	t->heatTemp = (int16_t)get16(buf + 20);
+	t->coolTemp = (int16_t)get16(buf + 22);
+	t->offsetVal = (int16_t)get16(buf + 24);
+	t->relays = buf[26];
+	t->flags = buf[27];
+	t->reads = get32(buf + 28);
+	t->failures = get32(buf + 32);
+	t->boot = get32(buf + 36);
+	memcpy(t->host, buf + 40, HOSTNAME);
+	t->host[HOSTNAME - 1] = '\0';
+	memcpy(t->zoneName, buf + 56, 16);
+	t->zoneName[15] = '\0';
+	plain(t->host);
+	plain(t->zoneName);
+
+	return 1;
+}
+
+// split "host:port", returns 0 if either part is missing
+int telemetry_address(const char *spec, struct sockaddr_in *addr)
+{
+	char host[64];
+	const char *colon = strrchr(spec, ':');
+	char *end;
+	long port;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+
+	port = strtol(colon ? colon + 1 : spec, &end, 10);
+	if(*end != '\0' || port <= 0 || port > 65535)
+		return 0;
+	addr->sin_port = htons(port);
+
+	if(colon == NULL || colon == spec)
+	{
+		addr->sin_addr.s_addr = htonl(INADDR_ANY);
+		return 1;
+	}
+	if((size_t)(colon - spec) >= sizeof(host))
+		return 0;
+	memcpy(host, spec, colon - spec);
+	host[colon - spec] = '\0';
+
+	return inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+// start sending to "address:port", multicast groups included
+int telemetry_open(const char *spec)
+{
+	struct sockaddr_in addr;
+	unsigned char ttl = 1;
+
+	if(!telemetry_address(spec, &addr) || addr.sin_addr.s_addr == htonl(INADDR_ANY))
+	{
+		printf("Bad telemetry address %s, expected address:port\n", spec);
+		return 0;
+	}
+
+	telemetryFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(telemetryFd < 0)
+	{
+		printf("Error opening telemetry socket\n");
+		return 0;
+	}
+
+	// stay on the local network, and let a receiver on this host hear it too
+	if(IN_MULTICAST(ntohl(addr.sin_addr.s_addr)))
+		setsockopt(telemetryFd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+	if(connect(telemetryFd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		printf("Error opening telemetry socket to %s\n", spec);
+		close(telemetryFd);
+		telemetryFd = -1;
+		return 0;
+	}
+
+	gethostname(hostName, sizeof(hostName));
+	hostName[HOSTNAME - 1] = '\0';
+	startTime = monotonic_ms();
+	srand(time(NULL) ^ getpid());
+	bootId = rand();
+	log_event(LVL_INFO, "telemetry", "address=%s", spec);
+
+	return 1;
+}
+
+// one datagram with the zone's latest state
+void telemetry_send(int zone, uint64_t now)
+{
+	struct zone *z = &zones[zone];
+	unsigned char buf[TELEMETRYSIZE];
+	struct telemetry t;
+	int i;
+
+	if(telemetryFd < 0)
+		return;
+
+	memset(&t, 0, sizeof(t));
+	t.boot = bootId;
+	t.sequence = sequence++;
+	t.uptime = now - startTime;
+	t.zone = zone;
+	t.hvacMode = z->hvacMode;
+	t.fanMode = z->fanMode;
+	t.temperature = z->temperature;
+	t.humidity = z->humidity;
+	t.heatTemp = z->heatTemp;
+	t.coolTemp = z->coolTemp;
+	t.offsetVal = z->offsetVal;
+	t.relays = relay_bits(z);
+	t.flags = (z->sensorReady ? TELEMETRY_READY : 0) | (z->hvacOn ? TELEMETRY_HVACON : 0) |
+		(z->unit == UNIT_C ? TELEMETRY_CELSIUS : 0);
+	for(i = 0; i < numSensors; i++)
+	{
+		if(sensors[i].zone == zone)
+		{
+			t.reads += sensors[i].reads;
+			t.failures += sensors[i].failures;
+		}
+	}
+	memcpy(t.host, hostName, HOSTNAME);
+	snprintf(t.zoneName, sizeof(t.zoneName), "%s", z->name);
+
+	telemetry_encode(&t, buf);
+
+	// nobody listening on loopback shows up as ECONNREFUSED, not worth a log line each
+	if(send(telemetryFd, buf, sizeof(buf), 0) < 0 && errno != ECONNREFUSED)
+	{
+		if(sendErrors++ == 0)
+			log_event(LVL_WARN, "telemetry_send_failed", "errno=%d", errno);
+	}
+}
+
+void telemetry_close(void)
+{
+	if(telemetryFd >= 0)
+		close(telemetryFd);
+	telemetryFd = -1;
+}
@@ -0,0 +1,56 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRYMAGIC "RPTM"
+#define TELEMETRYVERSION 1
+// fixed datagram size for this version
+#define TELEMETRYSIZE 72
+#define HOSTNAME 16
+
+// relay bitmask and flags in a datagram
+#define TELEMETRY_READY 1
+#define TELEMETRY_HVACON 2
+// setpoints are in C rather than F
+#define TELEMETRY_CELSIUS 4
+
+// one zone's state, as carried by a datagram
+struct telemetry
+{
+	// random per run, tells a restart from a late datagram
+	uint32_t boot;
+	uint32_t sequence;
+	uint32_t uptime;
+	int zone;
+	int hvacMode;
+	int fanMode;
+	// tenths of a degree C and percent
+	int temperature;
+	int humidity;
+	// tenths, in the setpoints' own unit
+	int heatTemp;
+	int coolTemp;
+	int offsetVal;
+	int relays;
+	int flags;
+	uint32_t reads;
+	uint32_t failures;
+	char host[HOSTNAME];
+	char zoneName[16];
+};
+
+struct sockaddr_in;
+
+void telemetry_encode(const struct telemetry *t, unsigned char *buf);
+int telemetry_decode(const unsigned char *buf, size_t len, struct telemetry *t);
+
+int telemetry_address(const char *spec, struct sockaddr_in *addr);
+int telemetry_open(const char *spec);
+void telemetry_send(int zone, uint64_t now);
+void telemetry_close(void);
+
+int fleet_run(const char *spec, int port);
+
+#endif
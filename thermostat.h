@@ -0,0 +1,78 @@
+#ifndef THERMOSTAT_H
+#define THERMOSTAT_H
+
+#include <stdint.h>
+
+// enum for hvac mode
+enum hvac
+{
+	AC, HEAT, OFF
+};
+
+// enum for fan mode
+enum fan
+{
+	ON, AUTO
+};
+
+// relay outputs
+enum relay
+{
+	RELAY_BLOWER, RELAY_AC, RELAY_HEAT, RELAYS
+};
+
+#define MAXZONES 16
+#define ZONENAME 16
+#define SENSORSPEC 96
+
+// sensors, one set of relays and the settings that drive them
+struct zone
+{
+	char name[ZONENAME];
+
+	// hardware, fixed once the zone is running
+	// sensor list as "driver@argument" items, empty for a dht22 on sensorPin
+	char sensors[SENSORSPEC];
+	int sensorPin;
+	int relayPins[RELAYS];
+
+	// config data, setpoints and offset in tenths of the display unit
+	int hvacMode;
+	int fanMode;
+	int unit;
+	int16_t heatTemp;
+	int16_t coolTemp;
+	int16_t offsetVal;
+
+	// fused reading from the zone's sensors, tenths of a degree C and of a percent
+	int16_t temperature;
+	uint16_t humidity;
+	int sensorReady;
+
+	// control state
+	int hvacReady;
+	int hvacOn;
+	// -1 until first written so the startup reset always reaches the pins
+	int relays[RELAYS];
+	uint64_t relayChanged[RELAYS];
+};
+
+extern struct zone zones[MAXZONES];
+extern int numZones;
+
+// settings file
+#define CONFIGFILE "config.ini"
+
+// state version, bumped whenever anything shown to clients changes
+unsigned long state_version(void);
+void state_changed(void);
+
+// relay control
+void blowerOn(struct zone *z);
+void blowerOff(struct zone *z);
+void ACOn(struct zone *z);
+void ACoff(struct zone *z);
+void HeatOn(struct zone *z);
+void HeatOff(struct zone *z);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ *      trace.c:
+ *      Span tracing for the control loop. Every thread writes fixed size
+ *      records into its own ring, so recording a span is two clock reads
+ *      and a store with no lock. trace_dump() writes whatever the rings
+ *      hold as Chrome trace JSON, which Perfetto and chrome://tracing
+ *      open directly.
+ *
+ *      Built only with -DTHERMOSTAT_TRACE, see trace.h.
+ */
+
+#ifdef THERMOSTAT_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+// records per thread, a power of two
+#define RINGSIZE 8192
+#define MAXTHREADS 16
+#define THREADNAME 16
+
+struct trace_record
+{
+	uint64_t start;
+	uint32_t duration;
+	uint8_t name;
+	uint8_t zone;
+	uint16_t arg;
+};
+
+struct trace_ring
+{
+	char name[THREADNAME];
+	int tid;
+	// records written so far, the ring holds the last RINGSIZE
+	unsigned long head;
+	struct trace_record records[RINGSIZE];
+};
+
+// span names and what their argument means
+static const char *names[TR_NAMES][2] =
+{
+	{ "dht22_read", "pin" },
+	{ "sensor_start", "sensor" },
+	{ "sensor_poll", "sensor" },
+	{ "fuse", NULL },
+	{ "control_step", NULL },
+	{ "zone_step", NULL },
+	{ "relay_write", "relay_on" },
+	{ "http_request", "post" },
+	{ "render", "json" },
+	{ "config_save", "ok" },
+	{ "command", NULL },
+	{ "idle", "events" },
+};
+
+static struct trace_ring *rings[MAXTHREADS];
+static int numRings = 0;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *ring;
+
+// ns since boot, the clock every span is measured on
+uint64_t trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// give the calling thread a ring, named for the timeline
+void trace_thread(const char *name)
+{
+	struct trace_ring *r;
+
+	if(ring)
+		return;
+
+	r = calloc(1, sizeof(*r));
+	if(r == NULL)
+		return;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&ringLock);
+	if(numRings < MAXTHREADS)
+	{
+		rings[numRings++] = r;
+		ring = r;
+	}
+	pthread_mutex_unlock(&ringLock);
+
+	if(ring != r)
+		free(r);
+}
+
+void trace_span(int name, uint64_t start, int zone, int arg)
+{
+	struct trace_record *rec;
+	uint64_t now = trace_clock();
+
+	if(ring == NULL)
+	{
+		trace_thread("thread");
+		if(ring == NULL)
+			return;
+	}
+
+	rec = &ring->records[ring->head & (RINGSIZE - 1)];
+	rec->start = start;
+	rec->duration = now - start > UINT32_MAX ? UINT32_MAX : now - start;
+	rec->name = name;
+	rec->zone = zone;
+	rec->arg = arg;
+
+	// a dump only reads records below head
+	__sync_synchronize();
+	ring->head++;
+}
+
+static void dump_ring(FILE *out, struct trace_ring *r, int *first)
+{
+	static struct trace_record copy[RINGSIZE];
+	unsigned long head, tail, i;
+	struct trace_record *rec;
+
+	head = r->head;
+	__sync_synchronize();
+	tail = head > RINGSIZE ? head - RINGSIZE : 0;
+	for(i = tail; i < head; i++)
+	{
+		copy[i & (RINGSIZE - 1)] = r->records[i & (RINGSIZE - 1)];
+	}
+	__sync_synchronize();
+
+	// the writer may have lapped the oldest records while we copied,
+	// and the slot after its head may be half written
+	if(r->head + 1 - tail > RINGSIZE)
+		tail = r->head + 1 - RINGSIZE;
+
+	fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		*first ? "" : ",\n", r->tid, r->name);
+	*first = 0;
+
+	for(i = tail; i < head; i++)
+	{
+		rec = &copy[i & (RINGSIZE - 1)];
+		if(rec->name >= TR_NAMES)
+			continue;
+
+		fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu.%03u,\"dur\":%u.%03u,\"args\":{",
+			names[rec->name][0], r->tid, (unsigned long long)(rec->start / 1000), (unsigned int)(rec->start % 1000),
+			rec->duration / 1000, rec->duration % 1000);
+		if(rec->zone != TR_NOZONE)
+			fprintf(out, "\"zone\":%u%s", rec->zone, names[rec->name][1] ? "," : "");
+		if(names[rec->name][1])
+			fprintf(out, "\"%s\":%u", names[rec->name][1], rec->arg);
+		fputs("}}", out);
+	}
+}
+
+// every ring as Chrome trace JSON, timestamps in microseconds
+void trace_dump(FILE *out)
+{
+	static pthread_mutex_t dumpLock = PTHREAD_MUTEX_INITIALIZER;
+	int i, count, first = 1;
+
+	pthread_mutex_lock(&ringLock);
+	count = numRings;
+	pthread_mutex_unlock(&ringLock);
+
+	pthread_mutex_lock(&dumpLock);
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+	for(i = 0; i < count; i++)
+	{
+		dump_ring(out, rings[i], &first);
+	}
+	fputs("\n]}\n", out);
+	pthread_mutex_unlock(&dumpLock);
+}
+
+#endif
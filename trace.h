@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// spans only exist in builds with -DTHERMOSTAT_TRACE (make TRACE=1),
+// otherwise every macro below expands to nothing
+
+#ifdef THERMOSTAT_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+
+// span names, index into the name table in trace.c
+enum trace_name
+{
+	TR_DHT22_READ, TR_SENSOR_START, TR_SENSOR_POLL, TR_FUSE, TR_CONTROL_STEP,
+	TR_ZONE_STEP, TR_RELAY_WRITE, TR_HTTP_REQUEST, TR_RENDER, TR_CONFIG_SAVE,
+	TR_COMMAND, TR_IDLE, TR_NAMES
+};
+
+// zone for spans that don't belong to one
+#define TR_NOZONE 0xFF
+
+uint64_t trace_clock(void);
+void trace_span(int name, uint64_t start, int zone, int arg);
+void trace_thread(const char *name);
+void trace_dump(FILE *out);
+
+#define TRACE_START(var) uint64_t var = trace_clock()
+#define TRACE_END(var, name, zone, arg) trace_span(name, var, zone, arg)
+#define TRACE_THREAD(name) trace_thread(name)
+
+#else
+
+#define TRACE_START(var)
+#define TRACE_END(var, name, zone, arg)
+#define TRACE_THREAD(name)
+
+#endif
+
+#endif
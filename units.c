@@ -0,0 +1,128 @@
+/*
+ *      units.c:
+ *      Temperatures are integer tenths throughout, the DHT22's own
+ *      format: readings in tenths of a degree C, setpoints and offsets in
+ *      tenths of the zone's display unit. Conversions happen only at the
+ *      edges, rounded to the nearest tenth, and setpoint comparisons are
+ *      done exactly in integers without converting at all.
+ */
+
+#include <stdio.h>
+#include <limits.h>
+
+#include "units.h"
+
+static const char *unitNames[] = { "F", "C" };
+
+const char *unit_name(int unit)
+{
+	return unitNames[unit == UNIT_C];
+}
+
+// a / b rounded to nearest, halves away from zero
+static int div_round(int a, int b)
+{
+	return a >= 0 ? (a + b / 2) / b : -((-a + b / 2) / b);
+}
+
+// a reading in tenths C to tenths of unit
+int unit_from_c(int deciC, int unit)
+{
+	if(unit == UNIT_C)
+		return deciC;
+
+	return div_round(deciC * 9, 5) + 320;
+}
+
+int unit_to_c(int deci, int unit)
+{
+	if(unit == UNIT_C)
+		return deci;
+
+	return div_round((deci - 320) * 5, 9);
+}
+
+// an absolute temperature from one unit to another
+int unit_convert(int deci, int from, int to)
+{
+	return from == to ? deci : unit_from_c(unit_to_c(deci, from), to);
+}
+
+// a difference, like the offset, from one unit to another
+int unit_convert_delta(int deci, int from, int to)
+{
+	if(from == to)
+		return deci;
+
+	return to == UNIT_C ? div_round(deci * 5, 9) : div_round(deci * 9, 5);
+}
+
+// sign of reading + offset - setpoint, compared in fifths of a tenth F so
+// nothing is rounded
+int unit_compare(int deciC, int offset, int setpoint, int unit)
+{
+	int diff;
+
+	if(unit == UNIT_C)
+		diff = deciC + offset - setpoint;
+	else
+		diff = deciC * 9 + 1600 + (offset - setpoint) * 5;
+
+	return (diff > 0) - (diff < 0);
+}
+
+// "72.5" to 725, extra decimals are rounded, returns 0 if not a number
+int unit_parse(const char *text, int *deci)
+{
+	const char *p = text;
+	long whole = 0;
+	int tenths = 0, round = 0, digits = 0, negative = 0;
+
+	if(*p == '-' || *p == '+')
+		negative = *p++ == '-';
+
+	for(; *p >= '0' && *p <= '9'; p++, digits++)
+	{
+		whole = whole * 10 + (*p - '0');
+		if(whole > SHRT_MAX)
+			return 0;
+	}
+	if(*p == '.')
+	{
+		p++;
+		if(*p >= '0' && *p <= '9')
+		{
+			tenths = *p++ - '0';
+			digits++;
+		}
+		if(*p >= '0' && *p <= '9')
+			round = *p - '0' >= 5;
+		while(*p >= '0' && *p <= '9')
+			p++;
+	}
+	if(digits == 0 || *p != '\0')
+		return 0;
+
+	whole = whole * 10 + tenths + round;
+	if(whole > SHRT_MAX)
+		return 0;
+	*deci = negative ? -whole : whole;
+
+	return 1;
+}
+
+// 725 to "72.5", buf holds at least UNITTEXT
+const char *unit_format(char *buf, int deci)
+{
+	int whole = deci / 10;
+	int tenth = deci % 10;
+
+	if(deci < 0)
+	{
+		whole = -whole;
+		tenth = -tenth;
+	}
+	snprintf(buf, UNITTEXT, "%s%d.%d", deci < 0 ? "-" : "", whole, tenth);
+
+	return buf;
+}
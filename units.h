@@ -0,0 +1,24 @@
+#ifndef UNITS_H
+#define UNITS_H
+
+#include <stddef.h>
+
+// display units, each zone's setpoints and offset are kept in its unit
+enum unit
+{
+	UNIT_F, UNIT_C
+};
+
+// room for any formatted int
+#define UNITTEXT 16
+
+const char *unit_name(int unit);
+int unit_from_c(int deciC, int unit);
+int unit_to_c(int deci, int unit);
+int unit_convert(int deci, int from, int to);
+int unit_convert_delta(int deci, int from, int to);
+int unit_compare(int deciC, int offset, int setpoint, int unit);
+int unit_parse(const char *text, int *deci);
+const char *unit_format(char *buf, int deci);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ *      watch.c:
+ *      inotify based file watcher driven by the event loop. The parent
+ *      directory is watched rather than the file, so replacing the file
+ *      by rename (as config saves and most editors do) is still seen.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "event.h"
+#include "log.h"
+#include "watch.h"
+
+#define MAXWATCHES 8
+#define WATCHMASK (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+struct watch
+{
+	int wd;
+	char path[256];
+	const char *name;
+	watch_cb cb;
+};
+
+static struct watch watches[MAXWATCHES];
+static int numWatches = 0;
+static int inotifyFd = -1;
+
+static void inotify_event_cb(int fd, short revents, void *arg)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	char *p;
+	int i;
+
+	while((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if(ev->len == 0)
+				continue;
+
+			for(i = 0; i < numWatches; i++)
+			{
+				if(watches[i].wd == ev->wd && strcmp(watches[i].name, ev->name) == 0)
+					watches[i].cb(watches[i].path);
+			}
+		}
+	}
+}
+
+int watch_init(void)
+{
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyFd < 0)
+	{
+		log_event(LVL_ERROR, "watch_init_failed", "errno=%d", errno);
+		return 0;
+	}
+
+	return event_add(inotifyFd, POLLIN, inotify_event_cb, NULL);
+}
+
+// call cb whenever path is written or replaced
+int watch_file(const char *path, watch_cb cb)
+{
+	struct watch *w;
+	char dir[256];
+	char *slash;
+
+	if(inotifyFd < 0 || numWatches == MAXWATCHES)
+		return 0;
+
+	w = &watches[numWatches];
+	snprintf(w->path, sizeof(w->path), "%s", path);
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if(slash)
+	{
+		*slash = '\0';
+		w->name = w->path + (slash - dir) + 1;
+	}
+	else
+	{
+		strcpy(dir, ".");
+		w->name = w->path;
+	}
+
+	w->wd = inotify_add_watch(inotifyFd, dir, WATCHMASK);
+	if(w->wd < 0)
+	{
+		log_event(LVL_ERROR, "watch_failed", "path=%s errno=%d", path, errno);
+		return 0;
+	}
+	w->cb = cb;
+	numWatches++;
+
+	return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+typedef void (*watch_cb)(const char *path);
+
+int watch_init(void);
+int watch_file(const char *path, watch_cb cb);
+
+#endif
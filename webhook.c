@@ -0,0 +1,182 @@
+/*
+ *      webhook.c:
+ *      JSON POSTs to local http endpoints for the rules engine. Posting
+ *      only queues the request, a background thread does the connect and
+ *      send, so a slow or dead endpoint never holds up the main loop.
+ *      When the queue is full the request is dropped and logged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "log.h"
+#include "telemetry.h"
+#include "webhook.h"
+
+#define QUEUESIZE 16
+// per connect, send and receive
+#define WEBHOOKTIMEOUT 2
+
+struct request
+{
+	struct webhook target;
+	char body[WEBHOOKBODY];
+};
+
+static struct request queue[QUEUESIZE];
+static int head = 0;
+static int count = 0;
+static int running = 0;
+static int stopping = 0;
+static pthread_t worker;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+// http://address[:port][/path], numeric addresses only so loading
+// rules never waits on DNS
+int webhook_parse(const char *url, struct webhook *w)
+{
+	char spec[80];
+	const char *host, *slash;
+	size_t len;
+
+	memset(w, 0, sizeof(*w));
+	if(strncmp(url, "http://", 7) != 0)
+		return 0;
+	host = url + 7;
+	slash = strchr(host, '/');
+	len = slash ? (size_t)(slash - host) : strlen(host);
+	if(len == 0 || len >= sizeof(w->host) || strlen(slash ? slash : "/") >= sizeof(w->path))
+		return 0;
+
+	memcpy(w->host, host, len);
+	w->host[len] = '\0';
+	snprintf(w->path, sizeof(w->path), "%s", slash ? slash : "/");
+	snprintf(spec, sizeof(spec), strchr(w->host, ':') ? "%s" : "%s:80", w->host);
+
+	return telemetry_address(spec, &w->addr) && w->addr.sin_addr.s_addr != htonl(INADDR_ANY);
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if(n <= 0)
+			return 0;
+		buf += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static void deliver(const struct request *r)
+{
+	struct timeval tv = { WEBHOOKTIMEOUT, 0 };
+	char buf[640];
+	int fd, len, status = 0;
+
+	len = snprintf(buf, sizeof(buf), "POST %s HTTP/1.0\r\nHost: %s\r\nContent-Type: application/json\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n%s", r->target.path, r->target.host, strlen(r->body), r->body);
+	// a cut off request would go out with the wrong Content-Length
+	if(len < 0 || (size_t)len >= sizeof(buf))
+	{
+		log_event(LVL_WARN, "webhook_failed", "host=%s path=%s reason=too_long", r->target.host, r->target.path);
+		return;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	errno = 0;
+	if(connect(fd, (struct sockaddr *)&r->target.addr, sizeof(r->target.addr)) == 0 && send_all(fd, buf, len))
+	{
+		len = recv(fd, buf, sizeof(buf) - 1, 0);
+		if(len > 0)
+		{
+			buf[len] = '\0';
+			sscanf(buf, "HTTP/%*s %d", &status);
+		}
+	}
+	if(status < 200 || status > 299)
+		log_event(LVL_WARN, "webhook_failed", "host=%s path=%s status=%d errno=%d", r->target.host, r->target.path, status, errno);
+	close(fd);
+}
+
+static void *worker_main(void *arg)
+{
+	struct request r;
+
+	pthread_mutex_lock(&queueLock);
+	for(;;)
+	{
+		while(count == 0 && !stopping)
+			pthread_cond_wait(&queueCond, &queueLock);
+		if(count == 0)
+			break;
+
+		r = queue[head];
+		head = (head + 1) % QUEUESIZE;
+		count--;
+		pthread_mutex_unlock(&queueLock);
+		deliver(&r);
+		pthread_mutex_lock(&queueLock);
+	}
+	pthread_mutex_unlock(&queueLock);
+
+	return NULL;
+}
+
+// queue a POST, the worker starts with the first one
+int webhook_post(const struct webhook *w, const char *body)
+{
+	struct request *r;
+
+	pthread_mutex_lock(&queueLock);
+	if(!running)
+	{
+		stopping = 0;
+		running = pthread_create(&worker, NULL, worker_main, NULL) == 0;
+	}
+	if(!running || count == QUEUESIZE)
+	{
+		pthread_mutex_unlock(&queueLock);
+		log_event(LVL_WARN, "webhook_dropped", "host=%s path=%s", w->host, w->path);
+		return 0;
+	}
+
+	r = &queue[(head + count) % QUEUESIZE];
+	r->target = *w;
+	snprintf(r->body, sizeof(r->body), "%s", body);
+	count++;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueLock);
+
+	return 1;
+}
+
+// deliver what is queued, then stop the worker
+void webhook_stop(void)
+{
+	pthread_mutex_lock(&queueLock);
+	if(!running)
+	{
+		pthread_mutex_unlock(&queueLock);
+		return;
+	}
+	stopping = 1;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueLock);
+
+	pthread_join(worker, NULL);
+	running = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef WEBHOOK_H
+#define WEBHOOK_H
+
+#include <netinet/in.h>
+
+#define WEBHOOKBODY 384
+
+// a local http endpoint
+struct webhook
+{
+	struct sockaddr_in addr;
+	char host[64];
+	char path[128];
+};
+
+int webhook_parse(const char *url, struct webhook *w);
+int webhook_post(const struct webhook *w, const char *body);
+void webhook_stop(void);
+
+#endif